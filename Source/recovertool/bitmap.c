@@ -0,0 +1,393 @@
+/* Bitmap scanning kernels for rfstool. */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <minix/config.h>
+#include <minix/const.h>
+#include <minix/type.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "bitmap.h"
+
+#define SPAN_WORDS	((int) (SPAN_BYTES / sizeof(bitchunk_t)))
+#define WORD_BITS	((int) (8 * sizeof(bitchunk_t)))
+
+#if !defined(__GNUC__) && !defined(__clang__)
+/* Index of the lowest set bit of a nonzero word. */
+int firstbit(w)
+unsigned w;
+{
+  register int i = 0;
+
+  if ((w & 0xFFFF) == 0) { w >>= 16; i += 16; }
+  if ((w & 0xFF) == 0) { w >>= 8; i += 8; }
+  if ((w & 0xF) == 0) { w >>= 4; i += 4; }
+  if ((w & 0x3) == 0) { w >>= 2; i += 2; }
+  if ((w & 0x1) == 0) i += 1;
+  return(i);
+}
+#endif
+
+/* Are the SPAN_BYTES bytes at `p' and `q' equal?  The differences of the
+ * whole span are or'ed together and tested once.
+ */
+static int spanequal(bitchunk_t *p, bitchunk_t *q)
+{
+#if defined(__AVX2__)
+  __m256i x;
+
+  x = _mm256_or_si256(
+	_mm256_xor_si256(_mm256_loadu_si256((__m256i *) p),
+			 _mm256_loadu_si256((__m256i *) q)),
+	_mm256_xor_si256(_mm256_loadu_si256((__m256i *) p + 1),
+			 _mm256_loadu_si256((__m256i *) q + 1)));
+  return(_mm256_testz_si256(x, x));
+#elif defined(__SSE2__)
+  __m128i x;
+
+  x = _mm_or_si128(
+	_mm_or_si128(_mm_xor_si128(_mm_loadu_si128((__m128i *) p),
+				   _mm_loadu_si128((__m128i *) q)),
+		     _mm_xor_si128(_mm_loadu_si128((__m128i *) p + 1),
+				   _mm_loadu_si128((__m128i *) q + 1))),
+	_mm_or_si128(_mm_xor_si128(_mm_loadu_si128((__m128i *) p + 2),
+				   _mm_loadu_si128((__m128i *) q + 2)),
+		     _mm_xor_si128(_mm_loadu_si128((__m128i *) p + 3),
+				   _mm_loadu_si128((__m128i *) q + 3))));
+  return(_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) == 0xFFFF);
+#else
+  register unsigned long *a = (unsigned long *) p, *b = (unsigned long *) q;
+  register unsigned long d = 0;
+  register int i;
+
+  for (i = 0; i < SPAN_BYTES / (int) sizeof(long); i++) d |= a[i] ^ b[i];
+  return(d == 0);
+#endif
+}
+
+/* Are the SPAN_BYTES bytes at `p' all zero? */
+static int spanzero(char *p)
+{
+#if defined(__AVX2__)
+  __m256i x;
+
+  x = _mm256_or_si256(_mm256_loadu_si256((__m256i *) p),
+		      _mm256_loadu_si256((__m256i *) p + 1));
+  return(_mm256_testz_si256(x, x));
+#elif defined(__SSE2__)
+  __m128i x;
+
+  x = _mm_or_si128(
+	_mm_or_si128(_mm_loadu_si128((__m128i *) p),
+		     _mm_loadu_si128((__m128i *) p + 1)),
+	_mm_or_si128(_mm_loadu_si128((__m128i *) p + 2),
+		     _mm_loadu_si128((__m128i *) p + 3)));
+  return(_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) == 0xFFFF);
+#else
+  register unsigned long *a = (unsigned long *) p;
+  register unsigned long d = 0;
+  register int i;
+
+  for (i = 0; i < SPAN_BYTES / (int) sizeof(long); i++) d |= a[i];
+  return(d == 0);
+#endif
+}
+
+/* Return the index of the first word at or after `from' in which the
+ * bitmaps `p' and `q' of `nwords' words differ, or `nwords' if there is
+ * none.  Identical spans are skipped SPAN_BYTES at a time.
+ */
+int mapdiff(p, q, from, nwords)
+bitchunk_t *p, *q;
+int from, nwords;
+{
+  register int i = from;
+
+  /* Single words up to a span boundary, then whole spans. */
+  for (; i < nwords && (i & (SPAN_WORDS - 1)) != 0; i++)
+	if (p[i] != q[i]) return(i);
+  for (; i + SPAN_WORDS <= nwords; i += SPAN_WORDS)
+	if (!spanequal(&p[i], &q[i])) break;
+  for (; i < nwords; i++)
+	if (p[i] != q[i]) return(i);
+  return(nwords);
+}
+
+/* Return the index of the first nonzero byte at or after `from' of the
+ * `n' bytes at `p', or `n' if there is none.  Zero spans are skipped
+ * SPAN_BYTES at a time.
+ */
+long bytescan(p, from, n)
+char *p;
+long from, n;
+{
+  register long i = from;
+
+  for (; i < n && (i & (SPAN_BYTES - 1)) != 0; i++)
+	if (p[i] != 0) return(i);
+  for (; i + SPAN_BYTES <= n; i += SPAN_BYTES)
+	if (!spanzero(&p[i])) break;
+  for (; i < n; i++)
+	if (p[i] != 0) return(i);
+  return(n);
+}
+
+/* Return the `n' bits, at most one word of them, of bitmap `map' from
+ * bit `bit' on, in the low bits of a word.  The bits need not start at a
+ * word boundary.
+ */
+bitchunk_t getbits(map, bit, n)
+bitchunk_t *map;
+long bit;
+int n;
+{
+  register int sh = (int) (bit % WORD_BITS);
+  register bitchunk_t w = map[bit / WORD_BITS] >> sh;
+
+  if (sh != 0 && sh + n > WORD_BITS)
+	w |= map[bit / WORD_BITS + 1] << (WORD_BITS - sh);
+  return(n < WORD_BITS ? w & (((bitchunk_t) 1 << n) - 1) : w);
+}
+
+/* Return the number of bits set in the `nwords' words at `p'. */
+long mapcount(p, nwords)
+bitchunk_t *p;
+int nwords;
+{
+  register long n = 0;
+  register int i;
+#if !defined(__GNUC__) && !defined(__clang__)
+  register bitchunk_t w;
+#endif
+
+  for (i = 0; i < nwords; i++) {
+#if defined(__GNUC__) || defined(__clang__)
+	n += __builtin_popcount(p[i]);
+#else
+	for (w = p[i]; w != 0; w &= w - 1) n++;
+#endif
+  }
+  return(n);
+}
+
+/* Return a word with bit i set if the 16 bit mode at the start of inode i
+ * of the `n' inodes of `size' bytes at `p' is not I_NOT_ALLOC.  The modes
+ * of four (SSE2) or eight (AVX2) inodes are compared at once.
+ */
+bitchunk_t inodesbusy(p, n, size)
+char *p;
+int n, size;
+{
+  register bitchunk_t busy = 0;
+  register int i = 0;
+#if defined(__AVX2__)
+  __m256i idx = _mm256_setr_epi32(0, size, 2 * size, 3 * size, 4 * size,
+				  5 * size, 6 * size, 7 * size);
+  __m256i mask = _mm256_set1_epi32(0xFFFF);
+  __m256i none = _mm256_set1_epi32(I_NOT_ALLOC);
+  __m256i x;
+
+  for (; i + 8 <= n; i += 8) {
+	x = _mm256_and_si256(_mm256_i32gather_epi32((int *) &p[i * size],
+						     idx, 1), mask);
+	busy |= (bitchunk_t) (~_mm256_movemask_ps(_mm256_castsi256_ps(
+			_mm256_cmpeq_epi32(x, none))) & 0xFF) << i;
+  }
+#elif defined(__SSE2__)
+  __m128i mask = _mm_set1_epi32(0xFFFF);
+  __m128i none = _mm_set1_epi32(I_NOT_ALLOC);
+  __m128i x;
+
+  for (; i + 4 <= n; i += 4) {
+	x = _mm_unpacklo_epi64(
+		_mm_unpacklo_epi32(_mm_cvtsi32_si128(*(int *) &p[i * size]),
+			_mm_cvtsi32_si128(*(int *) &p[(i + 1) * size])),
+		_mm_unpacklo_epi32(_mm_cvtsi32_si128(*(int *) &p[(i + 2) * size]),
+			_mm_cvtsi32_si128(*(int *) &p[(i + 3) * size])));
+	x = _mm_cmpeq_epi32(_mm_and_si128(x, mask), none);
+	busy |= (bitchunk_t) (~_mm_movemask_ps(_mm_castsi128_ps(x)) & 0xF) << i;
+  }
+#endif
+  for (; i < n; i++)
+	if (*(u16_t *) &p[i * size] != I_NOT_ALLOC) busy |= (bitchunk_t) 1 << i;
+  return(busy);
+}
+
+/* Allocate an empty sparse bitmap of `nbits' bits.  Return NULL if there
+ * is no memory.
+ */
+struct sbitmap *sballoc(nbits)
+long nbits;
+{
+  struct sbitmap *m;
+
+  if ((m = (struct sbitmap *) malloc(sizeof(*m))) == NULL) return(NULL);
+  m->sb_ncont = (nbits + SB_BITS - 1) / SB_BITS;
+  if ((m->sb_cont = (struct sbcont **) calloc((size_t) m->sb_ncont + 1,
+					      sizeof(*m->sb_cont))) == NULL) {
+	free((char *) m);
+	return(NULL);
+  }
+  return(m);
+}
+
+/* Return the index in the array of container `cp' of the low half `lo'
+ * of a bit, or of where it would go.
+ */
+static int sbfind(struct sbcont *cp, u16_t lo)
+{
+  register int l = 0, h = cp->sc_n, i;
+
+  while (l < h) {
+	i = (l + h) / 2;
+	if (cp->sc_array[i] < lo)
+		l = i + 1;
+	else
+		h = i;
+  }
+  return(l);
+}
+
+/* Turn the array of container `cp' into a plain bitmap. */
+static int sbdensify(struct sbcont *cp)
+{
+  register int i;
+
+  if ((cp->sc_map = (bitchunk_t *) calloc(SB_BITS / WORD_BITS,
+					   sizeof(bitchunk_t))) == NULL)
+	return(-1);
+  for (i = 0; i < cp->sc_n; i++)
+	cp->sc_map[cp->sc_array[i] / WORD_BITS] |=
+				(bitchunk_t) 1 << (cp->sc_array[i] % WORD_BITS);
+  free((char *) cp->sc_array);
+  cp->sc_array = NULL;
+  cp->sc_n = -1;
+  return(0);
+}
+
+/* Set bit `bit' of sparse bitmap `m'; bits past its end are ignored.
+ * Return -1 if there is no memory.
+ */
+int sbset(m, bit)
+struct sbitmap *m;
+long bit;
+{
+  register struct sbcont *cp;
+  register int i;
+  u16_t lo = (u16_t) (bit & (SB_BITS - 1));
+  u16_t *a;
+
+  if (bit < 0 || (bit >> SB_SHIFT) >= m->sb_ncont) return(0);
+  if ((cp = m->sb_cont[bit >> SB_SHIFT]) == NULL) {
+	if ((cp = (struct sbcont *) calloc(1, sizeof(*cp))) == NULL)
+		return(-1);
+	m->sb_cont[bit >> SB_SHIFT] = cp;
+  }
+  if (cp->sc_n < 0) {
+	cp->sc_map[lo / WORD_BITS] |= (bitchunk_t) 1 << (lo % WORD_BITS);
+	return(0);
+  }
+  i = sbfind(cp, lo);
+  if (i < cp->sc_n && cp->sc_array[i] == lo) return(0);
+  if (cp->sc_n == SB_ARRAY_MAX) {
+	if (sbdensify(cp) < 0) return(-1);
+	return(sbset(m, bit));
+  }
+  if (cp->sc_n == cp->sc_max) {
+	cp->sc_max = cp->sc_max == 0 ? 4 : 2 * cp->sc_max;
+	if (cp->sc_max > SB_ARRAY_MAX) cp->sc_max = SB_ARRAY_MAX;
+	a = (u16_t *) realloc((char *) cp->sc_array,
+			      (size_t) cp->sc_max * sizeof(u16_t));
+	if (a == NULL) return(-1);
+	cp->sc_array = a;
+  }
+  memmove(&cp->sc_array[i + 1], &cp->sc_array[i],
+	  (size_t) (cp->sc_n - i) * sizeof(u16_t));
+  cp->sc_array[i] = lo;
+  cp->sc_n++;
+  return(0);
+}
+
+/* Is bit `bit' of sparse bitmap `m' set?  Bits past its end are not. */
+int sbtest(m, bit)
+struct sbitmap *m;
+long bit;
+{
+  register struct sbcont *cp;
+  register int i;
+  u16_t lo = (u16_t) (bit & (SB_BITS - 1));
+
+  if (bit < 0 || (bit >> SB_SHIFT) >= m->sb_ncont ||
+      (cp = m->sb_cont[bit >> SB_SHIFT]) == NULL)
+	return(0);
+  if (cp->sc_n < 0)
+	return((cp->sc_map[lo / WORD_BITS] >> (lo % WORD_BITS)) & 1);
+  i = sbfind(cp, lo);
+  return(i < cp->sc_n && cp->sc_array[i] == lo);
+}
+
+/* Return the first bit set in sparse bitmap `m' at or after bit `bit', or
+ * -1 if there is none.
+ */
+long sbnext(m, bit)
+struct sbitmap *m;
+long bit;
+{
+  register struct sbcont *cp;
+  register long c;
+  register int i;
+  bitchunk_t w;
+
+  if (bit < 0) bit = 0;
+  for (c = bit >> SB_SHIFT; c < m->sb_ncont; c++, bit = c << SB_SHIFT) {
+	if ((cp = m->sb_cont[c]) == NULL) continue;
+	i = (int) (bit & (SB_BITS - 1));
+	if (cp->sc_n >= 0) {
+		i = sbfind(cp, (u16_t) i);
+		if (i < cp->sc_n) return((c << SB_SHIFT) | cp->sc_array[i]);
+		continue;
+	}
+	w = cp->sc_map[i / WORD_BITS] >> (i % WORD_BITS);
+	if (w != 0) return(bit + firstbit(w));
+	for (i = i / WORD_BITS + 1; i < SB_BITS / WORD_BITS; i++)
+		if (cp->sc_map[i] != 0)
+			return((c << SB_SHIFT) + i * WORD_BITS +
+			       firstbit(cp->sc_map[i]));
+  }
+  return(-1);
+}
+
+/* Deallocate sparse bitmap `m'. */
+void sbfree(m)
+struct sbitmap *m;
+{
+  register long i;
+  register struct sbcont *cp;
+
+  if (m == NULL) return;
+  for (i = 0; i < m->sb_ncont; i++)
+	if ((cp = m->sb_cont[i]) != NULL) {
+		if (cp->sc_array != NULL) free((char *) cp->sc_array);
+		if (cp->sc_map != NULL) free((char *) cp->sc_map);
+		free((char *) cp);
+	}
+  free((char *) m->sb_cont);
+  free((char *) m);
+}
+
+/* Name the kernel compiled in, for the benchmark. */
+char *mapkernel()
+{
+#if defined(__AVX2__)
+  return("avx2");
+#elif defined(__SSE2__)
+  return("sse2");
+#else
+  return("scalar");
+#endif
+}
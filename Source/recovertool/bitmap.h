@@ -0,0 +1,55 @@
+#ifndef __RFS_BITMAP_H__
+#define __RFS_BITMAP_H__
+
+/* Fast scanning of the bitmaps rfstool builds and loads.  The scans work
+ * on spans of SPAN_BYTES bytes at a time, with SSE2 or AVX2 when the
+ * compiler targets them and with long words otherwise.  The modes of
+ * the inodes in an inode table block and the reference counts are
+ * checked the same way.
+ */
+
+#define SPAN_BYTES	64	/* bytes compared per step */
+
+/* Sparse bitmaps, for the maps that usually have few bits set.  The bits
+ * are split in containers of SB_BITS bits.  A container holds the sorted
+ * low halves of the bits set in it, until it has more than SB_ARRAY_MAX
+ * of them and becomes a plain bitmap of SB_BITS bits.  Empty containers
+ * take no memory.
+ */
+#define SB_SHIFT	16
+#define SB_BITS		(1L << SB_SHIFT)
+#define SB_ARRAY_MAX	4096	/* bits held as an array, at most */
+
+struct sbcont {
+  int sc_n;			/* bits set, -1 once a plain bitmap */
+  int sc_max;			/* room in sc_array */
+  u16_t *sc_array;		/* low halves of the bits set, sorted */
+  bitchunk_t *sc_map;		/* or the container as a plain bitmap */
+};
+
+struct sbitmap {
+  long sb_ncont;		/* number of containers */
+  struct sbcont **sb_cont;	/* the containers, NULL if empty */
+};
+
+/* Index of the lowest set bit of a nonzero word. */
+#if defined(__GNUC__) || defined(__clang__)
+#define firstbit(w)	__builtin_ctz(w)
+#else
+_PROTOTYPE(int firstbit, (unsigned w));
+#endif
+
+_PROTOTYPE(int mapdiff, (bitchunk_t *p, bitchunk_t *q, int from,
+								int nwords));
+_PROTOTYPE(long bytescan, (char *p, long from, long n));
+_PROTOTYPE(bitchunk_t getbits, (bitchunk_t *map, long bit, int n));
+_PROTOTYPE(long mapcount, (bitchunk_t *p, int nwords));
+_PROTOTYPE(bitchunk_t inodesbusy, (char *p, int n, int size));
+_PROTOTYPE(struct sbitmap *sballoc, (long nbits));
+_PROTOTYPE(int sbset, (struct sbitmap *m, long bit));
+_PROTOTYPE(int sbtest, (struct sbitmap *m, long bit));
+_PROTOTYPE(long sbnext, (struct sbitmap *m, long bit));
+_PROTOTYPE(void sbfree, (struct sbitmap *m));
+_PROTOTYPE(char *mapkernel, (void));
+
+#endif
@@ -0,0 +1,622 @@
+/* fsbench - time rfstool on synthetic MINIX V3 file systems
+ *
+ * Usage: fsbench [-b block-size] [-z zones] [-I inodes] [-f files]
+ *		  [-d depth] [-w fanout] [-s file-size] [-F frag-percent]
+ *		  [-D damage-list] [-r rounds] [-S seed] [-o image]
+ *		  [-t tool] [-- tool-options]
+ *
+ * A file system is made in an image file: `depth' levels of `fanout'
+ * directories each, with `files' regular files spread over all of them.
+ * File sizes are drawn around `file-size' bytes.  With -F, that percentage
+ * of the zones is taken from a random place on the disk instead of the one
+ * after the last zone given out, so the zone trees get scattered.
+ *
+ * The image may then be damaged the way damage_unlink_file() in the
+ * modified MFS does it, to a random regular file:
+ *	0	the entry is removed and the link count lowered
+ *	1	the link count is lowered, the entry stays
+ *	2	the entry is removed, the link count stays
+ *	3	the link count is raised and the times of the inode cleared
+ *	4	the times of the parent directory are cleared
+ *	5	the link count of the parent directory is raised
+ * -D takes a comma separated list of these, or "none" for no damage
+ * (the default), and runs every one of them `rounds' times on a fresh
+ * image.
+ *
+ * The tool (./recoverFileSystemTool by default) is run on the image with
+ * -y all and the options after --.  For each run the wall clock time, the
+ * CPU time and the peak resident set size of the tool are reported, with
+ * the reads, system calls and bytes read that the tool prints itself.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <minix/config.h>
+#include <minix/const.h>
+#include <minix/type.h>
+#include "const.h"
+#include "inode.h"
+#include "type.h"
+#include "mfsdir.h"
+
+#define NR_DAMAGE	  6	/* damage types 0-5 */
+#define NO_DAMAGE	(-1)
+#define MAX_RUNS	 32	/* max. number of damage types in -D */
+#define MAX_ARGS	 32	/* max. number of tool options */
+#define OUTBUF		(64 * 1024)	/* tool output kept to parse */
+
+#define setbit(w, b)	((w)[(b) / FS_BITCHUNK_BITS] |= \
+				(bitchunk_t) 1 << ((b) % FS_BITCHUNK_BITS))
+#define bitset(w, b)	((w)[(b) / FS_BITCHUNK_BITS] & \
+				(bitchunk_t) 1 << ((b) % FS_BITCHUNK_BITS))
+
+/* Parameters of the file system made. */
+int block_size = 4096;
+long nzones = 64L * 1024;	/* zones, = blocks */
+long ninodes = 0;		/* 0: enough for the files and directories */
+long nfiles = 1000;
+int depth = 3;
+int fanout = 4;
+long filesize = 16 * 1024;
+int frag = 0;			/* percentage of zones placed at random */
+unsigned seed = 551;
+
+char *image = "fsbench.img";
+char *tool = "./recoverFileSystemTool";
+char *toolargs[MAX_ARGS + 4];
+int ntoolargs;
+
+/* The file system being made. */
+int fd;
+struct super_block sb;
+d2_inode *itable;		/* inode table, written at the end */
+bitchunk_t *imap, *zmap;
+long imapblocks, zmapblocks, ilistblocks, firstdata;
+long nextino;			/* next free inode */
+long zcursor;			/* zone after the last one given out */
+long nzused;
+char *blkbuf;
+
+/* Where each regular file is entered, to pick one to damage. */
+struct fent {
+  ino_t fe_ino;
+  ino_t fe_dir;
+  long fe_blk;			/* block and offset of its entry */
+  int fe_off;
+} *files;
+long nfent;
+
+/* What was measured for one run. */
+struct result {
+  double rs_wall, rs_cpu;
+  long rs_maxrss;		/* kB */
+  long rs_reads, rs_writes, rs_syscalls;
+  unsigned long long rs_rdbytes, rs_wrbytes;
+  int rs_status;
+};
+
+_PROTOTYPE(int main, (int argc, char **argv));
+_PROTOTYPE(void usage, (void));
+_PROTOTYPE(void fatal, (char *s));
+_PROTOTYPE(char *alloc, (size_t n));
+_PROTOTYPE(void rdblock, (long bno, char *buf));
+_PROTOTYPE(void wrblock, (long bno, char *buf));
+_PROTOTYPE(long bitmapblocks, (long nbits));
+_PROTOTYPE(long allocz, (void));
+_PROTOTYPE(ino_t alloci, (int mode, int nlinks));
+_PROTOTYPE(long zoneof, (d2_inode *ip, long n, int make));
+_PROTOTYPE(void enter, (ino_t dir, char *name, ino_t ino,
+			long *blk, int *off));
+_PROTOTYPE(void mkfile, (ino_t dir, char *name));
+_PROTOTYPE(ino_t mkdirent, (ino_t dir, char *name));
+_PROTOTYPE(void mkfs, (void));
+_PROTOTYPE(void writefs, (void));
+_PROTOTYPE(void damage, (int type));
+_PROTOTYPE(double now, (void));
+_PROTOTYPE(void runtool, (struct result *rp));
+_PROTOTYPE(void report, (char *what, struct result *rp, int n));
+
+void usage()
+{
+  fprintf(stderr, "Usage: fsbench [-b block-size] [-z zones] [-I inodes] [-f files]\n");
+  fprintf(stderr, "\t[-d depth] [-w fanout] [-s file-size] [-F frag-percent]\n");
+  fprintf(stderr, "\t[-D damage-list] [-r rounds] [-S seed] [-o image]\n");
+  fprintf(stderr, "\t[-t tool] [-- tool-options]\n");
+  exit(1);
+}
+
+void fatal(s)
+char *s;
+{
+  fprintf(stderr, "fsbench: %s\n", s);
+  exit(1);
+}
+
+/* Allocate some memory and zero it. */
+char *alloc(n)
+size_t n;
+{
+  char *p;
+
+  if ((p = calloc(1, n)) == NULL) fatal("out of memory");
+  return(p);
+}
+
+void rdblock(bno, buf)
+long bno;
+char *buf;
+{
+  if (pread(fd, buf, block_size, (off_t) bno * block_size) != block_size)
+	fatal("read error on image");
+}
+
+void wrblock(bno, buf)
+long bno;
+char *buf;
+{
+  if (pwrite(fd, buf, block_size, (off_t) bno * block_size) != block_size)
+	fatal("write error on image");
+}
+
+/* Number of blocks of a bit map of `nbits' bits. */
+long bitmapblocks(nbits)
+long nbits;
+{
+  long per = FS_BITS_PER_BLOCK(block_size);
+
+  return((nbits + per - 1) / per);
+}
+
+/* Give out a zone: the one after the last one given out, or with
+ * probability `frag' percent the first free one after a random zone.
+ */
+long allocz()
+{
+  long z, n;
+
+  if (nzused == nzones - firstdata) fatal("file system full");
+  z = frag > 0 && rand() % 100 < frag ?
+	firstdata + rand() % (nzones - firstdata) : zcursor;
+  for (n = 0; n < nzones; n++, z++) {
+	if (z >= nzones) z = firstdata;
+	if (!bitset(zmap, z - firstdata + 1)) break;
+  }
+  setbit(zmap, z - firstdata + 1);
+  nzused++;
+  zcursor = z + 1;
+  return(z);
+}
+
+/* Take a free inode with mode `mode' and `nlinks' links. */
+ino_t alloci(mode, nlinks)
+int mode, nlinks;
+{
+  d2_inode *ip;
+  ino_t ino;
+
+  if (nextino > ninodes) fatal("out of inodes");
+  ino = nextino++;
+  setbit(imap, ino);
+  ip = &itable[ino - 1];
+  ip->d2_mode = mode;
+  ip->d2_nlinks = nlinks;
+  ip->d2_atime = ip->d2_mtime = ip->d2_ctime = time(NULL);
+  return(ino);
+}
+
+/* Return the zone holding block `n' of the file of inode `ip', giving out
+ * it and the indirect zones leading to it if `make' is set.
+ */
+long zoneof(ip, n, make)
+d2_inode *ip;
+long n;
+int make;
+{
+  long ind = V2_INDIRECTS(block_size);
+  zone_t *slot, *zp;
+  long i, blk, z;
+  int level;
+
+  if (n < V2_NR_DZONES) {
+	if (ip->d2_zone[n] == NO_ZONE && make) ip->d2_zone[n] = allocz();
+	return(ip->d2_zone[n]);
+  }
+  n -= V2_NR_DZONES;
+  if (n < ind) {
+	slot = &ip->d2_zone[V2_NR_DZONES];
+	level = 1;
+  } else if ((n -= ind) < ind * ind) {
+	slot = &ip->d2_zone[V2_NR_DZONES + 1];
+	level = 2;
+  } else
+	fatal("file too large");
+  if (*slot == NO_ZONE) {
+	if (!make) return(NO_ZONE);
+	*slot = allocz();	/* the image is sparse, so it reads as zeros */
+  }
+  z = *slot;
+  zp = (zone_t *) blkbuf;
+  while (level-- > 0) {
+	blk = z;
+	rdblock(blk, blkbuf);
+	i = level == 1 ? n / ind : n % ind;
+	if (zp[i] == NO_ZONE) {
+		if (!make) return(NO_ZONE);
+		zp[i] = allocz();
+		wrblock(blk, blkbuf);
+	}
+	z = zp[i];
+  }
+  return(z);
+}
+
+/* Add entry `name' for `ino' to directory `dir'; return where it went. */
+void enter(dir, name, ino, blk, off)
+ino_t dir;
+char *name;
+ino_t ino;
+long *blk;
+int *off;
+{
+  d2_inode *ip = &itable[dir - 1];
+  struct direct *dp;
+  long pos = ip->d2_size;
+
+  *blk = zoneof(ip, pos / block_size, 1);
+  *off = pos % block_size;
+  rdblock(*blk, blkbuf);
+  dp = (struct direct *) &blkbuf[*off];
+  memset((void *) dp, 0, DIR_ENTRY_SIZE);
+  dp->mfs_d_ino = ino;
+  strncpy(dp->mfs_d_name, name, MFS_DIRSIZ);
+  wrblock(*blk, blkbuf);
+  ip->d2_size = pos + DIR_ENTRY_SIZE;
+}
+
+/* Make a regular file `name' in directory `dir'. */
+void mkfile(dir, name)
+ino_t dir;
+char *name;
+{
+  struct fent *fp = &files[nfent++];
+  d2_inode *ip;
+  long size, n;
+
+  fp->fe_ino = alloci(I_REGULAR | 0644, 1);
+  fp->fe_dir = dir;
+  enter(dir, name, fp->fe_ino, &fp->fe_blk, &fp->fe_off);
+  ip = &itable[fp->fe_ino - 1];
+  size = filesize > 0 ? rand() % (2 * filesize + 1) : 0;
+  for (n = 0; n * block_size < size; n++) zoneof(ip, n, 1);
+  ip->d2_size = size;
+}
+
+/* Make directory `name' in `dir'. */
+ino_t mkdirent(dir, name)
+ino_t dir;
+char *name;
+{
+  ino_t ino;
+  long blk;
+  int off;
+
+  ino = alloci(I_DIRECTORY | 0755, 2);
+  if (dir != NO_ENTRY) {
+	enter(dir, name, ino, &blk, &off);
+	itable[dir - 1].d2_nlinks++;
+  } else
+	dir = ino;
+  enter(ino, ".", ino, &blk, &off);
+  enter(ino, "..", dir, &blk, &off);
+  return(ino);
+}
+
+/* Make the file system in core and in the image. */
+void mkfs()
+{
+  long ndirs, level, width, i, j, k;
+  ino_t *dirs;
+  char name[MFS_DIRSIZ];
+
+  for (ndirs = 1, width = 1, level = 0; level < depth; level++)
+	ndirs += width *= fanout;
+  if (ninodes == 0) ninodes = ndirs + nfiles + 16;
+  imapblocks = bitmapblocks(ninodes + 1);
+  zmapblocks = bitmapblocks(nzones);
+  ilistblocks = (ninodes + V2_INODES_PER_BLOCK(block_size) - 1) /
+			V2_INODES_PER_BLOCK(block_size);
+  firstdata = START_BLOCK + imapblocks + zmapblocks + ilistblocks;
+  if (firstdata >= nzones) fatal("too few zones for the inodes");
+
+  if ((fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+	perror(image);
+	exit(1);
+  }
+  if (ftruncate(fd, (off_t) nzones * block_size) < 0) {
+	perror(image);
+	exit(1);
+  }
+  blkbuf = alloc(block_size);
+  itable = (d2_inode *) alloc((size_t) ilistblocks * block_size);
+  imap = (bitchunk_t *) alloc((size_t) imapblocks * block_size);
+  zmap = (bitchunk_t *) alloc((size_t) zmapblocks * block_size);
+  setbit(imap, 0);
+  setbit(zmap, 0);
+  nextino = ROOT_INODE;
+  zcursor = firstdata;
+  nzused = 0;
+  files = (struct fent *) alloc((size_t) (nfiles + 1) * sizeof(*files));
+  nfent = 0;
+
+  /* Directories breadth first, so each level is made in one go. */
+  dirs = (ino_t *) alloc((size_t) ndirs * sizeof(ino_t));
+  dirs[0] = mkdirent(NO_ENTRY, "");
+  for (i = 0, k = 1; i < k && k < ndirs; i++)
+	for (j = 0; j < fanout && k < ndirs; j++) {
+		sprintf(name, "d%ld", j);
+		dirs[k++] = mkdirent(dirs[i], name);
+	}
+  for (i = 0; i < nfiles; i++) {
+	sprintf(name, "f%ld", i);
+	mkfile(dirs[i % ndirs], name);
+  }
+  free((char *) dirs);
+  writefs();
+}
+
+/* Write the super block, the bit maps and the inode table. */
+void writefs()
+{
+  off_t maxsize;
+  long ind = V2_INDIRECTS(block_size);
+
+  memset((void *) &sb, 0, sizeof(sb));
+  sb.s_ninodes = ninodes;
+  sb.s_imap_blocks = imapblocks;
+  sb.s_zmap_blocks = zmapblocks;
+  /* The old field is 16 bits; 0 makes the checker compute it. */
+  sb.s_firstdatazone_old = firstdata <= 0xFFFF ? firstdata : 0;
+  sb.s_log_zone_size = 0;
+  sb.s_flags = MFSFLAG_CLEAN;
+  /* As chksuper() expects it. */
+  maxsize = MAX_FILE_POS;
+  if ((maxsize - 1) / block_size >= V2_NR_DZONES + ind + ind * ind)
+	maxsize = (V2_NR_DZONES + ind + ind * ind) * block_size;
+  sb.s_max_size = maxsize > 0 ? maxsize : LONG_MAX;
+  sb.s_zones = nzones;
+  sb.s_magic = SUPER_V3;
+  sb.s_block_size = block_size;
+  if (pwrite(fd, (char *) &sb, sizeof(sb), (off_t) SUPER_BLOCK_BYTES) !=
+							sizeof(sb) ||
+      pwrite(fd, (char *) imap, imapblocks * block_size,
+	     (off_t) START_BLOCK * block_size) != imapblocks * block_size ||
+      pwrite(fd, (char *) zmap, zmapblocks * block_size,
+	     (off_t) (START_BLOCK + imapblocks) * block_size) !=
+						zmapblocks * block_size ||
+      pwrite(fd, (char *) itable, ilistblocks * block_size,
+	     (off_t) (START_BLOCK + imapblocks + zmapblocks) * block_size) !=
+						ilistblocks * block_size)
+	fatal("write error on image");
+}
+
+/* Damage a random regular file the way damage_unlink_file() does. */
+void damage(type)
+int type;
+{
+  struct fent *fp;
+  d2_inode *ip, *dip;
+  struct direct *dp;
+
+  if (type == NO_DAMAGE) return;
+  if (nfent == 0) fatal("no files to damage");
+  fp = &files[rand() % nfent];
+  ip = &itable[fp->fe_ino - 1];
+  dip = &itable[fp->fe_dir - 1];
+  if (type == 0 || type == 2) {
+	rdblock(fp->fe_blk, blkbuf);
+	dp = (struct direct *) &blkbuf[fp->fe_off];
+	dp->mfs_d_ino = NO_ENTRY;
+	wrblock(fp->fe_blk, blkbuf);
+  }
+  switch (type) {
+      case 0:
+      case 1:
+	ip->d2_nlinks--;
+	ip->d2_ctime++;
+	break;
+      case 2:
+	ip->d2_ctime++;
+	break;
+      case 3:
+	ip->d2_nlinks++;
+	ip->d2_atime = ip->d2_mtime = ip->d2_ctime = 0;
+	break;
+      case 4:
+	dip->d2_atime = dip->d2_mtime = dip->d2_ctime = 0;
+	break;
+      case 5:
+	dip->d2_nlinks++;
+	dip->d2_ctime++;
+	break;
+  }
+  writefs();
+}
+
+/* Wall clock time in seconds. */
+double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/* Run the tool on the image and collect what it cost. */
+void runtool(rp)
+struct result *rp;
+{
+  int pfd[2], null, status;
+  char *out, *p;
+  long n = 0, r;
+  struct rusage ru;
+  double t0;
+  pid_t pid;
+
+  memset((void *) rp, 0, sizeof(*rp));
+  out = alloc(OUTBUF + 1);
+  if (pipe(pfd) < 0) fatal("can't make a pipe");
+  t0 = now();
+  if ((pid = fork()) < 0) fatal("can't fork");
+  if (pid == 0) {
+	/* No one answers questions; -y all keeps the tool from asking. */
+	if ((null = open("/dev/null", O_RDONLY)) >= 0) dup2(null, 0);
+	dup2(pfd[1], 1);
+	close(pfd[0]);
+	close(pfd[1]);
+	execv(tool, toolargs);
+	perror(tool);
+	_exit(127);
+  }
+  close(pfd[1]);
+
+  /* Keep the tail of the output; the counters come last. */
+  while ((r = read(pfd[0], out + n, OUTBUF - n)) > 0)
+	if ((n += r) == OUTBUF) {
+		memmove(out, out + OUTBUF / 2, OUTBUF / 2);
+		n = OUTBUF / 2;
+	}
+  close(pfd[0]);
+  if (wait4(pid, &status, 0, &ru) < 0) fatal("wait4 failed");
+  rp->rs_wall = now() - t0;
+  rp->rs_cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+  rp->rs_maxrss = ru.ru_maxrss;
+  rp->rs_status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+  out[n] = '\0';
+  if ((p = strstr(out, "Device: ")) != NULL)
+	sscanf(p, "Device: %ld reads, %ld writes, %ld system calls, %llu bytes read, %llu bytes written",
+	       &rp->rs_reads, &rp->rs_writes, &rp->rs_syscalls,
+	       &rp->rs_rdbytes, &rp->rs_wrbytes);
+  free(out);
+}
+
+/* Print the runs `rp[0..n-1]' of one damage type and their mean. */
+void report(what, rp, n)
+char *what;
+struct result *rp;
+int n;
+{
+  struct result m;
+  int i;
+
+  memset((void *) &m, 0, sizeof(m));
+  for (i = 0; i < n; i++) {
+	printf("%-8s %2d %9.3f %9.3f %9ld %9ld %9ld %12llu %12llu %4d\n",
+	       what, i + 1, rp[i].rs_wall, rp[i].rs_cpu, rp[i].rs_maxrss,
+	       rp[i].rs_reads, rp[i].rs_syscalls, rp[i].rs_rdbytes,
+	       rp[i].rs_wrbytes, rp[i].rs_status);
+	m.rs_wall += rp[i].rs_wall;
+	m.rs_cpu += rp[i].rs_cpu;
+	if (rp[i].rs_maxrss > m.rs_maxrss) m.rs_maxrss = rp[i].rs_maxrss;
+	m.rs_reads += rp[i].rs_reads;
+	m.rs_syscalls += rp[i].rs_syscalls;
+	m.rs_rdbytes += rp[i].rs_rdbytes;
+	m.rs_wrbytes += rp[i].rs_wrbytes;
+  }
+  printf("%-8s %2s %9.3f %9.3f %9ld %9ld %9ld %12llu %12llu\n",
+	 what, "av", m.rs_wall / n, m.rs_cpu / n, m.rs_maxrss,
+	 m.rs_reads / n, m.rs_syscalls / n, m.rs_rdbytes / n,
+	 m.rs_wrbytes / n);
+}
+
+int main(argc, argv)
+int argc;
+char **argv;
+{
+  int types[MAX_RUNS], ntypes = 0, rounds = 3, i, r, c;
+  struct result *res;
+  char what[16], *p;
+
+  while ((c = getopt(argc, argv, "b:z:I:f:d:w:s:F:D:r:S:o:t:")) != -1) {
+	switch (c) {
+	    case 'b':	block_size = atoi(optarg);	break;
+	    case 'z':	nzones = atol(optarg);		break;
+	    case 'I':	ninodes = atol(optarg);		break;
+	    case 'f':	nfiles = atol(optarg);		break;
+	    case 'd':	depth = atoi(optarg);		break;
+	    case 'w':	fanout = atoi(optarg);		break;
+	    case 's':	filesize = atol(optarg);	break;
+	    case 'F':	frag = atoi(optarg);		break;
+	    case 'r':	rounds = atoi(optarg);		break;
+	    case 'S':	seed = atoi(optarg);		break;
+	    case 'o':	image = optarg;			break;
+	    case 't':	tool = optarg;			break;
+	    case 'D':
+		for (p = strtok(optarg, ","); p != NULL && ntypes < MAX_RUNS;
+						p = strtok(NULL, ",")) {
+			if (strcmp(p, "none") == 0)
+				types[ntypes++] = NO_DAMAGE;
+			else if ((c = atoi(p)) >= 0 && c < NR_DAMAGE &&
+				 p[0] >= '0' && p[0] <= '9')
+				types[ntypes++] = c;
+			else
+				usage();
+		}
+		break;
+	    default:
+		usage();
+	}
+  }
+  if (block_size < _MIN_BLOCK_SIZE || block_size % 512 != 0 ||
+      nzones <= 0 || nfiles < 0 || depth < 0 || fanout < 1 ||
+      frag < 0 || frag > 100 || rounds < 1)
+	usage();
+  if (ntypes == 0) types[ntypes++] = NO_DAMAGE;
+
+  toolargs[ntoolargs++] = tool;
+  toolargs[ntoolargs++] = "-y";
+  toolargs[ntoolargs++] = "all";
+  for (i = optind; i < argc && ntoolargs < MAX_ARGS; i++)
+	toolargs[ntoolargs++] = argv[i];
+  toolargs[ntoolargs++] = image;
+  toolargs[ntoolargs] = NULL;
+
+  printf("block size %d, %ld zones, %ld files, depth %d, fanout %d, file size %ld, %d%% fragmented\n",
+	 block_size, nzones, nfiles, depth, fanout, filesize, frag);
+  printf("%-8s %2s %9s %9s %9s %9s %9s %12s %12s %4s\n", "damage", "#",
+	 "wall s", "cpu s", "maxrss kB", "reads", "syscalls", "bytes read",
+	 "written", "exit");
+  res = (struct result *) alloc((size_t) rounds * sizeof(struct result));
+  for (i = 0; i < ntypes; i++) {
+	for (r = 0; r < rounds; r++) {
+		/* The same image every round, so the rounds can be compared. */
+		srand(seed);
+		mkfs();
+		damage(types[i]);
+		close(fd);
+		free(blkbuf);
+		free((char *) itable);
+		free((char *) imap);
+		free((char *) zmap);
+		free((char *) files);
+		runtool(&res[r]);
+	}
+	if (types[i] == NO_DAMAGE)
+		strcpy(what, "none");
+	else
+		sprintf(what, "type %d", types[i]);
+	report(what, res, rounds);
+  }
+  free((char *) res);
+  return(0);
+}
@@ -0,0 +1,121 @@
+/* mapbench - compare the bitmap check of rfstool with the old loop
+ *
+ * Usage: mapbench [bits [differences [rounds]]]
+ *
+ * Two bitmaps of `bits' bits that differ in `differences' random bits are
+ * compared with the word by word, bit by bit loop chkmap() used to have,
+ * and with mapdiff() and firstbit().  Both must find the same bits.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <minix/config.h>
+#include <minix/const.h>
+#include <minix/type.h>
+
+#include "bitmap.h"
+
+#define WORDBITS	((int) (8 * sizeof(bitchunk_t)))
+
+_PROTOTYPE(int main, (int argc, char **argv));
+_PROTOTYPE(long oldloop, (bitchunk_t *p, bitchunk_t *q, int w));
+_PROTOTYPE(long newloop, (bitchunk_t *p, bitchunk_t *q, int w));
+_PROTOTYPE(double now, (void));
+
+/* The loop of the old chkmap()/chkword(); returns the sum of the numbers
+ * of the differing bits so both loops can be compared.
+ */
+long oldloop(p, q, w)
+bitchunk_t *p, *q;
+int w;
+{
+  unsigned w1, w2;
+  long bit = 0, sum = 0;
+  long b;
+
+  do {
+	if (*p != *q)
+		for (w1 = *p, w2 = *q, b = bit; (w1 | w2);
+						w1 >>= 1, w2 >>= 1, b++)
+			if ((w1 ^ w2) & 1) sum += b;
+	p++;
+	q++;
+	bit += WORDBITS;
+  } while (--w > 0);
+  return(sum);
+}
+
+/* The loop of the current chkmap()/chkword(). */
+long newloop(p, q, w)
+bitchunk_t *p, *q;
+int w;
+{
+  register int i;
+  register unsigned d;
+  long sum = 0;
+
+  for (i = 0; (i = mapdiff(p, q, i, w)) < w; i++)
+	for (d = p[i] ^ q[i]; d != 0; d &= d - 1)
+		sum += (long) i * WORDBITS + firstbit(d);
+  return(sum);
+}
+
+/* Wall clock time in seconds. */
+double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+int main(argc, argv)
+int argc;
+char **argv;
+{
+  long bits = argc > 1 ? atol(argv[1]) : 64L * 1024 * 1024;
+  long ndiff = argc > 2 ? atol(argv[2]) : 100;
+  int rounds = argc > 3 ? atoi(argv[3]) : 20;
+  int w = (bits + WORDBITS - 1) / WORDBITS;
+  bitchunk_t *p, *q;
+  long i, b, s1 = 0, s2 = 0;
+  double t0, t1, t2;
+  long (*volatile fold)() = oldloop;	/* keep the rounds from being */
+  long (*volatile fnew)() = newloop;	/* folded into one */
+
+  if ((p = malloc(w * sizeof(*p))) == NULL ||
+      (q = malloc(w * sizeof(*q))) == NULL) {
+	fprintf(stderr, "mapbench: out of memory\n");
+	return(1);
+  }
+  srand(551);
+  for (i = 0; i < w; i++) p[i] = rand() ^ ((bitchunk_t) rand() << 16);
+  memcpy(q, p, w * sizeof(*p));
+  for (i = 0; i < ndiff; i++) {
+	/* Two 16 bit draws, so nothing overflows a 32 bit long. */
+	b = (((unsigned long) (rand() & 0xFFFF) << 16 | (rand() & 0xFFFF)) %
+	     ((unsigned long) w * WORDBITS));
+	q[b / WORDBITS] ^= (bitchunk_t) 1 << (b % WORDBITS);
+  }
+
+  t0 = now();
+  for (i = 0; i < rounds; i++) s1 += (*fold)(p, q, w);
+  t1 = now();
+  for (i = 0; i < rounds; i++) s2 += (*fnew)(p, q, w);
+  t2 = now();
+
+  printf("%ld bits, %ld differences, %d rounds, kernel %s\n",
+	 (long) w * WORDBITS, ndiff, rounds, mapkernel());
+  printf("old loop: %8.3f ms/round, %8.1f MB/s\n",
+	 (t1 - t0) * 1000 / rounds, 2.0 * w * sizeof(*p) * rounds / (t1 - t0) / 1e6);
+  printf("mapdiff:  %8.3f ms/round, %8.1f MB/s\n",
+	 (t2 - t1) * 1000 / rounds, 2.0 * w * sizeof(*p) * rounds / (t2 - t1) / 1e6);
+  if (s1 != s2) {
+	printf("MISMATCH: old loop found %ld, mapdiff %ld\n", s1, s2);
+	return(1);
+  }
+  return(0);
+}
@@ -14,9 +14,12 @@
 *   and failed due to a bug in the ACK C compiler.  Use mkfs instead!
 */
 
+#define _GNU_SOURCE		/* for O_DIRECT on Linux */
 #include <sys/types.h>
 #include <ctype.h>
 #include <errno.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stdlib.h>
@@ -33,21 +36,42 @@
 #include <minix/fslib.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#if defined(__linux__) && !defined(NO_URING)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_URING
+#endif
 #include <a.out.h>
 #include <tools.h>
 #include <dirent.h>
 
 #include "exitvalues.h"
+#include "bitmap.h"
 
 #undef N_DATA
 
-unsigned int fs_version = 2, block_size = 0;
-
 #define BITSHIFT	  5	/* = log2(#bits(int)) */
 
 #define MAXPRINT	  80	/* max. number of error lines in chkmap */
-#define CINDIR		128	/* number of indirect zno's read at a time */
-#define CDIRECT		  1	/* number of dir entries read at a time */
+#define CINDIR		128	/* indirect zno's checked between size checks */
+
+#define CACHE_WAYS	  4	/* blocks per set in the block cache */
+#define CACHE_BLOCKS	256	/* default number of blocks in the cache */
+#define RA_MAX		 32	/* max. number of blocks read ahead */
+#define ILIST_CHUNK	 64	/* inode table blocks read at a time */
+#define QUEUE_MAX	4096	/* max. io_uring queue depth */
+#define DIRECT_ALIGN	4096	/* alignment of O_DIRECT transfers */
+#define DIRTY_HASH	 256	/* first number of hash chains of repairs */
+#define DIRTY_CHAIN	   2	/* mean chain length that doubles them */
+#define DIRTY_MAX	1024	/* max. repaired blocks held back */
+#define BIGCNT_HASH	1024	/* hash chains of the overflowing counts */
+#define NR_WORKERS	 64	/* max. number of prefetch threads */
+#define DEQUE_SIZE	1024	/* max. prefetch tasks queued per thread */
 
 /* Macros for handling bitmaps.  Now bit_t is long, these are bulky and the
  * type demotions produce a lot of lint.  The explicit demotion in POWEROFBIT
@@ -70,14 +94,13 @@ unsigned int fs_version = 2, block_size = 0;
 #define INODE_CT	 95	/* default inodes (when making file system) */
 
 #include "super.h"
-static struct super_block sb;
 
-#define INODES_PER_BLOCK V2_INODES_PER_BLOCK(block_size)
+#define INODES_PER_BLOCK V2_INODES_PER_BLOCK(fs->fs_block_size)
 #define INODE_SIZE ((int) V2_INODE_SIZE)
-#define WORDS_PER_BLOCK (block_size / (int) sizeof(bitchunk_t))
-#define MAX_ZONES (V2_NR_DZONES+V2_INDIRECTS(block_size)+(long)V2_INDIRECTS(block_size)*V2_INDIRECTS(block_size))
+#define WORDS_PER_BLOCK (fs->fs_block_size / (int) sizeof(bitchunk_t))
+#define MAX_ZONES (V2_NR_DZONES+V2_INDIRECTS(fs->fs_block_size)+(long)V2_INDIRECTS(fs->fs_block_size)*V2_INDIRECTS(fs->fs_block_size))
 #define NR_DZONE_NUM V2_NR_DZONES
-#define NR_INDIRECTS V2_INDIRECTS(block_size)
+#define NR_INDIRECTS V2_INDIRECTS(fs->fs_block_size)
 #define NR_ZONE_NUMS V2_NR_TZONES
 #define ZONE_NUM_SIZE V2_ZONE_NUM_SIZE
 #define bit_nr bit_t
@@ -96,16 +119,17 @@ static struct super_block sb;
 /* Ztob gives the block address of a zone
  * btoa64 gives the byte address of a block
  */
-#define ztob(z)		((block_nr) (z) << sb.s_log_zone_size)
-#define btoa64(b)	(mul64u(b, block_size))
+#define ztob(z)		((block_nr) (z) << fs->fs_sb.s_log_zone_size)
+#define btoa64(b)	(mul64u(b, fs->fs_block_size))
 #define SCALE		((int) ztob(1))	/* # blocks in a zone */
-#define FIRST		((zone_nr) sb.s_firstdatazone)	/* as the name says */
+#define FIRST		((zone_nr) fs->fs_sb.s_firstdatazone)	/* as the name says */
 
 /* # blocks of each type */
-#define N_IMAP		(sb.s_imap_blocks)
-#define N_ZMAP		(sb.s_zmap_blocks)
-#define N_ILIST		((sb.s_ninodes+INODES_PER_BLOCK-1) / INODES_PER_BLOCK)
-#define N_DATA		(sb.s_zones - FIRST)
+#define N_IMAP		(fs->fs_sb.s_imap_blocks)
+#define N_ZMAP		(fs->fs_sb.s_zmap_blocks)
+#define N_ILIST		\
+	((fs->fs_sb.s_ninodes+INODES_PER_BLOCK-1) / INODES_PER_BLOCK)
+#define N_DATA		(fs->fs_sb.s_zones - FIRST)
 
 /* Block address of each type */
 #define OFFSET_SUPER_BLOCK	SUPER_BLOCK_BYTES
@@ -113,50 +137,513 @@ static struct super_block sb;
 #define BLK_ZMAP	(BLK_IMAP  + N_IMAP)
 #define BLK_ILIST	(BLK_ZMAP  + N_ZMAP)
 #define BLK_FIRST	ztob(FIRST)
-#define ZONE_SIZE	((int) ztob(block_size))
+#define ZONE_SIZE	((int) ztob(fs->fs_block_size))
 #define NLEVEL		(NR_ZONE_NUMS - NR_DZONE_NUM + 1)
 
-/* Byte address of a zone */
-#define INDCHUNK	((int) (CINDIR * ZONE_NUM_SIZE))
-#define DIRCHUNK	((int) (CDIRECT * DIR_ENTRY_SIZE))
-
-char *prog, *fsck_device;		/* program name (fsck), device name */
-int firstcnterr;		/* is this the first inode ref cnt error? */
-bitchunk_t *imap, *spec_imap;	/* inode bit maps */
-bitchunk_t *zmap, *spec_zmap;	/* zone bit maps */
-bitchunk_t *dirmap;		/* directory (inode) bit map */
-char *rwbuf;			/* one block buffer cache */
-block_nr thisblk;		/* block in buffer cache */
-char *nullbuf;	/* null buffer */
-nlink_t *count;			/* inode count */
-int changed;			/* has the diskette been written to? */
+char *prog;			/* program name (fsck) */
+
+/* A read of `rq_n' consecutive blocks from `rq_bno' on, one of a batch
+ * given to devbatch().
+ */
+struct ioreq {
+  block_nr rq_bno;
+  struct iovec *rq_iov;		/* one buffer per block, or one in all */
+  int rq_n;			/* number of buffers in rq_iov */
+  int rq_got;			/* number of whole blocks read */
+};
+
+#ifdef HAVE_URING
+/* An io_uring and its mapped queues. */
+struct uring {
+  int ur_fd;
+  unsigned ur_entries;		/* size of the submission queue */
+  unsigned *ur_sqhead, *ur_sqtail, *ur_sqmask, *ur_sqarray;
+  unsigned *ur_cqhead, *ur_cqtail, *ur_cqmask;
+  struct io_uring_sqe *ur_sqes;
+  struct io_uring_cqe *ur_cqes;
+  char *ur_sqmap, *ur_cqmap;
+  size_t ur_sqsize, ur_cqsize;
+};
+#endif
+
+/* Reference counts.  Nearly every count stays within a few links of 0, so
+ * each inode has a byte; a count that doesn't fit in it is kept in a hash
+ * table instead, and its byte is set to CNT_OVER.
+ */
+#define CNT_OVER	SCHAR_MIN
+
+struct bigcnt {
+  ino_t bc_ino;
+  int bc_count;
+  struct bigcnt *bc_next;
+};
+
+/* A repaired block not written yet.  Repairs are collected in these, and
+ * written in block order at the end of each phase.
+ */
+struct dblock {
+  block_nr db_blk;
+  struct dblock *db_next;	/* next in its hash chain */
+  char *db_data;
+};
+
+struct cblock {
+  block_nr cb_blk;		/* block held by this slot, NO_BLOCK if none */
+  unsigned long cb_used;	/* LRU stamp of the last access */
+  char *cb_data;
+};
+int cacheblocks = CACHE_BLOCKS;	/* number of blocks in each cache (-c) */
+int qdepth;			/* reads kept in flight by io_uring (-Q) */
+
+/* The zone trees of the files met in a directory are walked by a pool
+ * of threads ahead of the checker, loading their indirect and directory
+ * blocks into the cache.  The checker itself stays serial, so what it
+ * prints and repairs does not depend on the number of threads.  Every
+ * thread has a deque of tasks; it works from the bottom of its own deque
+ * and steals from the top of the others when it runs dry.  One pool
+ * serves all devices checked; a task names the check it belongs to.
+ */
+struct task {
+  struct fsck *tk_fs;		/* check the task belongs to */
+  zone_nr tk_zone;		/* zone to load, NO_ZONE to load an inode */
+  ino_t tk_ino;			/* inode to load */
+  char tk_level;		/* level of indirection of tk_zone */
+  char tk_data;			/* load the data zones below tk_zone? */
+};
+
+struct worker {
+  pthread_t w_thread;
+  pthread_mutex_t w_lock;	/* protects the deque */
+  unsigned w_top, w_bottom;	/* steal at the top, push/pop at the bottom */
+  struct task w_deque[DEQUE_SIZE];
+  char *w_buf;			/* one block buffer */
+  int w_bufsize;		/* its size, the largest block size met */
+  long w_steals;		/* number of tasks stolen by this thread */
+} *workers;
+int nworkers;			/* number of prefetch threads, 0 if none */
+int poolwork;			/* number of tasks queued, not yet claimed */
+unsigned poolgen;		/* number of tasks queued so far */
+int nstarved;			/* threads waiting for the task they claimed */
+int poolquit;			/* tells the threads to stop */
+pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t poolcond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t starvecond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t draincond = PTHREAD_COND_INITIALIZER;
+
+#define LOCK(m)		do { if (nworkers) pthread_mutex_lock(m); } while (0)
+#define UNLOCK(m)	do { if (nworkers) pthread_mutex_unlock(m); } while (0)
+int useitable;			/* read the inode table before the tree? */
+
+/* The path to the file being checked is kept as a list of frames, from
+ * the file up to the root.  Directories get a frame on the heap that lives
+ * until all their zones have been checked and all frames of their
+ * subdirectories are gone; other files get a frame on the C stack.
+ */
 struct stack {
   dir_struct *st_dir;
   struct stack *st_next;
   char st_presence;
-} *ftop;
+  char st_done;			/* has finishdir() been called? */
+  char st_walked;		/* has chkdirectory() been called? */
+  int st_ok;			/* result of chkinode() */
+  int st_pending;		/* zones of the directory still queued */
+  int st_refs;			/* frames of subdirectories still alive */
+  block_nr st_entblk;		/* where the entry is in the parent, */
+  int st_entoff;		/* for removing the directory */
+  dir_struct st_ent;		/* copy of the entry for the directory */
+  d_inode st_inode;		/* the inode of the directory */
+  unsigned st_mark;		/* checkpoint that numbered the frame, */
+  long st_index;		/* and its number in it */
+};
+
+/* Directory zones waiting to be checked, in a heap ordered on zone number
+ * so they are visited in disk order.
+ */
+struct work {
+  zone_nr wk_zone;		/* directory zone to check */
+  off_t wk_pos;			/* its position in the directory */
+  struct stack *wk_dir;		/* frame of the directory */
+};
+
+int usemmap;			/* map the image instead of reading it? */
+int directio;			/* bypass the page cache with O_DIRECT? */
 
-int dev;			/* file descriptor of the device */
+#define MISALIGNED(x)	((unsigned long) (x) & (DIRECT_ALIGN - 1))
 
 #define DOT	1
 #define DOTDOT	2
 
-/* Counters for each type of inode/zone. */
-int nfreeinode, nregular, ndirectory, nblkspec, ncharspec, nbadinode;
-int nsock, npipe, nsyml, ztype[NLEVEL];
-long nfreezone;
-
-int repair, notrepaired = 0, automatic, listing, listsuper = 1;	/* flags */
+int repair, automatic, listing, listsuper = 1;	/* flags */
 int preen = 0, markdirty = 0;
-int firstlist;			/* has the listing header been printed? */
 unsigned part_offset;		/* sector offset for this partition */
 char answer[] = "Answer questions with y or n.  Then hit RETURN";
 
+/* Repair classes.  What is done about each class can be decided up front
+ * with -y, -n and -p; undecided classes are asked about as before.
+ */
+#define R_DOTS		0	/* bad . or .. entry */
+#define R_COUNT		1	/* wrong link count */
+#define R_ENTRY		2	/* bad directory entry */
+#define R_INODE		3	/* bad inode in the tree */
+#define R_CLEAR		4	/* free inode not cleared */
+#define R_MAP		5	/* inode or zone bit map differs */
+#define R_TIME		6	/* corrupted inode times */
+#define R_SIZE		7	/* wrong directory or symbolic link size */
+#define NR_RCLASS	8
+
+#define P_DEFAULT	0	/* ask, unless automatic is set */
+#define P_YES		1	/* always repair */
+#define P_NO		2	/* never repair */
+#define P_ASK		3	/* always ask */
+
+char *rclassname[NR_RCLASS] = {
+  "dots", "count", "entry", "inode", "clear", "map", "time", "size"
+};
+char *policyname[] = { "default", "yes", "no", "ask" };
+int policy[NR_RCLASS];		/* what to do about each repair class */
+FILE *replog;			/* log of repair decisions, if any */
+
+/* Phases of a check.  The time each takes and the work done in it are
+ * printed at the end, and saved in the statistics file of -S.
+ */
+#define PH_SETUP	0	/* super block and inode table */
+#define PH_TREE		1
+#define PH_ZMAP		2
+#define PH_COUNT	3
+#define PH_IMAP		4
+#define PH_ILIST	5
+#define PH_JOURNAL	6
+#define PH_TRIAGE	7
+#define NR_PHASE	8
+
+char *phasename[NR_PHASE] = {
+  "setup", "tree", "zone map", "counts", "inode map", "inode list", "journal",
+  "triage"
+};
+
+struct phase {
+  double ph_wall, ph_cpu;	/* seconds */
+  long ph_reads, ph_writes;	/* device transfers */
+  u64_t ph_rdbytes, ph_wrbytes;
+  long ph_hits, ph_misses;	/* block cache */
+  long ph_inodes, ph_zones;	/* inodes and zones checked */
+};
+
+FILE *statfile;			/* statistics file, if any (-S) */
+int nstats;			/* checks saved in it */
+pthread_mutex_t statlock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Progress report.  A thread of its own looks at the counters of the
+ * checks running every PROGRESS_SECS seconds, so the checks don't spend
+ * any time on it.  The counters it reads are set with relaxed atomic
+ * stores, which cost what plain ones do.
+ */
+#define PROGRESS_SECS	1
+
+#if defined(__GNUC__) || defined(__clang__)
+#define PSET(c, v)	__atomic_store_n(&(c), (v), __ATOMIC_RELAXED)
+#define PGET(c)		__atomic_load_n(&(c), __ATOMIC_RELAXED)
+#else
+#define PSET(c, v)	((c) = (v))
+#define PGET(c)		(c)
+#endif
+#define PADD(c, n)	PSET(c, (c) + (n))
+
+int showprogress;		/* print the progress on stderr (-v) */
+char *statusfile;		/* rewrite it with the progress (-s) */
+int progress;			/* either of them */
+struct fsck *checks;		/* checks running */
+int nfinished;			/* checks done */
+int progstop;			/* stop the progress thread */
+pthread_t progthread;
+pthread_mutex_t proglock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t progcond = PTHREAD_COND_INITIALIZER;
+
+/* Check journal.  After a clean run, the bit maps, a record of every inode,
+ * the entries of all directories but . and .., and the zones owned by each
+ * inode are saved.  A later run rechecks only the inodes whose record has
+ * changed and the directories they are entered in.  Its totals are taken
+ * from the inode table and the zones saved, with their level.
+ */
+#define JNL_MAGIC	0x4a534652L	/* "RFSJ" */
+#define JNL_VERSION	2
+#define FNV_BASIS	2166136261UL
+#define FNV_PRIME	16777619UL
+
+/* Undo log.  Before repaired blocks are written, what they held is
+ * appended to the log, one record per run of adjacent blocks, and the log
+ * is synced once for all of them.  A rollback writes the records back
+ * from the last to the first, so each block gets the oldest contents
+ * logged for it.  A record whose sum doesn't match ends the log.  A patch
+ * saved by -O has the same records, but holds the repaired blocks.  Both
+ * have the hash of the super block, and each record the hash of what its
+ * blocks must hold on the device when it is used: what a patch replaces,
+ * or what the repairs an undo log undoes left.  So a log is only used on
+ * the device it was made for, as it was left.
+ */
+#define UNDO_MAGIC	0x55534652L	/* "RFSU" */
+#define PATCH_MAGIC	0x50534652L	/* "RFSP": a patch saved by -O */
+#define UNDO_VERSION	3
+
+struct uheader {
+  u32_t uh_magic;
+  u32_t uh_version;
+  u32_t uh_blocksize;
+  u32_t uh_super;		/* hash of the super block */
+};
+
+struct urecord {
+  u32_t ur_magic;
+  u32_t ur_block;		/* first block of the run */
+  u32_t ur_nblk;		/* blocks that follow the record */
+  u32_t ur_dev;			/* hash of what they must hold */
+  u32_t ur_sum;			/* hash of the record with ur_sum 0 and
+				 * of the blocks */
+};
+
+struct jheader {
+  u32_t jh_magic;
+  u32_t jh_version;
+  u32_t jh_ninodes;		/* geometry of the file system */
+  u32_t jh_zones;
+  u32_t jh_firstdata;
+  u32_t jh_blocksize;
+  u32_t jh_imapblocks;
+  u32_t jh_zmapblocks;
+  u32_t jh_nlink;		/* number of directory entries saved */
+  u32_t jh_next;		/* number of zone extents saved */
+};
+
+struct jinode {
+  u32_t ji_ctime;		/* time the inode was last changed */
+  u32_t ji_size;
+  u32_t ji_hash;		/* hash of the inode but its access time */
+  u32_t ji_sum;			/* sum of the hashes of a directory's entries */
+  u32_t ji_parent;		/* .. of a directory */
+  u16_t ji_mode;
+  u16_t ji_nlinks;
+};
+
+struct jlink {
+  u32_t jl_dir;			/* directory */
+  u32_t jl_ino;			/* inode of an entry other than . and .. */
+};
+
+struct jextent {
+  u32_t je_zone;		/* first zone */
+  u32_t je_len;			/* number of zones */
+  u32_t je_ino;			/* inode owning them */
+  u32_t je_level;		/* their level of indirection */
+};
+
+/* Checkpoint of the tree walk (-K).  Every CKPT_SECS seconds of the walk,
+ * between two directory zones, the repairs held are written and the bit
+ * maps, the link counts, the frames of the directories being walked, the
+ * directory zones queued and the counters are saved.  A later run of the
+ * same file system picks the walk up from there; the file (device and
+ * inode number, size), the hash of the super block and that of the root
+ * inode must be those saved.  The frames are saved
+ * with the number of their parent in place of the pointer; the worklist
+ * is saved as it is, which keeps it a heap.
+ */
+#define CKPT_MAGIC	0x4b534652L	/* "RFSK" */
+#define CKPT_VERSION	2
+#define CKPT_SECS	60		/* between two checkpoints */
+#define CKPT_TEST	256		/* zones between two looks at the clock */
+#define CKPT_END	((u32_t) -1)	/* ends the bits of a sparse map */
+
+struct kheader {
+  u32_t kh_magic;
+  u32_t kh_version;
+  u32_t kh_ninodes;		/* geometry of the file system */
+  u32_t kh_zones;
+  u32_t kh_firstdata;
+  u32_t kh_blocksize;
+  u32_t kh_imapblocks;
+  u32_t kh_zmapblocks;
+  u32_t kh_super;		/* hash of the super block */
+  u32_t kh_root;		/* hash of the root inode */
+  u64_t kh_dev, kh_ino;		/* the file checked */
+  u64_t kh_size;
+  u32_t kh_nframe;		/* number of directory frames saved */
+  u32_t kh_nwork;		/* number of directory zones queued */
+  u32_t kh_nbig;		/* number of counts saved apart */
+  int kh_nregular, kh_ndirectory, kh_nblkspec, kh_ncharspec;
+  int kh_nbadinode, kh_nsock, kh_npipe, kh_nsyml;
+  int kh_ztype[NLEVEL];
+  int kh_nfreeinode;
+  long kh_nfreezone, kh_nchecked;
+  int kh_changed, kh_notrepaired, kh_nerrors;
+  int kh_firstcnterr, kh_firstlist;
+};
+
+struct kframe {
+  u32_t kf_next;		/* number of the parent frame + 1, or 0 */
+  char kf_presence, kf_done, kf_walked;
+  int kf_ok, kf_pending, kf_refs;
+  block_nr kf_entblk;
+  int kf_entoff;
+  dir_struct kf_ent;
+  d_inode kf_inode;
+};
+
+struct kwork {
+  zone_nr kw_zone;
+  off_t kw_pos;
+  u32_t kw_frame;		/* number of the frame of the directory */
+};
+
+char *jnlfile;			/* check journal, if any */
+char *ckptfile;			/* checkpoint of the tree walk, if any (-K) */
+char *scope;			/* path of the subtree to check, if any (-r) */
+
+/* Quick triage (-T).  A random sample of the inode table blocks is drawn,
+ * TRIAGE_BATCH blocks at a time, until the percentage asked for is drawn
+ * or the time budget is spent.
+ */
+#define TRIAGE_BATCH	16	/* inode table blocks drawn at a time */
+#define TRIAGE_SECS	10	/* default time budget */
+#define TRIAGE_Z	1.96	/* of the 95% confidence intervals */
+
+/* A rate of bad objects in a triage, with the sums needed for its variance
+ * over the inode table blocks sampled.
+ */
+struct rate {
+  long rt_n, rt_bad;		/* objects checked, and the bad ones */
+  long rt_m;			/* inode table blocks they are from */
+  double rt_nn, rt_nb, rt_bb;	/* sums of the squares and products */
+};
+
+double triagepct;		/* percent of the inode table to sample */
+double triagesecs;		/* time budget of a sample (-b), 0 if not set */
+FILE *nullout;			/* where muted reports go */
+char *undofile;			/* undo log of the repairs, if any (-U) */
+char *rollfile;			/* undo log to roll back (-R) */
+char *patchfile;		/* save repairs here, not on the device (-O) */
+char *applyfile;		/* patch to write to the device (-A) */
+
+/* Everything that belongs to the check of one device.  Each thread that
+ * checks a device points `fs' at its check, and the code reaches the
+ * state through it, so several devices can be checked at once.  A fatal
+ * error ends the check, not the program.
+ */
+struct fsck {
+  jmp_buf fs_fail;		/* where fatal() goes */
+  FILE *fs_out;			/* where the report goes */
+  FILE *fs_mute;		/* the report while it is muted */
+  char *fs_device;		/* device name */
+  unsigned fs_version, fs_block_size;
+  struct super_block fs_sb;
+  u32_t fs_superhash;		/* hash of the super block as read */
+  int fs_dev;			/* file descriptor of the device */
+  char *fs_image;		/* the mapped image, if any */
+  u64_t fs_imagesize;		/* size of the mapped image */
+
+  int fs_firstcnterr;		/* is this the first inode ref cnt error? */
+  bitchunk_t *fs_imap, *fs_zmap;	/* inode and zone bit maps */
+  struct sbitmap *fs_spec_imap;	/* inodes to report or looked into */
+  struct sbitmap *fs_spec_zmap;	/* zones to report or found twice */
+  struct sbitmap *fs_dirmap;	/* directory inodes */
+
+  struct cblock *fs_cache;	/* set associative block cache */
+  int fs_ncache;		/* number of blocks in the cache */
+  int fs_nsets;			/* number of sets in the cache */
+  unsigned long fs_cacheclock;	/* LRU clock */
+  char *fs_rabuf;		/* buffer for reading ahead */
+  block_nr fs_ranext;		/* block following the last read ahead */
+  int fs_rawin;			/* current read ahead window */
+  long fs_cachehits, fs_cachemisses, fs_nreadahead;	/* statistics */
+  long fs_nrdcalls, fs_nwrcalls, fs_nsyscalls;	/* device transfers */
+  u64_t fs_nrdbytes, fs_nwrbytes;	/* bytes read and written */
+  block_nr *fs_pflist;		/* blocks to prefetch */
+  int fs_npflist;		/* max. number of blocks in pflist */
+  struct cblock **fs_pfslot;	/* slots, buffers and reads of a batch */
+  struct iovec *fs_pfiov;	/* of pflist blocks */
+  struct ioreq *fs_pfreq;
+  struct uring *fs_ring;	/* io_uring of -Q, null if not used */
+  struct dblock **fs_dirtyhash;	/* hash of the repaired blocks */
+  int fs_ndirtyhash;		/* number of chains in it */
+  int fs_ndirty;		/* number of repaired blocks held */
+  int fs_undofd;		/* undo log, -1 if not open yet */
+  long fs_nundo;		/* blocks logged in it */
+  char *fs_zbufs;		/* free list of zone buffers */
+  pthread_mutex_t fs_cachelock;	/* lock of the cache, taken while */
+  pthread_mutex_t fs_iolock;	/* the pool runs, and of lseek64() and
+				 * the device counters */
+  int fs_nextworker;		/* next deque to hand a task to */
+  int fs_ntasks;		/* tasks queued or running in the pool */
+  int fs_drain;			/* drop the tasks still queued */
+  long fs_nprefetched;		/* blocks loaded by the threads */
+  unsigned long fs_wrgen;	/* number of times blocks were written */
+
+  char *fs_nullbuf;		/* null buffer */
+  d_inode *fs_itable;		/* in core copy of the inode table */
+  signed char *fs_count;	/* inode count, or CNT_OVER */
+  struct bigcnt **fs_bigcount;	/* counts that don't fit in fs_count */
+  int fs_changed;		/* has the diskette been written to? */
+  struct stack *fs_ftop;	/* frame of the file being checked */
+  struct work *fs_worklist;	/* directory zones to check */
+  int fs_nwork, fs_maxwork;	/* number of items in and size of worklist */
+  block_nr fs_entblk;		/* block and offset of the entry being */
+  int fs_entoff;		/* checked by chkdirzone() */
+  struct stack *fs_path;	/* frames of the directories above -r path */
+
+  /* Counters for each type of inode/zone. */
+  int fs_nfreeinode, fs_nregular, fs_ndirectory, fs_nblkspec;
+  int fs_ncharspec, fs_nbadinode, fs_nsock, fs_npipe, fs_nsyml;
+  int fs_ztype[NLEVEL];
+  long fs_nchecked;		/* inodes checked */
+  unsigned fs_kmark;		/* last mark used to number the frames */
+  u32_t fs_seed;		/* state of the random numbers of -T */
+  double fs_knext;		/* when the next checkpoint is due */
+  long fs_estimate;		/* inodes and zones to check, 0 if unknown */
+  double fs_start;		/* when the check started */
+  struct fsck *fs_nextcheck;	/* next check running */
+  int fs_curphase;		/* phase running, -1 if none */
+  struct phase fs_mark;		/* totals when it started */
+  struct phase fs_phase[NR_PHASE];	/* what each phase took */
+  long fs_nfreezone;
+  int fs_notrepaired;		/* was a repair refused? */
+  int fs_firstlist;		/* has the listing header been printed? */
+  int fs_note;			/* has the answer key been printed? */
+  int fs_nerrors;		/* number of problems found */
+
+  struct jinode *fs_jold, *fs_jnew;	/* inode records, saved and current */
+  struct jlink *fs_jlinks, *fs_jnewlinks;	/* entries, saved and found */
+  long fs_njlinks, fs_njnewlinks, fs_maxjnewlinks;
+  struct jextent *fs_jexts, *fs_jnewexts;	/* zones owned, saved, found */
+  long fs_njexts, fs_njnewexts, fs_maxjnewexts;
+  bitchunk_t *fs_jimap, *fs_jzmap;	/* bit maps saved */
+  bitchunk_t *fs_jchg, *fs_jreread;	/* inodes changed, dirs to reread */
+  bitchunk_t *fs_jzmapnew;	/* zone map as it should be now */
+  int *fs_jdelta;		/* change in the number of links to an inode */
+  int fs_jmark;			/* mark the zones walked in jzmapnew? */
+  int fs_jpresence;		/* . and .. seen in the directory reread */
+  off_t fs_jdirsize;		/* end of its last entry */
+};
+
+#if defined(__GNUC__) || defined(__clang__)
+__thread struct fsck *fs;	/* check done by this thread */
+#else
+_Thread_local struct fsck *fs;
+#endif
+
+/* The report of a check goes to its own stream, so the reports of checks
+ * running at once don't mix.
+ */
+#define OUT		(fs != NULL ? fs->fs_out : stdout)
+#undef putchar
+#define putchar(c)	putc((c), OUT)
+
 _PROTOTYPE(int main, (int argc, char **argv));
+_PROTOTYPE(int fsprintf, (char *fmt, ...));
 _PROTOTYPE(void initvars, (void));
 _PROTOTYPE(void fatal, (char *s));
 _PROTOTYPE(int eoln, (int c));
 _PROTOTYPE(int yes, (char *question));
+_PROTOTYPE(int ask, (int class, ino_t ino, char *question));
+_PROTOTYPE(int setpolicy, (char *list, int value));
+_PROTOTYPE(int loadpolicy, (char *file));
 _PROTOTYPE(int atoo, (char *s));
 _PROTOTYPE(int input, (char *buf, int size));
 _PROTOTYPE(char *alloc, (unsigned nelem, unsigned elsize));
@@ -164,10 +651,69 @@ _PROTOTYPE(void printname, (char *s));
 _PROTOTYPE(void printrec, (struct stack *sp));
 _PROTOTYPE(void printpath, (int mode, int nlcr));
 _PROTOTYPE(void devopen, (void));
-_PROTOTYPE(void devclose, (void));
-_PROTOTYPE(void devio, (block_nr bno, int dir));
+_PROTOTYPE(int devclose, (void));
+_PROTOTYPE(int devio, (block_nr bno, char *buf, int nblk, int dir));
+_PROTOTYPE(void countio, (int dir, int nsys, long r));
+_PROTOTYPE(long bounceio, (u64_t pos, char *buf, long len, int dir));
+_PROTOTYPE(void advise, (block_nr bno, long n, int done));
+_PROTOTYPE(int deviov, (block_nr bno, struct iovec *iov, int n, int dir));
+_PROTOTYPE(void uringopen, (void));
+_PROTOTYPE(void uringclose, (void));
+_PROTOTYPE(int devbatch, (struct ioreq *rq, int n));
+_PROTOTYPE(int fillcache, (block_nr bno, int n, struct cblock *cp));
+_PROTOTYPE(int takeslots, (block_nr bno, int n, struct cblock *cp,
+			 struct cblock **slot, struct iovec *iov, char *scratch));
+_PROTOTYPE(void putslots, (block_nr bno, int got, struct cblock *cp,
+			 struct cblock **slot));
+_PROTOTYPE(void initcache, (void));
+_PROTOTYPE(void freecache, (void));
+_PROTOTYPE(struct cblock *findblock, (block_nr bno));
+_PROTOTYPE(struct cblock *getblock, (block_nr bno));
+_PROTOTYPE(void putcache, (block_nr bno, char *data));
+_PROTOTYPE(void devreadblocks, (block_nr block, int nblk, char *buf));
+_PROTOTYPE(int blkcmp, (const void *a, const void *b));
+_PROTOTYPE(void devprefetch, (block_nr *list, int n));
+_PROTOTYPE(char *balloc, (size_t size));
+_PROTOTYPE(char *getzbuf, (void));
+_PROTOTYPE(void putzbuf, (char *p));
+_PROTOTYPE(void fetchblock, (block_nr bno, char *buf));
+_PROTOTYPE(int pushtask, (struct worker *wp, struct task *tp));
+_PROTOTYPE(int poptask, (struct worker *wp, struct task *tp));
+_PROTOTYPE(int stealtask, (struct worker *wp, struct task *tp));
+_PROTOTYPE(void submit, (zone_nr zno, ino_t ino, int level, int data));
+_PROTOTYPE(void runtask, (struct worker *wp, struct task *tp));
+_PROTOTYPE(void *workerloop, (void *arg));
+_PROTOTYPE(void startpool, (void));
+_PROTOTYPE(void stoppool, (void));
+_PROTOTYPE(void drainpool, (void));
+_PROTOTYPE(void prefetchdir, (dir_struct *dirp, int n));
 _PROTOTYPE(void devread, (long block, long offset, char *buf, int size));
 _PROTOTYPE(void devwrite, (long block, long offset, char *buf, int size));
+_PROTOTYPE(struct dblock *finddirty, (block_nr bno));
+_PROTOTYPE(void applydirty, (block_nr bno, char *buf));
+_PROTOTYPE(void growdirty, (void));
+_PROTOTYPE(int writedirty, (void));
+_PROTOTYPE(void flushdirty, (void));
+_PROTOTYPE(int dblkcmp, (const void *a, const void *b));
+_PROTOTYPE(struct dblock **dirtylist, (int *np));
+_PROTOTYPE(void freedirty, (struct dblock **list, int n));
+_PROTOTYPE(int writepatch, (void));
+_PROTOTYPE(int putheader, (int fd, u32_t magic, unsigned bs, u32_t super));
+_PROTOTYPE(int openundo, (char *log, unsigned bs, u32_t super));
+_PROTOTYPE(u32_t undosum, (struct urecord *rp, char *data, unsigned bs));
+_PROTOTYPE(int putrecord, (int fd, block_nr bno, int nblk, char *data,
+						unsigned bs, u32_t dev));
+_PROTOTYPE(int logundo, (struct dblock **list, int n));
+_PROTOTYPE(off_t scanlog, (int lfd, char *log, u32_t magic,
+			struct uheader *uhp, off_t **recsp, long *np));
+_PROTOTYPE(int getrecord, (int lfd, off_t pos, struct urecord *urp,
+						char *buf, unsigned bs));
+_PROTOTYPE(int hashsuper, (int dfd, u32_t *hp));
+_PROTOTYPE(int cutshort, (int lfd, off_t end, off_t size, unsigned bs));
+_PROTOTYPE(int rollback, (char *log, char *f));
+_PROTOTYPE(int applypatch, (char *patch, char *f));
+_PROTOTYPE(int inoblock, (int inn));
+_PROTOTYPE(int inooff, (int inn));
 _PROTOTYPE(void pr, (char *fmt, int cnt, char *s, char *p));
 _PROTOTYPE(void lpr, (char *fmt, long cnt, char *s, char *p));
 _PROTOTYPE(bit_nr getnumber, (char *s));
@@ -177,18 +723,29 @@ _PROTOTYPE(void lsuper, (void));
 #define SUPER_PUT	1
 _PROTOTYPE(void rw_super, (int mode));
 _PROTOTYPE(void chksuper, (void));
+_PROTOTYPE(void loaditable, (void));
+_PROTOTYPE(void freeitable, (void));
+_PROTOTYPE(void getinode, (ino_t ino, d_inode *ip));
+_PROTOTYPE(void putinode, (ino_t ino, d_inode *ip));
 _PROTOTYPE(void lsi, (char **clist));
 _PROTOTYPE(bitchunk_t *allocbitmap, (int nblk));
 _PROTOTYPE(void loadbitmap, (bitchunk_t *bitmap, block_nr bno, int nblk));
 _PROTOTYPE(void dumpbitmap, (bitchunk_t *bitmap, block_nr bno, int nblk));
-_PROTOTYPE(void fillbitmap, (bitchunk_t *bitmap, bit_nr lwb, bit_nr upb, char **list));
+_PROTOTYPE(void fillbitmap, (struct sbitmap *bitmap, bit_nr lwb, bit_nr upb, char **list));
 _PROTOTYPE(void freebitmap, (bitchunk_t *p));
+_PROTOTYPE(struct sbitmap *allocsparse, (int nblk));
+_PROTOTYPE(void sbmark, (struct sbitmap *m, bit_nr bit));
 _PROTOTYPE(void getbitmaps, (void));
 _PROTOTYPE(void putbitmaps, (void));
 _PROTOTYPE(void chkword, (unsigned w1, unsigned w2, bit_nr bit, char *type, int *n, int *report, bit_t));
-_PROTOTYPE(void chkmap, (bitchunk_t *cmap, bitchunk_t *dmap, bit_nr bit, block_nr blkno, int nblk, char *type));
+_PROTOTYPE(void chkmap, (bitchunk_t *cmap, bit_nr bit, block_nr blkno, int nblk, char *type));
 _PROTOTYPE(void chkilist, (void));
+_PROTOTYPE(bitchunk_t freeinodes, (ino_t ino, int n));
+_PROTOTYPE(int blkfree, (long bno));
 _PROTOTYPE(void getcount, (void));
+_PROTOTYPE(struct bigcnt *findcnt, (ino_t ino));
+_PROTOTYPE(int getcnt, (ino_t ino));
+_PROTOTYPE(void addcnt, (ino_t ino, int n));
 _PROTOTYPE(void counterror, (ino_t ino));
 _PROTOTYPE(void chkcount, (void));
 _PROTOTYPE(void freecount, (void));
@@ -215,30 +772,110 @@ _PROTOTYPE(int chkspecial, (ino_t ino, d_inode *ip));
 _PROTOTYPE(int chkmode, (ino_t ino, d_inode *ip));
 _PROTOTYPE(int chkinode, (ino_t ino, d_inode *ip));
 _PROTOTYPE(int descendtree, (dir_struct *dp));
+_PROTOTYPE(void queuezone, (zone_nr zno, off_t pos));
+_PROTOTYPE(void prefetchwork, (zone_nr zno));
+_PROTOTYPE(int popzone, (struct work *wp));
+_PROTOTYPE(struct stack *newframe, (dir_struct *dp, d_inode *ip));
+_PROTOTYPE(void freeframe, (struct stack *fp));
+_PROTOTYPE(int finishdir, (struct stack *fp, dir_struct *dp));
 _PROTOTYPE(void chktree, (void));
+_PROTOTYPE(ino_t lookzones, (d_inode *ip, off_t *pos, zone_nr *zlist,
+			     int len, int level, char *name));
+_PROTOTYPE(ino_t lookup, (d_inode *ip, char *name));
+_PROTOTYPE(void chkpath, (void));
+_PROTOTYPE(void freepath, (void));
 _PROTOTYPE(void printtotal, (void));
-_PROTOTYPE(void chkdev, (char *f, char **clist, char **ilist, char **zlist));
+_PROTOTYPE(double clocktime, (clockid_t id));
+_PROTOTYPE(void getmark, (struct phase *pp));
+_PROTOTYPE(void phase, (int p));
+_PROTOTYPE(void addphase, (struct phase *tot, struct phase *pp));
+_PROTOTYPE(void printphases, (void));
+_PROTOTYPE(void jsonphase, (FILE *fp, struct phase *pp));
+_PROTOTYPE(void jsonstring, (FILE *fp, char *s));
+_PROTOTYPE(void savestats, (char *f, int r));
+_PROTOTYPE(void estimate, (void));
+_PROTOTYPE(long bitsused, (bitchunk_t *map, long n));
+_PROTOTYPE(void report, (int last));
+_PROTOTYPE(void *progressloop, (void *arg));
+_PROTOTYPE(u32_t jhash, (u32_t h, char *p, int n));
+_PROTOTYPE(char *jgrow, (char *p, long n, long *max, unsigned size));
+_PROTOTYPE(void jnlrecord, (ino_t ino));
+_PROTOTYPE(void jnlentry, (ino_t ino, off_t pos, dir_struct *dp));
+_PROTOTYPE(void jnlzone, (ino_t ino, zone_nr zno, int level));
+_PROTOTYPE(void jnltotals, (bitchunk_t *im));
+_PROTOTYPE(int jfail, (char *why, ino_t ino));
+_PROTOTYPE(int jnlread, (FILE *fp, char *p, long n, unsigned size));
+_PROTOTYPE(int loadjournal, (void));
+_PROTOTYPE(void newjournal, (void));
+_PROTOTYPE(int linkcmp, (const void *a, const void *b));
+_PROTOTYPE(int haslink, (ino_t dir, ino_t ino));
+_PROTOTYPE(void savejournal, (bitchunk_t *im, bitchunk_t *zm));
+_PROTOTYPE(void freejournal, (void));
+_PROTOTYPE(int jnldirzone, (ino_t ino, off_t pos, zone_nr zno));
+_PROTOTYPE(int jnlzones, (ino_t ino, d_inode *ip, off_t *pos,
+				zone_nr *zlist, int len, int level));
+_PROTOTYPE(int jnlinode, (ino_t ino, d_inode *ip));
+_PROTOTYPE(int chkjournal, (void));
+_PROTOTYPE(long numberframes, (void));
+_PROTOTYPE(int savesparse, (FILE *kp, struct sbitmap *m));
+_PROTOTYPE(void saveckpt, (void));
+_PROTOTYPE(int loadsparse, (FILE *kp, struct sbitmap **mp, int nblk));
+_PROTOTYPE(int loadckpt, (void));
+_PROTOTYPE(void ckptid, (struct kheader *khp));
+_PROTOTYPE(void mute, (int on));
+_PROTOTYPE(u32_t triagerand, (void));
+_PROTOTYPE(void addrate, (struct rate *rp, long n, long bad));
+_PROTOTYPE(void prrate, (char *what, struct rate *rp, double total,
+			  double frac));
+_PROTOTYPE(void triagefs, (void));
+_PROTOTYPE(void freework, (void));
+_PROTOTYPE(void chkfs, (char **clist, char **ilist, char **zlist));
+_PROTOTYPE(int chkdev, (char *f, char **clist, char **ilist, char **zlist,
+							FILE *out));
+_PROTOTYPE(void *chkthread, (void *arg));
+
+/* Print to the report of the check done by this thread. */
+int fsprintf(char *fmt, ...)
+{
+  va_list ap;
+  int r;
+
+  va_start(ap, fmt);
+  r = vfprintf(OUT, fmt, ap);
+  va_end(ap);
+  return(r);
+}
 
 /* Initialize the variables used by this program. */
 void initvars()
 {
   register level;
 
-  nregular = ndirectory = nblkspec = ncharspec =
-  nbadinode = nsock = npipe = nsyml = 0;
-  for (level = 0; level < NLEVEL; level++) ztype[level] = 0;
-  changed = 0;
-  thisblk = NO_BLOCK;
-  firstlist = 1;
-  firstcnterr = 1;
+  fs->fs_nregular = fs->fs_ndirectory = fs->fs_nblkspec = fs->fs_ncharspec =
+  fs->fs_nbadinode = fs->fs_nsock = fs->fs_npipe = fs->fs_nsyml = 0;
+  for (level = 0; level < NLEVEL; level++) PSET(fs->fs_ztype[level], 0);
+  PSET(fs->fs_nchecked, 0);
+  PSET(fs->fs_curphase, -1);
+  memset((void *) fs->fs_phase, 0, sizeof(fs->fs_phase));
+  fs->fs_changed = 0;
+  fs->fs_cachehits = fs->fs_cachemisses = fs->fs_nreadahead = 0;
+  fs->fs_nrdcalls = fs->fs_nwrcalls = fs->fs_nsyscalls = 0;
+  fs->fs_nrdbytes = fs->fs_nwrbytes = 0;
+  fs->fs_ranext = NO_BLOCK;
+  fs->fs_rawin = 1;
+  fs->fs_firstlist = 1;
+  fs->fs_firstcnterr = 1;
+  fs->fs_nerrors = 0;
 }
 
-/* Print the string `s' and exit. */
+/* Print the string `s' and end the check, or exit if there is none. */
 void fatal(s)
 char *s;
 {
-  printf("%s\nfatal\n", s);
-  exit(FSCK_EXIT_CHECK_FAILED);
+  if (fs != NULL && fs->fs_mute != NULL) mute(0);
+  fsprintf("%s\nfatal\n", s);
+  if (fs == NULL) exit(FSCK_EXIT_CHECK_FAILED);
+  longjmp(fs->fs_fail, 1);
 }
 
 /* Test for end of line. */
@@ -253,28 +890,123 @@ int yes(question)
 char *question;
 {
   register int c, answerchar;
-  static int note = 0;
   int yes;
 
   if (!repair) {
-	printf("\n");
+	fsprintf("\n");
 	return(0);
   }
-  printf("%s? ", question);
-  if(!note) { printf("(y=yes, n=no, q=quit, A=for yes to all) "); note = 1; }
+  fsprintf("%s? ", question);
+  if(!fs->fs_note) { fsprintf("(y=yes, n=no, q=quit, A=for yes to all) "); fs->fs_note = 1; }
   if (automatic) {
-	printf("yes\n");
+	fsprintf("yes\n");
 	return(1);
   }
-  fflush(stdout);
+  fflush(OUT);
   if ((c = answerchar = getchar()) == 'q' || c == 'Q') exit(FSCK_EXIT_CHECK_FAILED);
   if(c == 'A') { automatic = 1; c = 'y'; }
   while (!eoln(c)) c = getchar();
   yes = !(answerchar == 'n' || answerchar == 'N');
-  if(!yes) notrepaired = 1;
+  if(!yes) fs->fs_notrepaired = 1;
   return yes;
 }
 
+/* Ask whether a repair of class `class' to inode `ino' should be made,
+ * following the policy for that class, and log the decision.
+ */
+int ask(class, ino, question)
+int class;
+ino_t ino;
+char *question;
+{
+  int r, save;
+
+  fs->fs_nerrors++;
+  switch (policy[class]) {
+      case P_YES:
+      case P_NO:
+	if (!repair) {
+		fsprintf("\n");
+		r = 0;
+		break;
+	}
+	r = policy[class] == P_YES;
+	fsprintf("%s? %s\n", question, r ? "yes" : "no");
+	if (!r) fs->fs_notrepaired = 1;
+	break;
+      case P_ASK:
+	save = automatic;
+	automatic = 0;
+	r = yes(question);
+	if (!automatic) automatic = save;
+	break;
+      default:
+	r = yes(question);
+  }
+  if (replog != NULL && triagepct == 0)	/* a sample repairs nothing */
+	fprintf(replog, "%s\t%s\t%u\t%s\n", fs->fs_device, rclassname[class],
+		ino, r ? "repaired" : "skipped");
+  return(r);
+}
+
+/* Set the policy of the comma separated repair classes in `list' ("all"
+ * for every class) to `value'.  Return 0 if a class is unknown.
+ */
+int setpolicy(list, value)
+char *list;
+int value;
+{
+  register int c, len;
+  register char *p;
+
+  for (p = list; *p != '\0'; p += len + (p[len] == ',')) {
+	len = strcspn(p, ",");
+	if (len == 3 && strncmp(p, "all", 3) == 0) {
+		for (c = 0; c < NR_RCLASS; c++) policy[c] = value;
+		continue;
+	}
+	for (c = 0; c < NR_RCLASS; c++)
+		if (strlen(rclassname[c]) == len &&
+		    strncmp(p, rclassname[c], len) == 0) break;
+	if (c == NR_RCLASS) {
+		fsprintf("%s: unknown repair class %.*s\n", prog, len, p);
+		return(0);
+	}
+	policy[c] = value;
+  }
+  return(1);
+}
+
+/* Read the policy file `file'.  Every line holds a repair class (or "all")
+ * and one of yes, no, ask or default; # starts a comment.
+ */
+int loadpolicy(file)
+char *file;
+{
+  FILE *fp;
+  char line[128], class[64], value[64];
+  int v, n, lineno = 0;
+
+  if ((fp = fopen(file, "r")) == NULL) {
+	perror(file);
+	return(0);
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+	lineno++;
+	line[strcspn(line, "#")] = '\0';
+	if ((n = sscanf(line, "%63s %63s", class, value)) <= 0) continue;
+	for (v = 0; v <= P_ASK; v++)
+		if (n == 2 && strcmp(value, policyname[v]) == 0) break;
+	if (v > P_ASK || !setpolicy(class, v)) {
+		fsprintf("%s: %s line %d: bad policy\n", prog, file, lineno);
+		fclose(fp);
+		return(0);
+	}
+  }
+  fclose(fp);
+  return(1);
+}
+
 /* Convert string to integer.  Representation is octal. */
 int atoo(s)
 register char *s;
@@ -295,10 +1027,10 @@ int size;
 {
   register char *p = buf;
 
-  printf("\n");
+  fsprintf("\n");
   if (repair) {
-	printf("--> ");
-	fflush(stdout);
+	fsprintf("--> ");
+	fflush(OUT);
 	while (--size) {
 		*p = getchar();
 		if (eoln(*p)) {
@@ -329,6 +1061,22 @@ unsigned nelem, elsize;
   return(p);
 }
 
+/* Allocate a zeroed buffer of `size' bytes for blocks, aligned so it can
+ * be transferred with O_DIRECT.
+ */
+char *balloc(size)
+size_t size;
+{
+  void *p;
+
+  if (posix_memalign(&p, DIRECT_ALIGN, size) != 0) {
+  	fprintf(stderr, "Tried to allocate %ldkB\n", (long) size / 1024);
+  	fatal("out of memory");
+  }
+  memset(p, 0, size);
+  return((char *) p);
+}
+
 /* Print the name in a directory entry. */
 void printname(s)
 char *s;
@@ -349,11 +1097,18 @@ char *s;
  */
 void printrec(struct stack *sp)
 {
-  if (sp->st_next != 0) {
-	printrec(sp->st_next);
+  register struct stack *p;
+  register int n = 0, i;
+  struct stack **path;
+
+  for (p = sp; p->st_next != 0; p = p->st_next) n++;
+  path = (struct stack **) alloc((unsigned) n + 1, sizeof(*path));
+  for (p = sp, i = n; p->st_next != 0; p = p->st_next) path[--i] = p;
+  for (i = 0; i < n; i++) {
 	putchar('/');
-	printname(sp->st_dir->mfs_d_name);
+	printname(path[i]->st_dir->mfs_d_name);
   }
+  free((char *) path);
 }
 
 /* Print the current pathname.  */
@@ -361,1279 +1116,5580 @@ void printpath(mode, nlcr)
 int mode;
 int nlcr;
 {
-  if (ftop->st_next == 0)
+  if (fs->fs_ftop->st_next == 0)
 	putchar('/');
   else
-	printrec(ftop);
+	printrec(fs->fs_ftop);
   switch (mode) {
       case 1:
-	printf(" (ino = %u, ", ftop->st_dir->d_inum);
+	fsprintf(" (ino = %u, ", fs->fs_ftop->st_dir->d_inum);
 	break;
       case 2:
-	printf(" (ino = %u)", ftop->st_dir->d_inum);
+	fsprintf(" (ino = %u)", fs->fs_ftop->st_dir->d_inum);
 	break;
   }
-  if (nlcr) printf("\n");
+  if (nlcr) fsprintf("\n");
 }
 
-/* Open the device.  */
+/* Open the device.  With -d it is opened with O_DIRECT, so what is read
+ * stays out of the page cache and only the block cache holds it.
+ */
 void devopen()
 {
-  if ((dev = open(fsck_device,
-    (repair || markdirty) ? O_RDWR : O_RDONLY)) < 0) {
-	perror(fsck_device);
+  struct stat st;
+  int flags = (repair || markdirty) && patchfile == NULL ? O_RDWR : O_RDONLY;
+
+#ifdef O_DIRECT
+  if (directio) flags |= O_DIRECT;
+#endif
+  if ((fs->fs_dev = open(fs->fs_device, flags)) < 0) {
+	perror(fs->fs_device);
 	fatal("couldn't open device to fsck");
   }
+
+  /* An image file can be mapped as a whole.  The mapping is read-only;
+   * repairs are written with write() so a read-only run never dirties
+   * pages of the image.
+   */
+  fs->fs_image = NULL;
+  if (!usemmap) return;
+  if (fstat(fs->fs_dev, &st) < 0 || !S_ISREG(st.st_mode)) {
+	fsprintf("warning: %s is not an image file, not mapping it\n",
+		 fs->fs_device);
+	return;
+  }
+  fs->fs_imagesize = st.st_size;
+  fs->fs_image = mmap(NULL, (size_t) fs->fs_imagesize, PROT_READ, MAP_SHARED,
+		      fs->fs_dev, 0);
+  if (fs->fs_image == MAP_FAILED) {
+	perror("mmap");
+	fsprintf("warning: couldn't map %s, reading it instead\n",
+		 fs->fs_device);
+	fs->fs_image = NULL;
+  }
 }
 
-/* Close the device. */
-void devclose()
+/* Close the device.  Return -1 if that fails. */
+int devclose()
 {
-  if (close(dev) != 0) {
-	perror("close");
-	fatal("");
+  int r;
+
+  if (fs->fs_image != NULL) {
+	munmap(fs->fs_image, (size_t) fs->fs_imagesize);
+	fs->fs_image = NULL;
   }
+  if ((r = close(fs->fs_dev)) != 0) perror("close");
+  fs->fs_dev = -1;
+  return(r);
 }
 
-/* Read or write a block. */
-void devio(bno, dir)
+/* Read or write `nblk' consecutive blocks starting at `bno'.  Return the
+ * number of whole blocks transferred.  The transfer is positional, so
+ * the prefetch threads need no lock for it; only an offset that doesn't
+ * fit an off_t is reached by lseek64() under the I/O lock.  With O_DIRECT
+ * a transfer that is not aligned goes through bounceio().  Called by the
+ * prefetch threads too, so a failing seek is reported as a failed
+ * transfer, not with fatal().
+ */
+int devio(bno, buf, nblk, dir)
 block_nr bno;
+char *buf;
+int nblk;
 int dir;
 {
+  u64_t pos;
   int r;
 
-  if(!block_size) fatal("devio() with unknown block size");
-  if (dir == READING && bno == thisblk) return;
-  thisblk = bno;
+  if(!fs->fs_block_size) fatal("devio() with unknown block size");
 
 #if 0
-printf("%s at block %5d\n", dir == READING ? "reading " : "writing", bno);
+fsprintf("%s at block %5d\n", dir == READING ? "reading " : "writing", bno);
 #endif
-  r= lseek64(dev, btoa64(bno), SEEK_SET, NULL);
-  if (r != 0)
-	fatal("lseek64 failed");
-  if (dir == READING) {
-	if (read(dev, rwbuf, block_size) == block_size)
-		return;
+  pos = btoa64(bno);
+  if (directio && (MISALIGNED(buf) || MISALIGNED(pos) ||
+		   MISALIGNED(nblk * fs->fs_block_size))) {
+	r = bounceio(pos, buf, (long) nblk * fs->fs_block_size, dir);
+  } else if ((u64_t) (off_t) pos == pos) {
+	if (dir == READING)
+		r = pread(fs->fs_dev, buf, nblk * fs->fs_block_size,
+			  (off_t) pos);
+	else
+		r = pwrite(fs->fs_dev, buf, nblk * fs->fs_block_size,
+			   (off_t) pos);
+	countio(dir, 1, r);
   } else {
-	if (write(dev, rwbuf, block_size) == block_size)
-		return;
-  }
-
-  printf("%s: can't %s block %ld (error = 0x%x)\n", prog,
-         dir == READING ? "read" : "write", (long) bno, errno);
-  if (dir == READING) {
-	printf("Continuing with a zero-filled block.\n");
-	memset(rwbuf, 0, block_size);
-	return;
+	LOCK(&fs->fs_iolock);
+	r= lseek64(fs->fs_dev, pos, SEEK_SET, NULL);
+	if (r != 0)
+		r = -1;
+	else if (dir == READING)
+		r = read(fs->fs_dev, buf, nblk * fs->fs_block_size);
+	else
+		r = write(fs->fs_dev, buf, nblk * fs->fs_block_size);
+	UNLOCK(&fs->fs_iolock);
+	countio(dir, 2, r);
   }
-  fatal("");
+  return(r < 0 ? 0 : r / fs->fs_block_size);
 }
 
-/* Read `size' bytes from the disk starting at block 'block' and
- * byte `offset'.
+/* Transfer `len' bytes at `pos' through an aligned buffer, for O_DIRECT
+ * when `buf', `pos' or `len' is not aligned.  A write reads the aligned
+ * span around it first.  Return the number of bytes transferred, or -1.
  */
-void devread(block, offset, buf, size)
-long block;
-long offset;
+long bounceio(pos, buf, len, dir)
+u64_t pos;
 char *buf;
-int size;
+long len;
+int dir;
 {
-  if(!block_size) fatal("devread() with unknown block size");
-  if (offset >= block_size)
-  {
-	block += offset/block_size;
-	offset %= block_size;
+  u64_t start = pos & ~(u64_t) (DIRECT_ALIGN - 1);
+  long skip = (long) (pos - start);
+  long span = (skip + len + DIRECT_ALIGN - 1) & ~(long) (DIRECT_ALIGN - 1);
+  void *b;
+  long r;
+
+  if (posix_memalign(&b, DIRECT_ALIGN, (size_t) span) != 0) {
+	errno = ENOMEM;
+	return(-1);
   }
-  devio(block, READING);
-  memmove(buf, &rwbuf[offset], size);
+  r = pread(fs->fs_dev, b, (size_t) span, (off_t) start);
+  countio(READING, 1, r);
+  if (dir == READING) {
+	if ((r -= skip) > len) r = len;
+	if (r > 0) memmove(buf, (char *) b + skip, (size_t) r);
+  } else if (r >= skip + len) {
+	memmove((char *) b + skip, buf, (size_t) len);
+	r = pwrite(fs->fs_dev, b, (size_t) span, (off_t) start);
+	countio(WRITING, 1, r);
+	r = r < skip + len ? -1 : len;
+  } else
+	r = -1;
+  free(b);
+  return(r);
 }
 
-/* Write `size' bytes to the disk starting at block 'block' and
- * byte `offset'.
+/* Tell the system the `n' blocks from `bno' on are about to be read in
+ * order, or, when `done', that they won't be read again, so their pages
+ * can go.  Not needed when the page cache is bypassed.
  */
-void devwrite(block, offset, buf, size)
-long block;
-long offset;
-char *buf;
-int size;
+void advise(bno, n, done)
+block_nr bno;
+long n;
+int done;
 {
-  if(!block_size) fatal("devwrite() with unknown block size");
-  if (!repair) fatal("internal error (devwrite)");
-  if (offset >= block_size)
-  {
-	block += offset/block_size;
-	offset %= block_size;
-  }
-  if (size != block_size) devio(block, READING);
-  memmove(&rwbuf[offset], buf, size);
-  devio(block, WRITING);
-  changed = 1;
-}
+#ifdef POSIX_FADV_SEQUENTIAL
+  off_t pos = (off_t) btoa64(bno), len = (off_t) n * fs->fs_block_size;
 
-/* Print a string with either a singular or a plural pronoun. */
-void pr(fmt, cnt, s, p)
-char *fmt, *s, *p;
-int cnt;
-{
-  printf(fmt, cnt, cnt == 1 ? s : p);
+  if (fs->fs_image != NULL || directio) return;
+  if (done) {
+	posix_fadvise(fs->fs_dev, pos, len, POSIX_FADV_DONTNEED);
+	return;
+  }
+  posix_fadvise(fs->fs_dev, pos, len, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(fs->fs_dev, pos, len, POSIX_FADV_WILLNEED);
+#endif
 }
 
-/* Same as above, but with a long argument */
-void lpr(fmt, cnt, s, p)
-char *fmt, *s, *p;
-long cnt;
+/* Count a transfer in direction `dir' that took `nsys' system calls and
+ * returned `r'.  The prefetch threads transfer too, so the counters are
+ * kept under the I/O lock.
+ */
+void countio(dir, nsys, r)
+int dir;
+int nsys;
+long r;
 {
-  printf(fmt, cnt, cnt == 1 ? s : p);
+  LOCK(&fs->fs_iolock);
+  fs->fs_nsyscalls += nsys;
+  if (dir == READING) {
+	fs->fs_nrdcalls++;
+	if (r > 0) fs->fs_nrdbytes += r;
+  } else {
+	fs->fs_nwrcalls++;
+	if (r > 0) fs->fs_nwrbytes += r;
+  }
+  UNLOCK(&fs->fs_iolock);
 }
 
-/* Convert string to number. */
-bit_nr getnumber(s)
-register char *s;
+/* Read or write the `n' consecutive blocks starting at `bno' from or to
+ * the buffers of `iov', one block each, with a single preadv() or
+ * pwritev().  Return the number of whole blocks transferred.
+ */
+int deviov(bno, iov, n, dir)
+block_nr bno;
+struct iovec *iov;
+int n;
+int dir;
 {
-  register bit_nr n = 0;
+  u64_t pos = btoa64(bno);
+  register int i, got;
+  ssize_t r;
 
-  if (s == NULL)
-	return NO_BIT;
-  while (isdigit(*s))
-	n = (n << 1) + (n << 3) + *s++ - '0';
-  return (*s == '\0') ? n : NO_BIT;
+#ifndef NO_PREADV
+  for (i = 0; directio && i < n; i++)
+	if (MISALIGNED(iov[i].iov_base) || MISALIGNED(iov[i].iov_len))
+		break;
+  if (n > 1 && (u64_t) (off_t) pos == pos &&
+      (!directio || (i == n && !MISALIGNED(pos)))) {
+	if (dir == READING)
+		r = preadv(fs->fs_dev, iov, n, (off_t) pos);
+	else
+		r = pwritev(fs->fs_dev, iov, n, (off_t) pos);
+	countio(dir, 1, (long) r);
+	return(r < 0 ? 0 : r / fs->fs_block_size);
+  }
+#endif
+  for (i = 0; i < n; i += got)
+	if ((got = devio(bno + i, (char *) iov[i].iov_base, 1, dir)) == 0)
+		break;
+  return(i);
 }
 
-/* See if the list pointed to by `argv' contains numbers. */
-char **getlist(argv, type)
-char ***argv, *type;
+/* Set up an io_uring of `qdepth' entries for reading the device, if -Q
+ * asked for one.  Where the build or the kernel has none, say so and read
+ * synchronously.
+ */
+void uringopen()
 {
-  register char **list = *argv;
-  register empty = 1;
-
-  while (getnumber(**argv) != NO_BIT) {
-	(*argv)++;
-	empty = 0;
+#ifdef HAVE_URING
+  struct io_uring_params p;
+  register struct uring *rp;
+  int fd;
+
+  fs->fs_ring = NULL;
+  if (qdepth == 0 || fs->fs_image != NULL) return;
+  if (directio && MISALIGNED(fs->fs_block_size)) {
+	fsprintf("warning: blocks too small for O_DIRECT reads through io_uring, reading synchronously\n");
+	return;
   }
-  if (empty) {
-	printf("warning: no %s numbers given\n", type);
-	return(NULL);
+  memset(&p, 0, sizeof(p));
+  if ((fd = syscall(__NR_io_uring_setup, qdepth, &p)) < 0) {
+	fsprintf("warning: no io_uring (error = 0x%x), reading synchronously\n",
+		 errno);
+	return;
   }
-  return(list);
+  rp = (struct uring *) alloc(1, sizeof(struct uring));
+  rp->ur_fd = fd;
+  rp->ur_entries = p.sq_entries;
+  rp->ur_sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  rp->ur_cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  rp->ur_sqmap = mmap(NULL, rp->ur_sqsize, PROT_READ | PROT_WRITE,
+		      MAP_SHARED, fd, IORING_OFF_SQ_RING);
+  rp->ur_cqmap = mmap(NULL, rp->ur_cqsize, PROT_READ | PROT_WRITE,
+		      MAP_SHARED, fd, IORING_OFF_CQ_RING);
+  rp->ur_sqes = (struct io_uring_sqe *) mmap(NULL,
+		      p.sq_entries * sizeof(struct io_uring_sqe),
+		      PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQES);
+  fs->fs_ring = rp;
+  if (rp->ur_sqmap == MAP_FAILED || rp->ur_cqmap == MAP_FAILED ||
+      rp->ur_sqes == MAP_FAILED) {
+	fsprintf("warning: couldn't map the io_uring queues, reading synchronously\n");
+	uringclose();
+	return;
+  }
+  rp->ur_sqhead = (unsigned *) (rp->ur_sqmap + p.sq_off.head);
+  rp->ur_sqtail = (unsigned *) (rp->ur_sqmap + p.sq_off.tail);
+  rp->ur_sqmask = (unsigned *) (rp->ur_sqmap + p.sq_off.ring_mask);
+  rp->ur_sqarray = (unsigned *) (rp->ur_sqmap + p.sq_off.array);
+  rp->ur_cqhead = (unsigned *) (rp->ur_cqmap + p.cq_off.head);
+  rp->ur_cqtail = (unsigned *) (rp->ur_cqmap + p.cq_off.tail);
+  rp->ur_cqmask = (unsigned *) (rp->ur_cqmap + p.cq_off.ring_mask);
+  rp->ur_cqes = (struct io_uring_cqe *) (rp->ur_cqmap + p.cq_off.cqes);
+#else
+  fs->fs_ring = NULL;
+  if (qdepth != 0)
+	fsprintf("warning: built without io_uring, reading synchronously\n");
+#endif
 }
 
-/* Make a listing of the super block.  If `repair' is set, ask the user
- * for changes.
- */
-void lsuper()
+/* Tear down the io_uring, if any. */
+void uringclose()
 {
-  printf("Super Block Details:\n");
-  printf("====================\n");
-  printf("Super Block will not be modified!!!\n");
-  printf("ninodes       = %u\n", sb.s_ninodes);
-  printf("nzones        = %ld\n", sb.s_zones);
-  printf("imap_blocks   = %u\n", sb.s_imap_blocks);
-  printf("zmap_blocks   = %u\n", sb.s_zmap_blocks);
-  printf("firstdatazone = %u\n", sb.s_firstdatazone_old);
-  printf("log_zone_size = %u\n", sb.s_log_zone_size);
-  printf("maxsize       = %ld\n", sb.s_max_size);
-  printf("block size    = %ld\n", sb.s_block_size);
-  printf("flags         = ");
-  if(sb.s_flags & MFSFLAG_CLEAN) printf("CLEAN "); else printf("DIRTY ");
-  printf("\n");
+#ifdef HAVE_URING
+  register struct uring *rp = fs->fs_ring;
+
+  if (rp == NULL) return;
+  if (rp->ur_sqes != MAP_FAILED)
+	munmap((char *) rp->ur_sqes,
+	       rp->ur_entries * sizeof(struct io_uring_sqe));
+  if (rp->ur_cqmap != MAP_FAILED) munmap(rp->ur_cqmap, rp->ur_cqsize);
+  if (rp->ur_sqmap != MAP_FAILED) munmap(rp->ur_sqmap, rp->ur_sqsize);
+  close(rp->ur_fd);
+  free((char *) rp);
+#endif
+  fs->fs_ring = NULL;
 }
 
-/* Get the super block from either disk or user.  Do some initial checks. */
-void rw_super(int put)
+/* Do the `n' reads of `rq' and set how many blocks each one got.  With an
+ * io_uring up to `qdepth' of them are in flight at once; otherwise they
+ * are done one after the other with deviov().  Return -1 if the io_uring
+ * fails, so the caller can drop its locks before calling fatal().
+ */
+int devbatch(rq, n)
+struct ioreq *rq;
+int n;
 {
-  if(lseek(dev, OFFSET_SUPER_BLOCK, SEEK_SET) < 0) {
-  	perror("lseek");
-  	fatal("couldn't seek to super block.");
-  }
-  if(put == SUPER_PUT)  {
-    //if(write(dev, &sb, sizeof(sb)) != sizeof(sb)) {
-  	//fatal("couldn't write super block.");
-    //}
-    return;
-  }
-  if(read(dev, &sb, sizeof(sb)) != sizeof(sb)) {
-  	fatal("couldn't read super block.");
-  }
-  if (listsuper) lsuper();
-  if (sb.s_magic == SUPER_MAGIC) fatal("Cannot handle V1 file systems");
-  if (sb.s_magic == SUPER_V2) {
-  	fs_version = 2;
-  	block_size = /* STATIC_BLOCK_SIZE */ 8192;
-  } else if(sb.s_magic == SUPER_V3) {
-  	fs_version = 3;
-  	block_size = sb.s_block_size;
-  } else {
-  	fatal("bad magic number in super block");
-  }
-  if (sb.s_ninodes <= 0) fatal("no inodes");
-  if (sb.s_zones <= 0) fatal("no zones");
-  if (sb.s_imap_blocks <= 0) fatal("no imap");
-  if (sb.s_zmap_blocks <= 0) fatal("no zmap");
-  if (sb.s_firstdatazone != 0 && sb.s_firstdatazone <= 4)
-	fatal("first data zone too small");
-  if (sb.s_log_zone_size < 0) fatal("zone size < block size");
-  if (sb.s_max_size <= 0) {
-	printf("warning: invalid max file size %ld\n", sb.s_max_size);
-  	sb.s_max_size = LONG_MAX;
+  register int i;
+#ifdef HAVE_URING
+  register struct uring *rp = fs->fs_ring;
+  register struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  unsigned head, tail;
+  int next = 0, inflight = 0;
+
+  if (rp != NULL) {
+	while (next < n || inflight > 0) {
+		tail = *rp->ur_sqtail;
+		for (; next < n && inflight < rp->ur_entries; next++) {
+			i = tail++ & *rp->ur_sqmask;
+			sqe = &rp->ur_sqes[i];
+			memset((void *) sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_READV;
+			sqe->fd = fs->fs_dev;
+			sqe->off = btoa64(rq[next].rq_bno);
+			sqe->addr = (unsigned long) rq[next].rq_iov;
+			sqe->len = rq[next].rq_n;
+			sqe->user_data = next;
+			rp->ur_sqarray[i] = i;
+			inflight++;
+		}
+		__atomic_store_n(rp->ur_sqtail, tail, __ATOMIC_RELEASE);
+
+		/* Submit what the kernel hasn't taken yet, and wait for at
+		 * least one read to complete.
+		 */
+		i = tail - __atomic_load_n(rp->ur_sqhead, __ATOMIC_ACQUIRE);
+		if (syscall(__NR_io_uring_enter, rp->ur_fd, i, 1,
+			    IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+		    errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			perror("io_uring_enter");
+			return(-1);
+		}
+		LOCK(&fs->fs_iolock);
+		fs->fs_nsyscalls++;
+		UNLOCK(&fs->fs_iolock);
+
+		head = *rp->ur_cqhead;
+		while (head != __atomic_load_n(rp->ur_cqtail, __ATOMIC_ACQUIRE)) {
+			cqe = &rp->ur_cqes[head++ & *rp->ur_cqmask];
+			i = (int) cqe->user_data;
+			rq[i].rq_got = cqe->res < 0 ? 0 : cqe->res / fs->fs_block_size;
+			countio(READING, 0, (long) cqe->res);
+			inflight--;
+		}
+		__atomic_store_n(rp->ur_cqhead, head, __ATOMIC_RELEASE);
+	}
+	return(0);
   }
+#endif
+  for (i = 0; i < n; i++)
+	rq[i].rq_got = deviov(rq[i].rq_bno, rq[i].rq_iov, rq[i].rq_n,
+			      READING);
+  return(0);
 }
 
-int 
-bitmapsize(bit_t nr_bits, int blk_size)
+/* Allocate the block cache.  The cache is divided in sets of CACHE_WAYS
+ * blocks; a block can only live in the set given by its number modulo
+ * the number of sets.
+ */
+void initcache()
 {
-    block_t nr_blocks;
+  register int i;
+
+  if (fs->fs_ncache < CACHE_WAYS) fs->fs_ncache = CACHE_WAYS;
+  fs->fs_nsets = fs->fs_ncache / CACHE_WAYS;
+  fs->fs_ncache = fs->fs_nsets * CACHE_WAYS;
+  fs->fs_cache = (struct cblock *) alloc((unsigned) fs->fs_ncache,
+					 sizeof(struct cblock));
+  for (i = 0; i < fs->fs_ncache; i++) {
+	fs->fs_cache[i].cb_blk = NO_BLOCK;
+	fs->fs_cache[i].cb_data = balloc(fs->fs_block_size);
+  }
+  fs->fs_rabuf = balloc((size_t) RA_MAX * fs->fs_block_size);
+  fs->fs_cacheclock = 0;
+  fs->fs_npflist = fs->fs_ncache / 2;
+  fs->fs_pflist = (block_nr *) alloc((unsigned) fs->fs_npflist,
+				     sizeof(block_nr));
+  fs->fs_pfslot = (struct cblock **) alloc((unsigned) fs->fs_npflist,
+					   sizeof(*fs->fs_pfslot));
+  fs->fs_pfiov = (struct iovec *) alloc((unsigned) fs->fs_npflist,
+					sizeof(*fs->fs_pfiov));
+  fs->fs_pfreq = (struct ioreq *) alloc((unsigned) fs->fs_npflist,
+					sizeof(*fs->fs_pfreq));
+  fs->fs_zbufs = NULL;
+}
 
-    nr_blocks = (int) (nr_bits / FS_BITS_PER_BLOCK(blk_size));
-    if (((uint32_t) nr_blocks * FS_BITS_PER_BLOCK(blk_size)) < nr_bits)
-        ++nr_blocks;
+/* Release the block cache. */
+void freecache()
+{
+  register int i;
 
-    return(nr_blocks);
+  char *p;
 
+  if (fs->fs_cache != NULL) {
+	for (i = 0; i < fs->fs_ncache; i++) free(fs->fs_cache[i].cb_data);
+	free((char *) fs->fs_cache);
+  }
+  free(fs->fs_rabuf);
+  free((char *) fs->fs_pflist);
+  free((char *) fs->fs_pfslot);
+  free((char *) fs->fs_pfiov);
+  free((char *) fs->fs_pfreq);
+  while ((p = getzbuf()) != NULL) free(p);
+  fs->fs_cache = NULL;
+  fs->fs_rabuf = NULL;
+  fs->fs_pflist = NULL;
+  fs->fs_pfslot = NULL;
+  fs->fs_pfiov = NULL;
+  fs->fs_pfreq = NULL;
 }
 
-/* Check the super block for reasonable contents. */
-void chksuper()
+/* Return the cache slot holding block `bno', or the least recently used
+ * slot of its set if the block is not cached.
+ */
+struct cblock *findblock(bno)
+block_nr bno;
 {
-  register n;
-  register off_t maxsize;
+  register struct cblock *cp, *lru;
 
-  n = bitmapsize((bit_t) sb.s_ninodes + 1, block_size);
-  if (sb.s_magic != SUPER_V2 && sb.s_magic != SUPER_V3)
-  	fatal("bad magic number in super block");
-  if (sb.s_imap_blocks < n) {
-  	printf("need %d bocks for inode bitmap; only have %d\n",
-  		n, sb.s_imap_blocks);
-  	fatal("too few imap blocks");
-  }
-  if (sb.s_imap_blocks != n) {
-	pr("warning: expected %d imap_block%s", n, "", "s");
-	printf(" instead of %d\n", sb.s_imap_blocks);
-  }
-  n = bitmapsize((bit_t) sb.s_zones, block_size);
-  if (sb.s_zmap_blocks < n) fatal("too few zmap blocks");
-  if (sb.s_zmap_blocks != n) {
-	pr("warning: expected %d zmap_block%s", n, "", "s");
-	printf(" instead of %d\n", sb.s_zmap_blocks);
-  }
-  if (sb.s_log_zone_size >= 8 * sizeof(block_nr))
-	fatal("log_zone_size too large");
-  if (sb.s_log_zone_size > 8) printf("warning: large log_zone_size (%d)\n",
-	       sb.s_log_zone_size);
-  sb.s_firstdatazone = (BLK_ILIST + N_ILIST + SCALE - 1) >> sb.s_log_zone_size;
-  if (sb.s_firstdatazone_old != 0) {
-	if (sb.s_firstdatazone_old >= sb.s_zones)
-		fatal("first data zone too large");
-	if (sb.s_firstdatazone_old < sb.s_firstdatazone)
-		fatal("first data zone too small");
-	if (sb.s_firstdatazone_old != sb.s_firstdatazone) {
-		printf("warning: expected first data zone to be %u ",
-			sb.s_firstdatazone);
-		printf("instead of %u\n", sb.s_firstdatazone_old);
-		sb.s_firstdatazone = sb.s_firstdatazone_old;
-	}
+  cp = lru = &fs->fs_cache[(bno % fs->fs_nsets) * CACHE_WAYS];
+  for (; cp < &fs->fs_cache[(bno % fs->fs_nsets + 1) * CACHE_WAYS]; cp++) {
+	if (cp->cb_blk == bno) return(cp);
+	if (cp->cb_used < lru->cb_used) lru = cp;
   }
-  maxsize = MAX_FILE_POS;
-  if (((maxsize - 1) >> sb.s_log_zone_size) / block_size >= MAX_ZONES)
-	maxsize = ((long) MAX_ZONES * block_size) << sb.s_log_zone_size;
-  if(maxsize <= 0)
-	maxsize = LONG_MAX;
-  if (sb.s_max_size != maxsize) {
-	printf("warning: expected max size to be %ld ", maxsize);
-	printf("instead of %ld\n", sb.s_max_size);
+  return(lru);
+}
+
+/* Get block `bno' into the cache.  On a miss read it, and if the misses
+ * are sequential, the blocks following it as well.
+ */
+struct cblock *getblock(bno)
+block_nr bno;
+{
+  register struct cblock *cp;
+  register int n;
+  block_nr last;
+
+  cp = findblock(bno);
+  cp->cb_used = ++fs->fs_cacheclock;
+  if (cp->cb_blk == bno) {
+	fs->fs_cachehits++;
+	return(cp);
   }
+  fs->fs_cachemisses++;
 
-  if(sb.s_flags & MFSFLAG_MANDATORY_MASK) {
-  	fatal("unsupported feature bits - newer fsck needed");
+  /* Grow the read ahead window as long as the misses are sequential. */
+  if (bno == fs->fs_ranext) {
+	if ((fs->fs_rawin *= 2) > RA_MAX) fs->fs_rawin = RA_MAX;
+  } else
+	fs->fs_rawin = 1;
+  if (fs->fs_rawin > fs->fs_ncache / 2) fs->fs_rawin = 1;
+  last = ztob(fs->fs_sb.s_zones);
+  n = (bno < last && bno + fs->fs_rawin > last) ? last - bno : fs->fs_rawin;
+
+  n = fillcache(bno, n, cp);
+  if (n == 0) {
+	fsprintf("%s: can't read block %ld (error = 0x%x)\n", prog,
+		 (long) bno, errno);
+	fsprintf("Continuing with a zero-filled block.\n");
+	memset(cp->cb_data, 0, fs->fs_block_size);
+	cp->cb_blk = NO_BLOCK;
+	fs->fs_ranext = NO_BLOCK;
+	return(cp);
   }
+  fs->fs_ranext = bno + n;
+  return(cp);
 }
 
-int inoblock(int inn)
+/* Read the `n' blocks starting at `bno' straight into cache slots with one
+ * deviov().  `cp' is the slot for `bno' if the caller has picked one.
+ * A block that is cached already, or whose set has no other slot for this
+ * run, is read into rabuf and dropped.  Return the number of blocks read;
+ * the slots taken for blocks that couldn't be read are left empty.
+ */
+int fillcache(bno, n, cp)
+block_nr bno;
+int n;
+struct cblock *cp;
 {
-  return div64u(mul64u(inn - 1, INODE_SIZE), block_size) + BLK_ILIST;
+  struct cblock *slot[RA_MAX];
+  struct iovec iov[RA_MAX];
+  int got;
+
+  takeslots(bno, n, cp, slot, iov, fs->fs_rabuf);
+  got = deviov(bno, iov, n, READING);
+  putslots(bno, got, cp, slot);
+  return(got);
 }
 
-int inooff(int inn)
+/* Take cache slots for the `n' blocks from `bno' on and point `iov' at
+ * them; `cp' is the slot for `bno' if the caller has picked one.  A block
+ * that is cached already, or whose set has no other slot for the run, is
+ * read into `scratch' and dropped.  Without scratch the run ends before
+ * such a block, and before a slot read ahead but not used yet, which may
+ * be taken by an earlier run of the same batch.  Return the length of the
+ * run.  The slots taken are empty until putslots().
+ */
+int takeslots(bno, n, cp, slot, iov, scratch)
+block_nr bno;
+int n;
+struct cblock *cp;
+struct cblock **slot;
+struct iovec *iov;
+char *scratch;
 {
-  return rem64u(mul64u(inn - 1, INODE_SIZE), block_size);
+  register struct cblock *sp;
+  register int i, j;
+
+  for (i = 0; i < n; i++) {
+	sp = i == 0 && cp != NULL ? cp : findblock(bno + i);
+	for (j = 0; j < i && slot[j] != sp; j++) ;
+	if (scratch == NULL && sp != cp &&
+	    (j < i || sp->cb_blk == bno + i ||
+	     sp->cb_used >= fs->fs_cacheclock - 1))
+		break;
+	if (j < i || sp->cb_blk == bno + i) {
+		sp = NULL;
+		iov[i].iov_base = &scratch[i * fs->fs_block_size];
+	} else {
+		sp->cb_blk = NO_BLOCK;
+		if (sp != cp) sp->cb_used = fs->fs_cacheclock - 1;	/* not yet used */
+		iov[i].iov_base = sp->cb_data;
+	}
+	iov[i].iov_len = fs->fs_block_size;
+	slot[i] = sp;
+  }
+  return(i);
 }
 
-/* Make a listing of the inodes given by `clist'.  If `repair' is set, ask
- * the user for changes.
- */
-void lsi(clist)
-char **clist;
+/* Fill in the slots taken by takeslots() for the `got' blocks read. */
+void putslots(bno, got, cp, slot)
+block_nr bno;
+int got;
+struct cblock *cp;
+struct cblock **slot;
 {
-  register bit_nr bit;
-  register ino_t ino;
-  d_inode inode, *ip = &inode;
-  char buf[80];
+  register int i;
 
-  if (clist == 0) return;
-  while ((bit = getnumber(*clist++)) != NO_BIT) {
-	setbit(spec_imap, bit);
-	ino = bit;
-	do {
-		devread(inoblock(ino), inooff(ino), (char *) ip, INODE_SIZE);
-		printf("inode %u:\n", ino);
-		printf("    mode   = %6o", ip->i_mode);
-		if (input(buf, 80)) ip->i_mode = atoo(buf);
-		printf("    nlinks = %6u", ip->i_nlinks);
-		if (input(buf, 80)) ip->i_nlinks = atol(buf);
-		printf("    size   = %6ld", ip->i_size);
-		if (input(buf, 80)) ip->i_size = atol(buf);
-		if (yes("Write this back")) {
-			devwrite(inoblock(ino), inooff(ino), (char *) ip,
-				INODE_SIZE);
-			break;
-		}
-	} while (yes("Do you want to change it again"));
+  for (i = 0; i < got; i++) {
+	if (slot[i] == NULL) continue;
+	slot[i]->cb_blk = bno + i;
+	applydirty(bno + i, slot[i]->cb_data);
+	if (slot[i] != cp) fs->fs_nreadahead++;
   }
 }
 
-/* Allocate `nblk' blocks worth of bitmap. */
-bitchunk_t *allocbitmap(nblk)
-int nblk;
+/* Read `size' bytes from the disk starting at block 'block' and
+ * byte `offset'.
+ */
+void devread(block, offset, buf, size)
+long block;
+long offset;
+char *buf;
+int size;
 {
-  register bitchunk_t *bitmap;
+  struct dblock *dp;
 
-  bitmap = (bitchunk_t *) alloc((unsigned) nblk, block_size);
-  *bitmap |= 1;
-  return(bitmap);
+  if(!fs->fs_block_size) fatal("devread() with unknown block size");
+  if (offset >= fs->fs_block_size)
+  {
+	block += offset/fs->fs_block_size;
+	offset %= fs->fs_block_size;
+  }
+  if (fs->fs_image != NULL) {
+	if (btoa64(block + 1) > fs->fs_imagesize) {
+		fsprintf("%s: can't read block %ld (beyond end of image)\n",
+			 prog, block);
+		fsprintf("Continuing with a zero-filled block.\n");
+		memset(buf, 0, size);
+		return;
+	}
+	if ((dp = finddirty((block_nr) block)) != NULL)
+		memmove(buf, &dp->db_data[offset], size);
+	else
+		memmove(buf, &fs->fs_image[btoa64(block) + offset], size);
+	return;
+  }
+  LOCK(&fs->fs_cachelock);
+  memmove(buf, &getblock(block)->cb_data[offset], size);
+  UNLOCK(&fs->fs_cachelock);
 }
 
-/* Load the bitmap starting at block `bno' from disk. */
-void loadbitmap(bitmap, bno, nblk)
-bitchunk_t *bitmap;
-block_nr bno;
-int nblk;
+/* Write `size' bytes to the disk starting at block 'block' and
+ * byte `offset'.  The block is changed in the cache and held back with the
+ * other repaired blocks until flushdirty(), so several repairs to a block
+ * cost one write.
+ */
+void devwrite(block, offset, buf, size)
+long block;
+long offset;
+char *buf;
+int size;
 {
-  register i;
-  register bitchunk_t *p;
+  register struct cblock *cp;
+  register struct dblock *dp;
 
-  p = bitmap;
-  for (i = 0; i < nblk; i++, bno++, p += WORDS_PER_BLOCK)
-	devread(bno, 0, (char *) p, block_size);
-  *bitmap |= 1;
+  if(!fs->fs_block_size) fatal("devwrite() with unknown block size");
+  if (!repair) fatal("internal error (devwrite)");
+  if (offset >= fs->fs_block_size)
+  {
+	block += offset/fs->fs_block_size;
+	offset %= fs->fs_block_size;
+  }
+  LOCK(&fs->fs_cachelock);
+  if ((dp = finddirty((block_nr) block)) == NULL) {
+	if (fs->fs_dirtyhash == NULL) {
+		fs->fs_ndirtyhash = DIRTY_HASH;
+		fs->fs_dirtyhash = (struct dblock **) alloc(DIRTY_HASH, sizeof(*fs->fs_dirtyhash));
+	} else if (fs->fs_ndirty >= DIRTY_CHAIN * fs->fs_ndirtyhash)
+		growdirty();
+	dp = (struct dblock *) alloc(1, sizeof(struct dblock));
+	dp->db_data = balloc(fs->fs_block_size);
+	if (size != fs->fs_block_size && fs->fs_image != NULL)
+		devread(block, 0L, dp->db_data, fs->fs_block_size);
+	else if (size != fs->fs_block_size)
+		memmove(dp->db_data, getblock(block)->cb_data,
+			fs->fs_block_size);
+	dp->db_blk = block;
+	dp->db_next = fs->fs_dirtyhash[block % fs->fs_ndirtyhash];
+	fs->fs_dirtyhash[block % fs->fs_ndirtyhash] = dp;
+	fs->fs_ndirty++;
+  }
+  memmove(&dp->db_data[offset], buf, size);
+  if (fs->fs_image == NULL) {
+	cp = findblock(block);
+	cp->cb_used = ++fs->fs_cacheclock;
+	memmove(cp->cb_data, dp->db_data, fs->fs_block_size);
+	cp->cb_blk = block;
+  }
+  UNLOCK(&fs->fs_cachelock);
+  fs->fs_changed = 1;
+  if (fs->fs_ndirty >= DIRTY_MAX) flushdirty();
 }
 
-/* Write the bitmap starting at block `bno' to disk. */
-void dumpbitmap(bitmap, bno, nblk)
-bitchunk_t *bitmap;
+/* Return the repaired block `bno' if it is held back. */
+struct dblock *finddirty(bno)
 block_nr bno;
-int nblk;
 {
-  register i;
-  register bitchunk_t *p = bitmap;
+  register struct dblock *dp;
 
-  for (i = 0; i < nblk; i++, bno++, p += WORDS_PER_BLOCK)
-	devwrite(bno, 0, (char *) p, block_size);
+  if (fs->fs_dirtyhash == NULL) return(NULL);
+  for (dp = fs->fs_dirtyhash[bno % fs->fs_ndirtyhash]; dp != NULL;
+       dp = dp->db_next)
+	if (dp->db_blk == bno) return(dp);
+  return(NULL);
 }
 
-/* Set the bits given by `list' in the bitmap. */
-void fillbitmap(bitmap, lwb, upb, list)
-bitchunk_t *bitmap;
-bit_nr lwb, upb;
-char **list;
+/* Double the number of hash chains of the repaired blocks.  With -O all
+ * repairs are held until the end, and every block read looks in there.
+ */
+void growdirty()
 {
-  register bit_nr bit;
+  register struct dblock **hash, *dp, *next;
+  register int i, n = 2 * fs->fs_ndirtyhash;
+
+  hash = (struct dblock **) alloc((unsigned) n, sizeof(*hash));
+  for (i = 0; i < fs->fs_ndirtyhash; i++)
+	for (dp = fs->fs_dirtyhash[i]; dp != NULL; dp = next) {
+		next = dp->db_next;
+		dp->db_next = hash[dp->db_blk % n];
+		hash[dp->db_blk % n] = dp;
+	}
+  free((char *) fs->fs_dirtyhash);
+  fs->fs_dirtyhash = hash;
+  fs->fs_ndirtyhash = n;
+}
 
-  if (list == 0) return;
-  while ((bit = getnumber(*list++)) != NO_BIT)
-	if (bit < lwb || bit >= upb) {
-		if (bitmap == spec_imap)
-			printf("inode number %ld ", bit);
-		else
-			printf("zone number %ld ", bit);
-		printf("out of range (ignored)\n");
-	} else
-		setbit(bitmap, bit - lwb + 1);
+/* Block `bno' was just read into `buf'; if it was repaired since, put
+ * the repaired contents there instead.
+ */
+void applydirty(bno, buf)
+block_nr bno;
+char *buf;
+{
+  register struct dblock *dp;
+
+  if ((dp = finddirty(bno)) != NULL)
+	memmove(buf, dp->db_data, fs->fs_block_size);
 }
 
-/* Deallocate the bitmap `p'. */
-void freebitmap(p)
-bitchunk_t *p;
+int dblkcmp(a, b)
+const void *a, *b;
 {
-  free((char *) p);
+  block_nr x = (*(struct dblock * const *) a)->db_blk;
+  block_nr y = (*(struct dblock * const *) b)->db_blk;
+
+  return(x < y ? -1 : x > y);
 }
 
-/* Get all the bitmaps used by this program. */
-void getbitmaps()
+/* Return the repaired blocks held back in block order, and their number
+ * in `*np'.
+ */
+struct dblock **dirtylist(np)
+int *np;
 {
-  imap = allocbitmap(N_IMAP);
-  zmap = allocbitmap(N_ZMAP);
-  spec_imap = allocbitmap(N_IMAP);
-  spec_zmap = allocbitmap(N_ZMAP);
-  dirmap = allocbitmap(N_IMAP);
+  register struct dblock **list, *dp;
+  register int i, n = 0;
+
+  list = (struct dblock **) alloc((unsigned) fs->fs_ndirty + 1, sizeof(*list));
+  for (i = 0; i < fs->fs_ndirtyhash; i++)
+	for (dp = fs->fs_dirtyhash[i]; dp != NULL; dp = dp->db_next)
+		list[n++] = dp;
+  qsort(list, n, sizeof(*list), dblkcmp);
+  *np = n;
+  return(list);
 }
 
-/* Release all the space taken by the bitmaps. */
-void putbitmaps()
+/* Forget the `n' repaired blocks in `list'. */
+void freedirty(list, n)
+struct dblock **list;
+int n;
 {
-  freebitmap(imap);
-  freebitmap(zmap);
-  freebitmap(spec_imap);
-  freebitmap(spec_zmap);
-  freebitmap(dirmap);
+  register int i;
+
+  for (i = 0; i < n; i++) {
+	free(list[i]->db_data);
+	free((char *) list[i]);
+  }
+  free((char *) list);
+  free((char *) fs->fs_dirtyhash);
+  fs->fs_dirtyhash = NULL;
+  fs->fs_ndirty = 0;
 }
 
-/* `w1' and `w2' are differing words from two bitmaps that should be
- * identical.  Print what's the matter with them.
+/* Write the repaired blocks held back in block order, adjacent ones with
+ * one pwritev(), and forget them.  Return the number of blocks that
+ * couldn't be written; they are reported here.
  */
-void chkword(w1, w2, bit, type, n, report, phys)
-unsigned w1, w2;
-char *type;
-bit_nr bit;
-int *n, *report;
-bit_nr phys;
+int writedirty()
 {
-  for (; (w1 | w2); w1 >>= 1, w2 >>= 1, bit++, phys++)
-	if ((w1 ^ w2) & 1 && ++(*n) % MAXPRINT == 0 && *report &&
-	    (!repair || automatic || yes("stop this listing")))
-		*report = 0;
-	else if (*report)
-		if ((w1 & 1) && !(w2 & 1))
-			printf("%s %ld is missing\n", type, bit);
-		else if (!(w1 & 1) && (w2 & 1))
-			printf("%s %ld is not free\n", type, bit);
+  struct iovec iov[RA_MAX];
+  register struct dblock **list;
+  register int i, j, got, bad = 0;
+  int n;
+
+  if (fs->fs_dirtyhash == NULL) return(0);
+  LOCK(&fs->fs_cachelock);
+  fs->fs_wrgen++;
+  list = dirtylist(&n);
+  if (undofile != NULL && logundo(list, n) != 0) {
+	fsprintf("%s: %d repaired blocks not written, they couldn't be logged\n",
+		 prog, n);
+	bad = n;
+  }
+  for (i = 0; bad == 0 && i < n; i = j) {
+	for (j = i; j < n && j - i < RA_MAX &&
+		    list[j]->db_blk == list[i]->db_blk + (j - i); j++) {
+		iov[j - i].iov_base = list[j]->db_data;
+		iov[j - i].iov_len = fs->fs_block_size;
+	}
+	got = deviov(list[i]->db_blk, iov, j - i, WRITING);
+	if (got < j - i) {
+		fsprintf("%s: can't write block %ld (error = 0x%x)\n", prog,
+			 (long) list[i + got]->db_blk, errno);
+		bad++;
+		j = i + got + 1;
+	}
+  }
+  freedirty(list, n);
+  UNLOCK(&fs->fs_cachelock);
+  return(bad);
 }
 
-/* Check if the given (correct) bitmap is identical with the one that is
- * on the disk.  If not, ask if the disk should be repaired.
+/* Write the repaired blocks held back, at the end of a phase.  With -O
+ * they are kept until the end of the check, as the overlay later phases
+ * read the file system through.
  */
-void chkmap(cmap, dmap, bit, blkno, nblk, type)
-bitchunk_t *cmap, *dmap;
-bit_nr bit;
-block_nr blkno;
-int nblk;
-char *type;
+void flushdirty()
 {
-  register bitchunk_t *p = dmap, *q = cmap;
-  int report = 1, nerr = 0;
-  int w = nblk * WORDS_PER_BLOCK;
-  bit_nr phys = 0;
-
-  printf("Checking %s map. ", type);
-  if(!preen) printf("\n");
-  fflush(stdout);
-  loadbitmap(dmap, blkno, nblk);
-  do {
-	if (*p != *q) chkword(*p, *q, bit, type, &nerr, &report, phys);
-	p++;
-	q++;
-	bit += 8 * sizeof(bitchunk_t);
-	phys += 8 * sizeof(bitchunk_t);
-  } while (--w > 0);
-
-  if ((!repair || automatic) && !report) printf("etc. ");
-  if (nerr > MAXPRINT || nerr > 10) printf("%d errors found. ", nerr);
-  if (nerr != 0 && yes("install a new map")) dumpbitmap(cmap, blkno, nblk);
-  if (nerr > 0) printf("\n");
+  if (patchfile != NULL) return;
+  if (writedirty() != 0) fatal("");
 }
 
-/* See if the inodes that aren't allocated are cleared. */
-void chkilist()
+/* Save the repaired blocks held back, all of them, in the patch file
+ * instead of writing them to the device.  The patch is written under a
+ * temporary name and renamed when it is complete.  Return the number of
+ * blocks that couldn't be saved.
+ */
+int writepatch()
 {
-  register ino_t ino = 1;
-  mode_t mode;
-
-  printf("Checking inode list. ");
-  if(!preen) printf("\n");
-  fflush(stdout);
-  do
-	if (!bitset(imap, (bit_nr) ino)) {
-		devread(inoblock(ino), inooff(ino), (char *) &mode,
-			sizeof(mode));
-		if (mode != I_NOT_ALLOC) {
-			printf("mode inode %u not cleared", ino);
-			if (yes(". clear")) devwrite(inoblock(ino),
-				inooff(ino), nullbuf, INODE_SIZE);
-		}
+  struct iovec iov[RA_MAX];
+  register struct dblock **list;
+  register int i, j;
+  char *tmp, *buf, *old;
+  int n = 0, fd, bad = 0;
+
+  LOCK(&fs->fs_cachelock);
+  list = fs->fs_dirtyhash == NULL ? NULL : dirtylist(&n);
+  tmp = alloc(strlen(patchfile) + 5, 1);
+  sprintf(tmp, "%s.new", patchfile);
+  buf = balloc((size_t) RA_MAX * fs->fs_block_size);
+  old = balloc((size_t) RA_MAX * fs->fs_block_size);
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ||
+      putheader(fd, PATCH_MAGIC, fs->fs_block_size, fs->fs_superhash) < 0)
+	bad = 1;
+  for (i = 0; !bad && i < n; i = j) {
+	for (j = i; j < n && j - i < RA_MAX &&
+		    list[j]->db_blk == list[i]->db_blk + (j - i); j++) {
+		memmove(&buf[(j - i) * fs->fs_block_size], list[j]->db_data,
+			fs->fs_block_size);
+		iov[j - i].iov_base = &old[(j - i) * fs->fs_block_size];
+		iov[j - i].iov_len = fs->fs_block_size;
 	}
-  while (++ino <= sb.s_ninodes && ino != 0);
-  if(!preen) printf("\n");
+	/* Nothing was written, so the device has what was there. */
+	if (deviov(list[i]->db_blk, iov, j - i, READING) != j - i ||
+	    putrecord(fd, list[i]->db_blk, j - i, buf, fs->fs_block_size,
+		      jhash((u32_t) FNV_BASIS, old,
+			    (j - i) * fs->fs_block_size)) < 0)
+		bad = 1;
+  }
+  if (!bad && fsync(fd) < 0) bad = 1;
+  if (fd >= 0 && close(fd) < 0) bad = 1;
+  if (!bad && rename(tmp, patchfile) < 0) bad = 1;
+  if (bad) {
+	perror(tmp);
+	unlink(tmp);
+	fsprintf("%s: %d repaired blocks not saved\n", prog, n);
+  } else
+	fsprintf("%d repaired blocks saved in patch %s\n", n, patchfile);
+  free(buf);
+  free(old);
+  free(tmp);
+  if (list != NULL) freedirty(list, n);
+  UNLOCK(&fs->fs_cachelock);
+  return(bad ? n + 1 : 0);
 }
 
-/* Allocate an array to maintain the inode reference counts in. */
-void getcount()
+/* Write a log header with magic number `magic' for blocks of `bs' bytes
+ * of the file system whose super block hashes to `super' to `fd'.
+ * Return -1 if that fails.
+ */
+int putheader(fd, magic, bs, super)
+int fd;
+u32_t magic;
+unsigned bs;
+u32_t super;
 {
-  count = (nlink_t *) alloc((unsigned) (sb.s_ninodes + 1), sizeof(nlink_t));
+  struct uheader uh;
+
+  uh.uh_magic = magic;
+  uh.uh_version = UNDO_VERSION;
+  uh.uh_blocksize = bs;
+  uh.uh_super = super;
+  return(write(fd, (char *) &uh, sizeof(uh)) == sizeof(uh) ? 0 : -1);
 }
 
-/* The reference count for inode `ino' is wrong.  Ask if it should be adjusted. */
-void counterror(ino_t ino)
+/* Open undo log `log' for blocks of `bs' bytes of the file system whose
+ * super block hashes to `super', writing its header if it is new and
+ * checking it if earlier runs left records in it.  Return the file
+ * descriptor, or -1 if that fails.
+ */
+int openundo(log, bs, super)
+char *log;
+unsigned bs;
+u32_t super;
 {
-  d_inode inode;
-
-  if (firstcnterr) {
-	printf("INODE NLINK COUNT\n");
-	firstcnterr = 0;
+  struct uheader uh;
+  struct stat st;
+  int fd;
+
+  if ((fd = open(log, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0 ||
+      fstat(fd, &st) < 0) {
+	perror(log);
+	if (fd >= 0) close(fd);
+	return(-1);
   }
-  devread(inoblock(ino), inooff(ino), (char *) &inode, INODE_SIZE);
-  count[ino] += inode.i_nlinks;	/* it was already subtracted; add it back */
-  printf("%5u %5u %5u", ino, (unsigned) inode.i_nlinks, count[ino]);
-  if (yes(" adjust")) {
-	if ((inode.i_nlinks = count[ino]) == 0) {
-		fatal("internal error (counterror)");
-		inode.i_mode = I_NOT_ALLOC;
-		clrbit(imap, (bit_nr) ino);
+  if (st.st_size == 0) {
+	if (putheader(fd, UNDO_MAGIC, bs, super) < 0) {
+		perror(log);
+		close(fd);
+		return(-1);
 	}
-	devwrite(inoblock(ino), inooff(ino), (char *) &inode, INODE_SIZE);
+  } else if (pread(fd, (char *) &uh, sizeof(uh), (off_t) 0) != sizeof(uh) ||
+	     uh.uh_magic != UNDO_MAGIC || uh.uh_version != UNDO_VERSION ||
+	     uh.uh_blocksize != bs || uh.uh_super != super) {
+	fprintf(stderr, "%s: %s is not an undo log for this file system\n",
+		prog, log);
+	close(fd);
+	return(-1);
   }
+  return(fd);
 }
 
-/* Check if the reference count of the inodes are correct.  The array `count'
- * is maintained as follows:  an entry indexed by the inode number is
- * incremented each time a link is found; when the inode is read the link
- * count in there is substracted from the corresponding entry in `count'.
- * Thus, when the whole file system has been traversed, all the entries
- * should be zero.
- */
-void chkcount()
+/* Hash undo record `rp' and the blocks of `bs' bytes that follow it. */
+u32_t undosum(rp, data, bs)
+struct urecord *rp;
+char *data;
+unsigned bs;
 {
-  register ino_t ino;
+  struct urecord r;
 
-  for (ino = 1; ino <= sb.s_ninodes && ino != 0; ino++)
-	if (count[ino] != 0) counterror(ino);
-  if (!firstcnterr) printf("\n");
+  r = *rp;
+  r.ur_sum = 0;
+  return(jhash(jhash((u32_t) FNV_BASIS, (char *) &r, sizeof(r)), data,
+	       (int) (r.ur_nblk * bs)));
 }
 
-/* Deallocate the `count' array. */
-void freecount()
+/* Append a record of the `nblk' blocks of `bs' bytes from block `bno' on,
+ * held in `data', to log `fd'.  `dev' is the hash of what the blocks must
+ * hold on the device when the record is used.  Return -1 if that fails.
+ */
+int putrecord(fd, bno, nblk, data, bs, dev)
+int fd;
+block_nr bno;
+int nblk;
+char *data;
+unsigned bs;
+u32_t dev;
 {
-  free((char *) count);
+  struct urecord ur;
+
+  ur.ur_magic = UNDO_MAGIC;
+  ur.ur_block = bno;
+  ur.ur_nblk = nblk;
+  ur.ur_dev = dev;
+  ur.ur_sum = undosum(&ur, data, bs);
+  if (write(fd, (char *) &ur, sizeof(ur)) != sizeof(ur) ||
+      write(fd, data, (size_t) nblk * bs) != (ssize_t) nblk * bs)
+	return(-1);
+  return(0);
 }
 
-/* Print the inode permission bits given by mode and shift. */
-void printperm(mode_t mode, int shift, int special, int overlay)
+/* Append what the `n' blocks in `list', sorted, hold on the device to the
+ * undo log, with the hash of what they are repaired to, and sync it once.
+ * Return -1 if they couldn't all be logged.
+ */
+int logundo(list, n)
+struct dblock **list;
+int n;
 {
-  if (mode >> shift & R_BIT)
-	putchar('r');
-  else
-	putchar('-');
-  if (mode >> shift & W_BIT)
-	putchar('w');
-  else
-	putchar('-');
-  if (mode & special)
-	putchar(overlay);
-  else
-	if (mode >> shift & X_BIT)
-		putchar('x');
-	else
-		putchar('-');
+  struct iovec iov[RA_MAX];
+  register int i, j;
+  char *buf;
+  u32_t h;
+  int r = 0;
+
+  if (n == 0) return(0);
+  if (fs->fs_undofd < 0 &&
+      (fs->fs_undofd = openundo(undofile, fs->fs_block_size,
+				fs->fs_superhash)) < 0)
+	return(-1);
+  buf = balloc((size_t) RA_MAX * fs->fs_block_size);
+  for (i = 0; r == 0 && i < n; i = j) {
+	h = (u32_t) FNV_BASIS;
+	for (j = i; j < n && j - i < RA_MAX &&
+		    list[j]->db_blk == list[i]->db_blk + (j - i); j++) {
+		iov[j - i].iov_base = &buf[(j - i) * fs->fs_block_size];
+		iov[j - i].iov_len = fs->fs_block_size;
+		h = jhash(h, list[j]->db_data, fs->fs_block_size);
+	}
+	if (deviov(list[i]->db_blk, iov, j - i, READING) != j - i) {
+		fsprintf("%s: can't read block %ld for the undo log (error = 0x%x)\n",
+			 prog, (long) list[i]->db_blk, errno);
+		r = -1;
+	} else if (putrecord(fs->fs_undofd, list[i]->db_blk, j - i, buf,
+			     fs->fs_block_size, h) < 0) {
+		perror(undofile);
+		r = -1;
+	} else
+		fs->fs_nundo += j - i;
+  }
+  free(buf);
+  if (r == 0 && fsync(fs->fs_undofd) < 0) {
+	perror(undofile);
+	r = -1;
+  }
+  return(r);
 }
 
-/* List the given inode. */
-void list(ino_t ino, d_inode *ip)
+/* Read the header of log `log', open as `lfd', and find the records that
+ * are whole, up to the first one cut short or with a bad sum.  Their
+ * offsets are returned in `*recsp' and their number in `*np', the header
+ * in `*uhp'.  Return the offset past the last of them, or -1 if the
+ * header isn't one with magic number `magic'.
+ */
+off_t scanlog(lfd, log, magic, uhp, recsp, np)
+int lfd;
+char *log;
+u32_t magic;
+struct uheader *uhp;
+off_t **recsp;
+long *np;
 {
-  if (firstlist) {
-	firstlist = 0;
-	printf(" inode permission link   size name\n");
+  struct uheader uh;
+  struct urecord ur;
+  off_t pos, *recs = NULL;
+  long n = 0, max = 0;
+  size_t size;
+  char *buf;
+
+  if (pread(lfd, (char *) &uh, sizeof(uh), (off_t) 0) != sizeof(uh) ||
+      uh.uh_magic != magic || uh.uh_version != UNDO_VERSION ||
+      uh.uh_blocksize == 0) {
+	fprintf(stderr, "%s: %s is not %s\n", prog, log,
+		magic == UNDO_MAGIC ? "an undo log" : "a patch");
+	return(-1);
   }
-  printf("%6u ", ino);
-  switch (ip->i_mode & I_TYPE) {
-      case I_REGULAR:		putchar('-');	break;
-      case I_DIRECTORY:		putchar('d');	break;
-      case I_CHAR_SPECIAL:	putchar('c');	break;
-      case I_BLOCK_SPECIAL:	putchar('b');	break;
-      case I_NAMED_PIPE:	putchar('p');	break;
-      case I_UNIX_SOCKET:	putchar('s');	break;
-#ifdef I_SYMBOLIC_LINK
-      case I_SYMBOLIC_LINK:	putchar('l');	break;
-#endif
-      default:			putchar('?');
-}
-  printperm(ip->i_mode, 6, I_SET_UID_BIT, 's');
-  printperm(ip->i_mode, 3, I_SET_GID_BIT, 's');
-  printperm(ip->i_mode, 0, STICKY_BIT, 't');
-  printf(" %3u ", ip->i_nlinks);
-  switch (ip->i_mode & I_TYPE) {
-      case I_CHAR_SPECIAL:
-      case I_BLOCK_SPECIAL:
-	printf("  %2x,%2x ", (dev_t) ip->i_zone[0] >> MAJOR & 0xFF,
-	       (dev_t) ip->i_zone[0] >> MINOR & 0xFF);
-	break;
-      default:	printf("%7ld ", ip->i_size);
+  if ((buf = malloc((size_t) RA_MAX * uh.uh_blocksize)) == NULL)
+	fatal("out of memory");
+  for (pos = sizeof(uh); ; pos += sizeof(ur) + size) {
+	if (pread(lfd, (char *) &ur, sizeof(ur), pos) != sizeof(ur)) break;
+	if (ur.ur_magic != UNDO_MAGIC || ur.ur_nblk == 0 ||
+	    ur.ur_nblk > RA_MAX)
+		break;
+	size = (size_t) ur.ur_nblk * uh.uh_blocksize;
+	if (pread(lfd, buf, size, pos + sizeof(ur)) != (ssize_t) size ||
+	    undosum(&ur, buf, uh.uh_blocksize) != ur.ur_sum)
+		break;
+	recs = (off_t *) jgrow((char *) recs, n, &max, sizeof(*recs));
+	recs[n++] = pos;
   }
-  printpath(0, 1);
+  free(buf);
+  *uhp = uh;
+  *recsp = recs;
+  *np = n;
+  return(pos);
 }
 
-/* Remove an entry from a directory if ok with the user.
- * Don't name the function remove() - that is owned by ANSI, and chaos results
- * when it is a macro.
+/* Read the record at `pos' of log `lfd' into `urp' and its blocks of `bs'
+ * bytes into `buf'.  Return -1 if that fails.
  */
-int Remove(dir_struct *dp)
+int getrecord(lfd, pos, urp, buf, bs)
+int lfd;
+off_t pos;
+struct urecord *urp;
+char *buf;
+unsigned bs;
 {
-  setbit(spec_imap, (bit_nr) dp->d_inum);
-  if (yes(". remove entry")) {
-	count[dp->d_inum]--;
-	memset((void *) dp, 0, sizeof(dir_struct));
-	return(1);
-  }
+  size_t size;
+
+  if (pread(lfd, (char *) urp, sizeof(*urp), pos) != sizeof(*urp)) return(-1);
+  size = (size_t) urp->ur_nblk * bs;
+  if (pread(lfd, buf, size, pos + sizeof(*urp)) != (ssize_t) size) return(-1);
   return(0);
 }
 
-/* Convert string so that embedded control characters are printable. */
-void make_printable_name(dst, src, n)
-register char *dst;
-register char *src;
-register int n;
+/* Hash the super block of the device open as `dfd' into `*hp'.  Return -1
+ * if it can't be read.
+ */
+int hashsuper(dfd, hp)
+int dfd;
+u32_t *hp;
 {
-  register int c;
+  struct super_block sup;
 
-  while (--n >= 0 && (c = *src++) != '\0') {
-	if (isprint(c) && c != '\\')
-		*dst++ = c;
-	else {
-		*dst++ = '\\';
-		switch (c) {
-		      case '\\':
-			*dst++ = '\\'; break;
-		      case '\b':
-			*dst++ = 'b'; break;
-		      case '\f':
-			*dst++ = 'f'; break;
-		      case '\n':
-			*dst++ = 'n'; break;
-		      case '\r':
-			*dst++ = 'r'; break;
-		      case '\t':
-			*dst++ = 't'; break;
-		      default:
-			*dst++ = '0' + ((c >> 6) & 03);
-			*dst++ = '0' + ((c >> 3) & 07);
-			*dst++ = '0' + (c & 07);
-		}
-	}
-  }
-  *dst = '\0';
+  if (pread(dfd, (char *) &sup, sizeof(sup), (off_t) OFFSET_SUPER_BLOCK) !=
+							sizeof(sup))
+	return(-1);
+  *hp = jhash((u32_t) FNV_BASIS, (char *) &sup, (int) sizeof(sup));
+  return(0);
 }
 
-/* See if the `.' or `..' entry is as expected. */
-int chkdots(ino_t ino, off_t pos, dir_struct *dp, ino_t exp)
+/* Tell whether what log `lfd', of `size' bytes with blocks of `bs' bytes,
+ * holds past `end', where its whole records end, is no more than a last
+ * record cut short, as a crash while logging leaves.
+ */
+int cutshort(lfd, end, size, bs)
+int lfd;
+off_t end, size;
+unsigned bs;
 {
-  char printable_name[4 * MFS_NAME_MAX + 1];
+  struct urecord ur;
 
-  if (dp->d_inum != exp) {
-	make_printable_name(printable_name, dp->mfs_d_name, sizeof(dp->mfs_d_name));
-	printf("bad %s in ", printable_name);
-	printpath(1, 0);
-	printf("%s is linked to %u ", printable_name, dp->d_inum);
-	printf("instead of %u)", exp);
-	setbit(spec_imap, (bit_nr) ino);
-	setbit(spec_imap, (bit_nr) dp->d_inum);
-	setbit(spec_imap, (bit_nr) exp);
-	if (yes(". repair")) {
-		count[dp->d_inum]--;
-		dp->d_inum = exp;
-		count[exp]++;
-		return(0);
-	}
-  } else if (pos != (dp->mfs_d_name[1] ? DIR_ENTRY_SIZE : 0)) {
-	make_printable_name(printable_name, dp->mfs_d_name, sizeof(dp->mfs_d_name));
-	printf("warning: %s has offset %ld in ", printable_name, pos);
-	printpath(1, 0);
-	printf("%s is linked to %u)\n", printable_name, dp->d_inum);
-	setbit(spec_imap, (bit_nr) ino);
-	setbit(spec_imap, (bit_nr) dp->d_inum);
-	setbit(spec_imap, (bit_nr) exp);
-  }
-  return(1);
+  if (size - end < (off_t) sizeof(ur)) return(1);
+  if (pread(lfd, (char *) &ur, sizeof(ur), end) != sizeof(ur)) return(0);
+  return(ur.ur_magic == UNDO_MAGIC && ur.ur_nblk > 0 &&
+	 ur.ur_nblk <= RA_MAX &&
+	 size - end < (off_t) (sizeof(ur) + (size_t) ur.ur_nblk * bs));
 }
 
-/* Check the name in a directory entry. */
-int chkname(ino_t ino, dir_struct *dp)
+/* Undo the repairs logged in `log' on device `f': write the records back
+ * from the last to the first.  A last record cut short is left alone.
+ * Nothing is written if the log is damaged before that, if its super
+ * block hash isn't that of the device, or if a block holds neither what
+ * the repairs left in it nor what was logged, so a log can't be rolled
+ * back on another device, or over changes made since.  Return an exit
+ * status.
+ */
+int rollback(log, f)
+char *log, *f;
+{
+  struct uheader uh;
+  struct urecord ur, *hdr;
+  struct stat st;
+  off_t end, *recs;
+  long i, j, n, nblk = 0;
+  u32_t super, lo, hi;
+  unsigned bs;
+  size_t size;
+  char *buf, *cur;
+  int lfd, dfd, r = FSCK_EXIT_OK;
+
+  if ((lfd = open(log, O_RDONLY)) < 0) {
+	perror(log);
+	return(FSCK_EXIT_USAGE);
+  }
+  if ((end = scanlog(lfd, log, UNDO_MAGIC, &uh, &recs, &n)) < 0) {
+	close(lfd);
+	return(FSCK_EXIT_USAGE);
+  }
+  bs = uh.uh_blocksize;
+  if (fstat(lfd, &st) < 0 ||
+      (end < st.st_size && !cutshort(lfd, end, st.st_size, bs))) {
+	fprintf(stderr, "%s: %s is damaged past byte %ld, nothing written\n",
+		prog, log, (long) end);
+	free(recs);
+	close(lfd);
+	return(FSCK_EXIT_CHECK_FAILED);
+  }
+  if (end < st.st_size)
+	fprintf(stderr, "%s: the last record of %s is cut short, not used\n",
+		prog, log);
+  if ((dfd = open(f, O_RDWR)) < 0) {
+	perror(f);
+	free(recs);
+	close(lfd);
+	return(FSCK_EXIT_USAGE);
+  }
+  if ((buf = malloc((size_t) RA_MAX * bs)) == NULL ||
+      (cur = malloc((size_t) RA_MAX * bs)) == NULL)
+	fatal("out of memory");
+  hdr = (struct urecord *) alloc((unsigned) n + 1, sizeof(*hdr));
+
+  /* See if the log is for this device as the repairs left it.  A record
+   * must find what they left once the records after it are written back,
+   * or what it holds, if a crash came before the repairs were written.
+   */
+  if (hashsuper(dfd, &super) < 0 || super != uh.uh_super) {
+	fprintf(stderr, "%s: %s is not an undo log for %s, nothing written\n",
+		prog, log, f);
+	r = FSCK_EXIT_USAGE;
+  }
+  for (i = 0; r == FSCK_EXIT_OK && i < n; i++) {
+	if (pread(lfd, (char *) &hdr[i], sizeof(ur), recs[i]) != sizeof(ur)) {
+		perror(log);
+		r = FSCK_EXIT_CHECK_FAILED;
+	}
+  }
+  for (i = n - 1; r == FSCK_EXIT_OK && i >= 0; i--) {
+	size = (size_t) hdr[i].ur_nblk * bs;
+	if (pread(dfd, cur, size, (off_t) hdr[i].ur_block * bs) !=
+							(ssize_t) size) {
+		perror(f);
+		r = FSCK_EXIT_CHECK_FAILED;
+	}
+	for (j = n - 1; r == FSCK_EXIT_OK && j > i; j--) {
+		lo = hdr[i].ur_block > hdr[j].ur_block ?
+			hdr[i].ur_block : hdr[j].ur_block;
+		hi = hdr[i].ur_block + hdr[i].ur_nblk;
+		if (hi > hdr[j].ur_block + hdr[j].ur_nblk)
+			hi = hdr[j].ur_block + hdr[j].ur_nblk;
+		if (lo >= hi) continue;
+		if (getrecord(lfd, recs[j], &ur, buf, bs) < 0) {
+			perror(log);
+			r = FSCK_EXIT_CHECK_FAILED;
+		} else
+			memmove(&cur[(size_t) (lo - hdr[i].ur_block) * bs],
+				&buf[(size_t) (lo - hdr[j].ur_block) * bs],
+				(size_t) (hi - lo) * bs);
+	}
+	if (r != FSCK_EXIT_OK ||
+	    jhash((u32_t) FNV_BASIS, cur, (int) size) == hdr[i].ur_dev)
+		continue;
+	/* Blocks that still hold what was logged were never written. */
+	if (getrecord(lfd, recs[i], &ur, buf, bs) < 0) {
+		perror(log);
+		r = FSCK_EXIT_CHECK_FAILED;
+	} else if (memcmp(cur, buf, size) != 0) {
+		fprintf(stderr, "%s: blocks %lu-%lu of %s changed since they were repaired, nothing written\n",
+			prog, (unsigned long) hdr[i].ur_block,
+			(unsigned long) (hdr[i].ur_block + hdr[i].ur_nblk - 1),
+			f);
+		r = FSCK_EXIT_CHECK_FAILED;
+	}
+  }
+
+  for (i = n - 1; r == FSCK_EXIT_OK && i >= 0; i--) {
+	if (getrecord(lfd, recs[i], &ur, buf, bs) < 0) {
+		perror(log);
+		r = FSCK_EXIT_CHECK_FAILED;
+	} else if (pwrite(dfd, buf, (size_t) ur.ur_nblk * bs,
+			  (off_t) ur.ur_block * bs) !=
+		   (ssize_t) ur.ur_nblk * bs) {
+		perror(f);
+		r = FSCK_EXIT_CHECK_FAILED;
+	} else
+		nblk += ur.ur_nblk;
+  }
+  if (r == FSCK_EXIT_OK && fsync(dfd) < 0) {
+	perror(f);
+	r = FSCK_EXIT_CHECK_FAILED;
+  }
+  if (r == FSCK_EXIT_OK)
+	fprintf(stderr, "%s: %ld blocks restored from %ld records of %s\n",
+		prog, nblk, n, log);
+  free(buf);
+  free(cur);
+  free((char *) hdr);
+  free(recs);
+  close(dfd);
+  close(lfd);
+  return(r);
+}
+
+/* Write the repairs saved in patch `patch' by a run with -O to device
+ * `f'.  Nothing is written unless the whole patch checks out, its super
+ * block hash is that of the device, and every block it replaces still
+ * holds what it held when the patch was made.  With -U, what the blocks
+ * hold is saved in the undo log and synced first, so an interrupted
+ * apply can be rolled back.  Return an exit status.
+ */
+int applypatch(patch, f)
+char *patch, *f;
+{
+  struct uheader uh;
+  struct urecord ur;
+  struct stat st;
+  off_t end, *recs;
+  long i, n, nblk = 0;
+  u32_t super;
+  unsigned bs;
+  char *buf, *old;
+  int lfd, dfd, ufd = -1, r = FSCK_EXIT_OK;
+
+  if ((lfd = open(patch, O_RDONLY)) < 0) {
+	perror(patch);
+	return(FSCK_EXIT_USAGE);
+  }
+  if ((end = scanlog(lfd, patch, PATCH_MAGIC, &uh, &recs, &n)) < 0) {
+	close(lfd);
+	return(FSCK_EXIT_USAGE);
+  }
+  bs = uh.uh_blocksize;
+  if (fstat(lfd, &st) < 0 || end != st.st_size) {
+	fprintf(stderr, "%s: %s is damaged past byte %ld, nothing written\n",
+		prog, patch, (long) end);
+	free(recs);
+	close(lfd);
+	return(FSCK_EXIT_CHECK_FAILED);
+  }
+  if ((dfd = open(f, O_RDWR)) < 0) {
+	perror(f);
+	free(recs);
+	close(lfd);
+	return(FSCK_EXIT_USAGE);
+  }
+  if ((buf = malloc((size_t) RA_MAX * bs)) == NULL ||
+      (old = malloc((size_t) RA_MAX * bs)) == NULL)
+	fatal("out of memory");
+
+  /* See if the patch is for this device as it is now. */
+  if (hashsuper(dfd, &super) < 0 || super != uh.uh_super) {
+	fprintf(stderr, "%s: %s is not a patch for %s, nothing written\n",
+		prog, patch, f);
+	r = FSCK_EXIT_USAGE;
+  }
+  for (i = 0; r == FSCK_EXIT_OK && i < n; i++) {
+	if (getrecord(lfd, recs[i], &ur, buf, bs) < 0 ||
+	    pread(dfd, old, (size_t) ur.ur_nblk * bs,
+		  (off_t) ur.ur_block * bs) != (ssize_t) ur.ur_nblk * bs) {
+		perror(f);
+		r = FSCK_EXIT_CHECK_FAILED;
+	} else if (jhash((u32_t) FNV_BASIS, old, (int) (ur.ur_nblk * bs)) !=
+								ur.ur_dev) {
+		fprintf(stderr, "%s: blocks %lu-%lu of %s changed since %s was made, nothing written\n",
+			prog, (unsigned long) ur.ur_block,
+			(unsigned long) (ur.ur_block + ur.ur_nblk - 1), f,
+			patch);
+		r = FSCK_EXIT_CHECK_FAILED;
+	}
+  }
+  if (r == FSCK_EXIT_OK && undofile != NULL &&
+      (ufd = openundo(undofile, bs, uh.uh_super)) < 0)
+	r = FSCK_EXIT_USAGE;
+
+  /* Log what the blocks hold now, and the hash of what they get. */
+  for (i = 0; r == FSCK_EXIT_OK && ufd >= 0 && i < n; i++) {
+	if (getrecord(lfd, recs[i], &ur, buf, bs) < 0 ||
+	    pread(dfd, old, (size_t) ur.ur_nblk * bs,
+		  (off_t) ur.ur_block * bs) != (ssize_t) ur.ur_nblk * bs ||
+	    putrecord(ufd, (block_nr) ur.ur_block, (int) ur.ur_nblk, old,
+		      bs, jhash((u32_t) FNV_BASIS, buf,
+				(int) (ur.ur_nblk * bs))) < 0) {
+		perror(undofile);
+		r = FSCK_EXIT_CHECK_FAILED;
+		break;
+	}
+  }
+  if (r == FSCK_EXIT_OK && ufd >= 0 && fsync(ufd) < 0) {
+	perror(undofile);
+	r = FSCK_EXIT_CHECK_FAILED;
+  }
+
+  for (i = 0; r == FSCK_EXIT_OK && i < n; i++) {
+	if (getrecord(lfd, recs[i], &ur, buf, bs) < 0) {
+		perror(patch);
+		r = FSCK_EXIT_CHECK_FAILED;
+	} else if (pwrite(dfd, buf, (size_t) ur.ur_nblk * bs,
+			  (off_t) ur.ur_block * bs) !=
+		   (ssize_t) ur.ur_nblk * bs) {
+		perror(f);
+		r = FSCK_EXIT_CHECK_FAILED;
+	} else
+		nblk += ur.ur_nblk;
+  }
+  if (r == FSCK_EXIT_OK && fsync(dfd) < 0) {
+	perror(f);
+	r = FSCK_EXIT_CHECK_FAILED;
+  }
+  if (r == FSCK_EXIT_OK)
+	fprintf(stderr, "%s: %ld blocks written from %ld records of %s\n",
+		prog, nblk, n, patch);
+  free(buf);
+  free(old);
+  free(recs);
+  if (ufd >= 0) close(ufd);
+  close(dfd);
+  close(lfd);
+  return(r);
+}
+
+/* Enter block `bno' with contents `data' in the cache. */
+void putcache(bno, data)
+block_nr bno;
+char *data;
+{
+  register struct cblock *cp;
+
+  cp = findblock(bno);
+  memmove(cp->cb_data, data, fs->fs_block_size);
+  cp->cb_blk = bno;
+  cp->cb_used = ++fs->fs_cacheclock;
+}
+
+/* Read `nblk' consecutive blocks starting at `block' into `buf'.  Cached
+ * blocks are copied from the cache; every run of blocks that are not
+ * cached is read with one devio() and entered in the cache.
+ */
+void devreadblocks(block, nblk, buf)
+block_nr block;
+int nblk;
+char *buf;
+{
+  register int i, j, n;
+  register struct cblock *cp;
+
+  if (fs->fs_image != NULL) {
+	for (i = 0; i < nblk; i++)
+		devread(block + i, 0, &buf[i * fs->fs_block_size],
+			fs->fs_block_size);
+	return;
+  }
+  LOCK(&fs->fs_cachelock);
+  for (i = 0; i < nblk; i = j) {
+	cp = findblock(block + i);
+	if (cp->cb_blk == block + i) {
+		fs->fs_cachehits++;
+		cp->cb_used = ++fs->fs_cacheclock;
+		memmove(&buf[i * fs->fs_block_size], cp->cb_data,
+			fs->fs_block_size);
+		j = i + 1;
+		continue;
+	}
+	for (j = i + 1; j < nblk && j - i < RA_MAX; j++)
+		if (findblock(block + j)->cb_blk == block + j) break;
+	n = devio(block + i, &buf[i * fs->fs_block_size], j - i, READING);
+	fs->fs_cachemisses += n;
+	for (; n > 0; n--, i++) {
+		applydirty(block + i, &buf[i * fs->fs_block_size]);
+		putcache(block + i, &buf[i * fs->fs_block_size]);
+	}
+	for (; i < j; i++)	/* reports the error, zero-fills */
+		memmove(&buf[i * fs->fs_block_size],
+			getblock(block + i)->cb_data,
+			fs->fs_block_size);
+  }
+  UNLOCK(&fs->fs_cachelock);
+}
+
+/* Compare two block numbers, for qsort(). */
+int blkcmp(a, b)
+const void *a, *b;
+{
+  block_nr x = *(const block_nr *) a, y = *(const block_nr *) b;
+
+  return(x < y ? -1 : x > y);
+}
+
+/* Load the `n' blocks in `list' into the cache.  The list is sorted so
+ * adjacent blocks that are not cached yet can be read with one preadv().
+ * With io_uring the runs are read as one batch, several at a time.
+ */
+void devprefetch(list, n)
+block_nr *list;
+int n;
+{
+  register int i, j, k, nrq, used;
+  register struct ioreq *rq;
+
+  if (fs->fs_image != NULL || n == 0) return;
+  if (n > fs->fs_npflist) n = fs->fs_npflist;
+  qsort(list, n, sizeof(*list), blkcmp);
+  LOCK(&fs->fs_cachelock);
+  for (i = nrq = used = 0; i < n; i = j) {
+	if (findblock(list[i])->cb_blk == list[i]) {
+		for (j = i + 1; j < n && list[j] == list[i]; j++) ;
+		continue;
+	}
+	for (j = i + 1, k = 1; j < n && k < RA_MAX; j++) {
+		if (list[j] == list[j - 1]) continue;
+		if (list[j] != list[i] + k ||
+		    findblock(list[j])->cb_blk == list[j]) break;
+		k++;
+	}
+	if (fs->fs_ring == NULL) {
+		fillcache(list[i], k, (struct cblock *) 0);
+		continue;
+	}
+	rq = &fs->fs_pfreq[nrq];
+	rq->rq_bno = list[i];
+	rq->rq_iov = &fs->fs_pfiov[used];
+	rq->rq_n = takeslots(list[i], k, (struct cblock *) 0,
+			     &fs->fs_pfslot[used], rq->rq_iov, (char *) 0);
+	if (rq->rq_n == 0) continue;
+	used += rq->rq_n;
+	nrq++;
+  }
+  if (nrq > 0) {
+	if (devbatch(fs->fs_pfreq, nrq) < 0) {
+		UNLOCK(&fs->fs_cachelock);
+		fatal("couldn't read from the io_uring");
+	}
+	for (i = used = 0; i < nrq; used += fs->fs_pfreq[i++].rq_n)
+		putslots(fs->fs_pfreq[i].rq_bno, fs->fs_pfreq[i].rq_got,
+			 (struct cblock *) 0, &fs->fs_pfslot[used]);
+  }
+  UNLOCK(&fs->fs_cachelock);
+}
+
+/* Get a buffer big enough for a zone.  Buffers are kept on a free list, so
+ * the zone checks don't allocate once the deepest level has been seen.
+ */
+char *getzbuf()
+{
+  char *p;
+
+  if ((p = fs->fs_zbufs) != NULL) fs->fs_zbufs = *(char **) p;
+  return(p);
+}
+
+/* Return a zone buffer to the free list. */
+void putzbuf(p)
+char *p;
+{
+  *(char **) p = fs->fs_zbufs;
+  fs->fs_zbufs = p;
+}
+
+/* Copy block `bno' to `buf', loading it into the cache if it isn't there.
+ * Called by the prefetch threads; the read is done without holding the
+ * cache lock.  If the repaired blocks were written meanwhile, what was
+ * read may be older than the device, so it isn't put in the cache.
+ */
+void fetchblock(bno, buf)
+block_nr bno;
+char *buf;
+{
+  register struct cblock *cp;
+  unsigned long gen;
+
+  pthread_mutex_lock(&fs->fs_cachelock);
+  cp = findblock(bno);
+  if (cp->cb_blk == bno) {
+	memmove(buf, cp->cb_data, fs->fs_block_size);
+	pthread_mutex_unlock(&fs->fs_cachelock);
+	return;
+  }
+  gen = fs->fs_wrgen;
+  pthread_mutex_unlock(&fs->fs_cachelock);
+
+  if (devio(bno, buf, 1, READING) != 1) {
+	memset(buf, 0, fs->fs_block_size);
+	return;
+  }
+  pthread_mutex_lock(&fs->fs_cachelock);
+  applydirty(bno, buf);
+  cp = findblock(bno);
+  if (cp->cb_blk != bno && fs->fs_wrgen == gen) {
+	memmove(cp->cb_data, buf, fs->fs_block_size);
+	cp->cb_blk = bno;
+	cp->cb_used = ++fs->fs_cacheclock;
+	fs->fs_nprefetched++;
+  }
+  pthread_mutex_unlock(&fs->fs_cachelock);
+}
+
+/* Push a task on the bottom of the deque of `wp'.  A full deque drops the
+ * task; prefetching is only a hint.
+ */
+int pushtask(wp, tp)
+struct worker *wp;
+struct task *tp;
+{
+  int ok;
+
+  /* Count the task before it can be taken, so a check never sees its
+   * count drop to zero while a task it queued is still around.
+   */
+  pthread_mutex_lock(&poollock);
+  tp->tk_fs->fs_ntasks++;
+  pthread_mutex_unlock(&poollock);
+  pthread_mutex_lock(&wp->w_lock);
+  if ((ok = wp->w_bottom - wp->w_top < DEQUE_SIZE))
+	wp->w_deque[wp->w_bottom++ % DEQUE_SIZE] = *tp;
+  pthread_mutex_unlock(&wp->w_lock);
+  pthread_mutex_lock(&poollock);
+  if (ok) {
+	poolwork++;
+	poolgen++;
+	pthread_cond_signal(&poolcond);
+	if (nstarved > 0) pthread_cond_broadcast(&starvecond);
+  } else if (--tp->tk_fs->fs_ntasks == 0)
+	pthread_cond_broadcast(&draincond);
+  pthread_mutex_unlock(&poollock);
+  return(ok);
+}
+
+/* Pop a task from the bottom of the own deque of `wp'. */
+int poptask(wp, tp)
+struct worker *wp;
+struct task *tp;
+{
+  int ok;
+
+  pthread_mutex_lock(&wp->w_lock);
+  if ((ok = wp->w_bottom != wp->w_top))
+	*tp = wp->w_deque[--wp->w_bottom % DEQUE_SIZE];
+  pthread_mutex_unlock(&wp->w_lock);
+  return(ok);
+}
+
+/* Steal a task from the top of the deque of some other thread. */
+int stealtask(wp, tp)
+struct worker *wp;
+struct task *tp;
+{
+  register int i;
+  register struct worker *vp;
+  int ok = 0;
+
+  for (i = 1; i < nworkers && !ok; i++) {
+	vp = &workers[(wp - workers + i) % nworkers];
+	pthread_mutex_lock(&vp->w_lock);
+	if ((ok = vp->w_bottom != vp->w_top))
+		*tp = vp->w_deque[vp->w_top++ % DEQUE_SIZE];
+	pthread_mutex_unlock(&vp->w_lock);
+  }
+  if (ok) wp->w_steals++;
+  return(ok);
+}
+
+/* Hand a task to the pool, spreading the tasks over the threads. */
+void submit(zno, ino, level, data)
+zone_nr zno;
+ino_t ino;
+int level;
+int data;
+{
+  struct task t;
+
+  if (nworkers == 0 || fs->fs_image != NULL) return;
+  t.tk_fs = fs;
+  t.tk_zone = zno;
+  t.tk_ino = ino;
+  t.tk_level = level;
+  t.tk_data = data;
+  pushtask(&workers[fs->fs_nextworker++ % nworkers], &t);
+}
+
+/* Load what task `tp' asks for, queueing the blocks found below it. */
+void runtask(wp, tp)
+struct worker *wp;
+struct task *tp;
+{
+  register int i, data;
+  struct task t;
+  d_inode inode;
+  zone_nr *zp;
+
+  if (tp->tk_zone == NO_ZONE) {
+	/* Load the inode, then queue its indirect zones and, for
+	 * directories and symbolic links, its data zones.
+	 */
+	if (tp->tk_ino < ROOT_INODE ||
+	    tp->tk_ino > fs->fs_sb.s_ninodes) return;
+	if (fs->fs_itable != NULL) {
+		pthread_mutex_lock(&fs->fs_cachelock);
+		inode = fs->fs_itable[tp->tk_ino - 1];
+		pthread_mutex_unlock(&fs->fs_cachelock);
+	} else {
+		fetchblock(inoblock(tp->tk_ino), wp->w_buf);
+		memmove(&inode, &wp->w_buf[inooff(tp->tk_ino)], INODE_SIZE);
+	}
+	switch (inode.i_mode & I_TYPE) {
+	    case I_DIRECTORY:
+	    case I_SYMBOLIC_LINK:
+		data = 1;
+		break;
+	    case I_REGULAR:
+	    case I_NAMED_PIPE:
+	    case I_UNIX_SOCKET:
+		data = 0;
+		break;
+	    default:
+		return;
+	}
+	t.tk_fs = tp->tk_fs;
+	t.tk_ino = tp->tk_ino;
+	t.tk_data = data;
+	for (i = data ? 0 : NR_DZONE_NUM; i < NR_ZONE_NUMS; i++) {
+		if (inode.i_zone[i] == NO_ZONE) continue;
+		t.tk_zone = inode.i_zone[i];
+		t.tk_level = i < NR_DZONE_NUM ? 0 : i - NR_DZONE_NUM + 1;
+		pushtask(wp, &t);
+	}
+	return;
+  }
+
+  if (tp->tk_zone < FIRST || tp->tk_zone >= fs->fs_sb.s_zones) return;
+  if (tp->tk_level == 0) {
+	for (i = 0; i < SCALE; i++)
+		fetchblock(ztob(tp->tk_zone) + i, wp->w_buf);
+	return;
+  }
+  fetchblock(ztob(tp->tk_zone), wp->w_buf);
+  t.tk_fs = tp->tk_fs;
+  t.tk_ino = tp->tk_ino;
+  t.tk_data = tp->tk_data;
+  t.tk_level = tp->tk_level - 1;
+  if (t.tk_level == 0 && !t.tk_data) return;
+  for (zp = (zone_nr *) wp->w_buf; zp < (zone_nr *) wp->w_buf + NR_INDIRECTS;
+								zp++) {
+	if (*zp == NO_ZONE) continue;
+	t.tk_zone = *zp;
+	pushtask(wp, &t);
+  }
+}
+
+/* Main loop of a prefetch thread.  The thread takes on the check of each
+ * task it runs; tasks of a check that is being drained are dropped.  A
+ * task is claimed before it is looked for: a task is in a deque before
+ * it is counted in poolwork, so there is one for every claim.  A thread
+ * that misses it, as it was put where the thread had looked already,
+ * sleeps until the next task is queued.
+ */
+void *workerloop(arg)
+void *arg;
+{
+  struct worker *wp = (struct worker *) arg;
+  struct task t;
+  unsigned gen;
+  int drop;
+  void *p;
+
+  for (;;) {
+	pthread_mutex_lock(&poollock);
+	while (poolwork == 0 && !poolquit)
+		pthread_cond_wait(&poolcond, &poollock);
+	if (poolquit) {
+		pthread_mutex_unlock(&poollock);
+		return(NULL);
+	}
+	poolwork--;
+	for (;;) {
+		gen = poolgen;
+		pthread_mutex_unlock(&poollock);
+		if (poptask(wp, &t) || stealtask(wp, &t)) break;
+		pthread_mutex_lock(&poollock);
+		nstarved++;
+		while (poolgen == gen)
+			pthread_cond_wait(&starvecond, &poollock);
+		nstarved--;
+	}
+	pthread_mutex_lock(&poollock);
+	drop = t.tk_fs->fs_drain;
+	pthread_mutex_unlock(&poollock);
+	fs = t.tk_fs;
+	if (!drop && wp->w_bufsize < fs->fs_block_size) {
+		if (posix_memalign(&p, DIRECT_ALIGN, fs->fs_block_size) == 0) {
+			free(wp->w_buf);
+			wp->w_buf = (char *) p;
+			wp->w_bufsize = fs->fs_block_size;
+		}
+	}
+	if (!drop && wp->w_bufsize >= fs->fs_block_size) runtask(wp, &t);
+	fs = NULL;
+	pthread_mutex_lock(&poollock);
+	if (--t.tk_fs->fs_ntasks == 0) pthread_cond_broadcast(&draincond);
+	pthread_mutex_unlock(&poollock);
+  }
+}
+
+/* Start the prefetch threads.  They serve every device checked. */
+void startpool()
+{
+  register int i, n;
+
+  if ((n = nworkers) == 0) return;
+  nworkers = 0;		/* no locking until the pool is complete */
+  workers = (struct worker *) alloc((unsigned) n, sizeof(struct worker));
+  poolwork = poolquit = 0;
+  for (i = 0; i < n; i++)
+	pthread_mutex_init(&workers[i].w_lock, NULL);
+  nworkers = n;
+  for (i = 0; i < n; i++) {
+	if (pthread_create(&workers[i].w_thread, NULL, workerloop,
+							&workers[i]) != 0)
+		fatal("couldn't start prefetch thread");
+  }
+}
+
+/* Stop the prefetch threads and print how much they stole. */
+void stoppool()
+{
+  register int i, n;
+  long steals = 0;
+
+  if ((n = nworkers) == 0) return;
+  pthread_mutex_lock(&poollock);
+  poolquit = 1;
+  pthread_cond_broadcast(&poolcond);
+  pthread_mutex_unlock(&poollock);
+  for (i = 0; i < n; i++) {
+	pthread_join(workers[i].w_thread, NULL);
+	steals += workers[i].w_steals;
+  }
+  nworkers = 0;
+  for (i = 0; i < n; i++) {
+	pthread_mutex_destroy(&workers[i].w_lock);
+	free(workers[i].w_buf);
+  }
+  free((char *) workers);
+  fsprintf("Prefetch: %d threads, %ld tasks stolen\n", n, steals);
+}
+
+/* Wait until no task of the current check is queued or running, dropping
+ * those not started yet.
+ */
+void drainpool()
+{
+  if (nworkers == 0) return;
+  pthread_mutex_lock(&poollock);
+  fs->fs_drain = 1;
+  while (fs->fs_ntasks > 0) pthread_cond_wait(&draincond, &poollock);
+  fs->fs_drain = 0;
+  pthread_mutex_unlock(&poollock);
+}
+
+/* Queue the inodes of the `n' directory entries at `dirp', so their zone
+ * trees are loaded while the checker works through the entries.  Without
+ * the pool but with io_uring, read the blocks of their inodes in a batch.
+ */
+void prefetchdir(dirp, n)
+dir_struct *dirp;
+int n;
+{
+  register dir_struct *dp;
+  register int k = 0;
+
+  if (nworkers == 0) {
+	if (fs->fs_ring == NULL || fs->fs_itable != NULL) return;
+	for (dp = dirp; dp < &dirp[n] && k < fs->fs_ncache / 4; dp++)
+		if (dp->d_inum != NO_ENTRY &&
+		    dp->d_inum <= fs->fs_sb.s_ninodes &&
+		    !bitset(fs->fs_imap, (bit_nr) dp->d_inum))
+			fs->fs_pflist[k++] = inoblock(dp->d_inum);
+	devprefetch(fs->fs_pflist, k);
+	return;
+  }
+  for (dp = &dirp[n - 1]; dp >= dirp; dp--)
+	if (dp->d_inum != NO_ENTRY && dp->d_inum <= fs->fs_sb.s_ninodes &&
+	    !bitset(fs->fs_imap, (bit_nr) dp->d_inum))
+		submit(NO_ZONE, dp->d_inum, 0, 0);
+}
+
+/* Print a string with either a singular or a plural pronoun. */
+void pr(fmt, cnt, s, p)
+char *fmt, *s, *p;
+int cnt;
+{
+  fsprintf(fmt, cnt, cnt == 1 ? s : p);
+}
+
+/* Same as above, but with a long argument */
+void lpr(fmt, cnt, s, p)
+char *fmt, *s, *p;
+long cnt;
+{
+  fsprintf(fmt, cnt, cnt == 1 ? s : p);
+}
+
+/* Convert string to number. */
+bit_nr getnumber(s)
+register char *s;
+{
+  register bit_nr n = 0;
+
+  if (s == NULL)
+	return NO_BIT;
+  while (isdigit(*s))
+	n = (n << 1) + (n << 3) + *s++ - '0';
+  return (*s == '\0') ? n : NO_BIT;
+}
+
+/* See if the list pointed to by `argv' contains numbers. */
+char **getlist(argv, type)
+char ***argv, *type;
+{
+  register char **list = *argv;
+  register empty = 1;
+
+  while (getnumber(**argv) != NO_BIT) {
+	(*argv)++;
+	empty = 0;
+  }
+  if (empty) {
+	fsprintf("warning: no %s numbers given\n", type);
+	return(NULL);
+  }
+  return(list);
+}
+
+/* Make a listing of the super block.  If `repair' is set, ask the user
+ * for changes.
+ */
+void lsuper()
+{
+  fsprintf("Super Block Details:\n");
+  fsprintf("====================\n");
+  fsprintf("Super Block will not be modified!!!\n");
+  fsprintf("ninodes       = %u\n", fs->fs_sb.s_ninodes);
+  fsprintf("nzones        = %ld\n", fs->fs_sb.s_zones);
+  fsprintf("imap_blocks   = %u\n", fs->fs_sb.s_imap_blocks);
+  fsprintf("zmap_blocks   = %u\n", fs->fs_sb.s_zmap_blocks);
+  fsprintf("firstdatazone = %u\n", fs->fs_sb.s_firstdatazone_old);
+  fsprintf("log_zone_size = %u\n", fs->fs_sb.s_log_zone_size);
+  fsprintf("maxsize       = %ld\n", fs->fs_sb.s_max_size);
+  fsprintf("block size    = %ld\n", fs->fs_sb.s_block_size);
+  fsprintf("flags         = ");
+  if(fs->fs_sb.s_flags & MFSFLAG_CLEAN) fsprintf("CLEAN ");
+  else fsprintf("DIRTY ");
+  fsprintf("\n");
+}
+
+/* Get the super block from either disk or user.  Do some initial checks. */
+void rw_super(int put)
+{
+  if(put == SUPER_PUT)  {
+    //if(write(dev, &sb, sizeof(sb)) != sizeof(sb)) {
+  	//fatal("couldn't write super block.");
+    //}
+    return;
+  }
+  if (directio) {
+	if (bounceio((u64_t) OFFSET_SUPER_BLOCK, (char *) &fs->fs_sb,
+		     (long) sizeof(fs->fs_sb), READING) != sizeof(fs->fs_sb))
+		fatal("couldn't read super block.");
+  } else {
+	if(pread(fs->fs_dev, &fs->fs_sb, sizeof(fs->fs_sb), (off_t) OFFSET_SUPER_BLOCK) != sizeof(fs->fs_sb)) {
+  		fatal("couldn't read super block.");
+	}
+	fs->fs_nrdcalls++;
+	fs->fs_nrdbytes += sizeof(fs->fs_sb);
+	fs->fs_nsyscalls++;
+  }
+  fs->fs_superhash = jhash((u32_t) FNV_BASIS, (char *) &fs->fs_sb,
+			   (int) sizeof(fs->fs_sb));
+  if (listsuper) lsuper();
+  if (fs->fs_sb.s_magic == SUPER_MAGIC) fatal("Cannot handle V1 file systems");
+  if (fs->fs_sb.s_magic == SUPER_V2) {
+  	fs->fs_version = 2;
+  	fs->fs_block_size = /* STATIC_BLOCK_SIZE */ 8192;
+  } else if(fs->fs_sb.s_magic == SUPER_V3) {
+  	fs->fs_version = 3;
+  	fs->fs_block_size = fs->fs_sb.s_block_size;
+  } else {
+  	fatal("bad magic number in super block");
+  }
+  if (fs->fs_sb.s_ninodes <= 0) fatal("no inodes");
+  if (fs->fs_sb.s_zones <= 0) fatal("no zones");
+  if (fs->fs_sb.s_imap_blocks <= 0) fatal("no imap");
+  if (fs->fs_sb.s_zmap_blocks <= 0) fatal("no zmap");
+  if (fs->fs_sb.s_firstdatazone != 0 && fs->fs_sb.s_firstdatazone <= 4)
+	fatal("first data zone too small");
+  if (fs->fs_sb.s_log_zone_size < 0) fatal("zone size < block size");
+  if (fs->fs_sb.s_max_size <= 0) {
+	fsprintf("warning: invalid max file size %ld\n", fs->fs_sb.s_max_size);
+  	fs->fs_sb.s_max_size = LONG_MAX;
+  }
+}
+
+int 
+bitmapsize(bit_t nr_bits, int blk_size)
+{
+    block_t nr_blocks;
+
+    nr_blocks = (int) (nr_bits / FS_BITS_PER_BLOCK(blk_size));
+    if (((uint32_t) nr_blocks * FS_BITS_PER_BLOCK(blk_size)) < nr_bits)
+        ++nr_blocks;
+
+    return(nr_blocks);
+
+}
+
+/* Check the super block for reasonable contents. */
+void chksuper()
+{
+  register n;
+  register off_t maxsize;
+
+  n = bitmapsize((bit_t) fs->fs_sb.s_ninodes + 1, fs->fs_block_size);
+  if (fs->fs_sb.s_magic != SUPER_V2 && fs->fs_sb.s_magic != SUPER_V3)
+  	fatal("bad magic number in super block");
+  if (fs->fs_sb.s_imap_blocks < n) {
+  	fsprintf("need %d bocks for inode bitmap; only have %d\n",
+  		n, fs->fs_sb.s_imap_blocks);
+  	fatal("too few imap blocks");
+  }
+  if (fs->fs_sb.s_imap_blocks != n) {
+	pr("warning: expected %d imap_block%s", n, "", "s");
+	fsprintf(" instead of %d\n", fs->fs_sb.s_imap_blocks);
+  }
+  n = bitmapsize((bit_t) fs->fs_sb.s_zones, fs->fs_block_size);
+  if (fs->fs_sb.s_zmap_blocks < n) fatal("too few zmap blocks");
+  if (fs->fs_sb.s_zmap_blocks != n) {
+	pr("warning: expected %d zmap_block%s", n, "", "s");
+	fsprintf(" instead of %d\n", fs->fs_sb.s_zmap_blocks);
+  }
+  if (fs->fs_sb.s_log_zone_size >= 8 * sizeof(block_nr))
+	fatal("log_zone_size too large");
+  if (fs->fs_sb.s_log_zone_size > 8)
+	fsprintf("warning: large log_zone_size (%d)\n",
+		 fs->fs_sb.s_log_zone_size);
+  fs->fs_sb.s_firstdatazone =
+	(BLK_ILIST + N_ILIST + SCALE - 1) >> fs->fs_sb.s_log_zone_size;
+  if (fs->fs_sb.s_firstdatazone_old != 0) {
+	if (fs->fs_sb.s_firstdatazone_old >= fs->fs_sb.s_zones)
+		fatal("first data zone too large");
+	if (fs->fs_sb.s_firstdatazone_old < fs->fs_sb.s_firstdatazone)
+		fatal("first data zone too small");
+	if (fs->fs_sb.s_firstdatazone_old != fs->fs_sb.s_firstdatazone) {
+		fsprintf("warning: expected first data zone to be %u ",
+			fs->fs_sb.s_firstdatazone);
+		fsprintf("instead of %u\n", fs->fs_sb.s_firstdatazone_old);
+		fs->fs_sb.s_firstdatazone = fs->fs_sb.s_firstdatazone_old;
+	}
+  }
+  maxsize = MAX_FILE_POS;
+  if (((maxsize - 1) >> fs->fs_sb.s_log_zone_size) / fs->fs_block_size >=
+      MAX_ZONES)
+	maxsize = ((long) MAX_ZONES * fs->fs_block_size) <<
+		  fs->fs_sb.s_log_zone_size;
+  if(maxsize <= 0)
+	maxsize = LONG_MAX;
+  if (fs->fs_sb.s_max_size != maxsize) {
+	fsprintf("warning: expected max size to be %ld ", maxsize);
+	fsprintf("instead of %ld\n", fs->fs_sb.s_max_size);
+  }
+
+  if(fs->fs_sb.s_flags & MFSFLAG_MANDATORY_MASK) {
+  	fatal("unsupported feature bits - newer fsck needed");
+  }
+}
+
+int inoblock(int inn)
+{
+  return div64u(mul64u(inn - 1, INODE_SIZE), fs->fs_block_size) + BLK_ILIST;
+}
+
+int inooff(int inn)
+{
+  return rem64u(mul64u(inn - 1, INODE_SIZE), fs->fs_block_size);
+}
+
+/* Read the whole inode table into core with large sequential reads, so
+ * that the tree walk and the later phases don't have to seek for it.
+ * With io_uring the chunks are read as one batch first; the loop then
+ * only rereads what that left out.
+ */
+void loaditable()
+{
+  register block_nr bno;
+  register int n, got, c;
+  struct ioreq *rq = NULL;
+  struct iovec *iov;
+  int nrq;
+  char *p;
+
+  fsprintf("Loading inode table. ");
+  if(!preen) fsprintf("\n");
+  fflush(OUT);
+  fs->fs_itable = (d_inode *) balloc((size_t) N_ILIST * fs->fs_block_size);
+  advise(BLK_ILIST, (long) N_ILIST, 0);
+  if (fs->fs_ring != NULL) {
+	nrq = (N_ILIST + ILIST_CHUNK - 1) / ILIST_CHUNK;
+	rq = (struct ioreq *) alloc((unsigned) nrq, sizeof(struct ioreq));
+	iov = (struct iovec *) alloc((unsigned) nrq, sizeof(struct iovec));
+	for (c = 0; c < nrq; c++) {
+		n = N_ILIST - c * ILIST_CHUNK;
+		if (n > ILIST_CHUNK) n = ILIST_CHUNK;
+		iov[c].iov_base = (char *) fs->fs_itable + c * ILIST_CHUNK * fs->fs_block_size;
+		iov[c].iov_len = n * fs->fs_block_size;
+		rq[c].rq_bno = BLK_ILIST + c * ILIST_CHUNK;
+		rq[c].rq_iov = &iov[c];
+		rq[c].rq_n = 1;
+		rq[c].rq_got = 0;
+	}
+	c = devbatch(rq, nrq);
+	free((char *) iov);
+	if (c < 0) {
+		free((char *) rq);
+		fatal("couldn't read from the io_uring");
+	}
+  }
+  p = (char *) fs->fs_itable;
+  for (bno = BLK_ILIST; bno < BLK_ILIST + N_ILIST; bno += n) {
+	n = BLK_ILIST + N_ILIST - bno;
+	if (n > ILIST_CHUNK) n = ILIST_CHUNK;
+	c = (bno - BLK_ILIST) / ILIST_CHUNK;
+	if (rq != NULL && (bno - BLK_ILIST) % ILIST_CHUNK == 0 &&
+	    rq[c].rq_got == n)
+		got = n;
+	else if (fs->fs_image != NULL && btoa64(bno + n) <= fs->fs_imagesize) {
+		memmove(p, &fs->fs_image[btoa64(bno)], n * fs->fs_block_size);
+		got = n;
+	} else
+		got = devio(bno, p, n, READING);
+	if (got < n) {
+		fsprintf("%s: can't read block %ld (error = 0x%x)\n", prog,
+			 (long) bno + got, errno);
+		fsprintf("Continuing with a zero-filled block.\n");
+		memset(&p[got * fs->fs_block_size], 0, fs->fs_block_size);
+		n = got + 1;
+	}
+	p += n * fs->fs_block_size;
+  }
+  if (rq != NULL) free((char *) rq);
+  advise(BLK_ILIST, (long) N_ILIST, 1);
+}
+
+/* Release the in core inode table. */
+void freeitable()
+{
+  if (fs->fs_itable != NULL) free((char *) fs->fs_itable);
+  fs->fs_itable = NULL;
+}
+
+/* Get inode `ino', from the in core table if it was loaded. */
+void getinode(ino, ip)
+ino_t ino;
+d_inode *ip;
+{
+  if (fs->fs_itable != NULL)
+	*ip = fs->fs_itable[ino - 1];
+  else
+	devread(inoblock(ino), inooff(ino), (char *) ip, INODE_SIZE);
+}
+
+/* Write inode `ino' back, keeping the in core table up to date. */
+void putinode(ino, ip)
+ino_t ino;
+d_inode *ip;
+{
+  if (fs->fs_itable != NULL) fs->fs_itable[ino - 1] = *ip;
+  devwrite(inoblock(ino), inooff(ino), (char *) ip, INODE_SIZE);
+}
+
+/* Make a listing of the inodes given by `clist'.  If `repair' is set, ask
+ * the user for changes.
+ */
+void lsi(clist)
+char **clist;
+{
+  register bit_nr bit;
+  register ino_t ino;
+  d_inode inode, *ip = &inode;
+  char buf[80];
+
+  if (clist == 0) return;
+  while ((bit = getnumber(*clist++)) != NO_BIT) {
+	sbmark(fs->fs_spec_imap, bit);
+	ino = bit;
+	do {
+		getinode(ino, ip);
+		fsprintf("inode %u:\n", ino);
+		fsprintf("    mode   = %6o", ip->i_mode);
+		if (input(buf, 80)) ip->i_mode = atoo(buf);
+		fsprintf("    nlinks = %6u", ip->i_nlinks);
+		if (input(buf, 80)) ip->i_nlinks = atol(buf);
+		fsprintf("    size   = %6ld", ip->i_size);
+		if (input(buf, 80)) ip->i_size = atol(buf);
+		if (yes("Write this back")) {
+			putinode(ino, ip);
+			break;
+		}
+	} while (yes("Do you want to change it again"));
+  }
+}
+
+/* Allocate `nblk' blocks worth of bitmap. */
+bitchunk_t *allocbitmap(nblk)
+int nblk;
+{
+  register bitchunk_t *bitmap;
+
+  bitmap = (bitchunk_t *) alloc((unsigned) nblk, fs->fs_block_size);
+  *bitmap |= 1;
+  return(bitmap);
+}
+
+/* Load the bitmap starting at block `bno' from disk. */
+void loadbitmap(bitmap, bno, nblk)
+bitchunk_t *bitmap;
+block_nr bno;
+int nblk;
+{
+  register i;
+  register bitchunk_t *p;
+
+  p = bitmap;
+  advise(bno, (long) nblk, 0);
+  for (i = 0; i < nblk; i++, bno++, p += WORDS_PER_BLOCK)
+	devread(bno, 0, (char *) p, fs->fs_block_size);
+  advise(bno - nblk, (long) nblk, 1);
+  *bitmap |= 1;
+}
+
+/* Write the bitmap starting at block `bno' to disk. */
+void dumpbitmap(bitmap, bno, nblk)
+bitchunk_t *bitmap;
+block_nr bno;
+int nblk;
+{
+  register i;
+  register bitchunk_t *p = bitmap;
+
+  for (i = 0; i < nblk; i++, bno++, p += WORDS_PER_BLOCK)
+	devwrite(bno, 0, (char *) p, fs->fs_block_size);
+}
+
+/* Set the bits given by `list' in the bitmap. */
+void fillbitmap(bitmap, lwb, upb, list)
+struct sbitmap *bitmap;
+bit_nr lwb, upb;
+char **list;
+{
+  register bit_nr bit;
+
+  if (list == 0) return;
+  while ((bit = getnumber(*list++)) != NO_BIT)
+	if (bit < lwb || bit >= upb) {
+		if (bitmap == fs->fs_spec_imap)
+			fsprintf("inode number %ld ", bit);
+		else
+			fsprintf("zone number %ld ", bit);
+		fsprintf("out of range (ignored)\n");
+	} else
+		sbmark(bitmap, bit - lwb + 1);
+}
+
+/* Deallocate the bitmap `p'. */
+void freebitmap(p)
+bitchunk_t *p;
+{
+  free((char *) p);
+}
+
+/* Allocate a sparse bitmap as large as `nblk' blocks worth of bitmap. */
+struct sbitmap *allocsparse(nblk)
+int nblk;
+{
+  register struct sbitmap *m;
+
+  if ((m = sballoc((long) nblk * fs->fs_block_size * CHAR_BIT)) == NULL)
+	fatal("out of memory");
+  return(m);
+}
+
+/* Set bit `bit' of sparse bitmap `m'. */
+void sbmark(m, bit)
+struct sbitmap *m;
+bit_nr bit;
+{
+  if (sbset(m, (long) bit) < 0) fatal("out of memory");
+}
+
+/* Get all the bitmaps used by this program.  The inode and zone maps are
+ * plain bitmaps; the maps of the inodes and zones to report and of the
+ * directories are sparse.
+ */
+void getbitmaps()
+{
+  fs->fs_imap = allocbitmap(N_IMAP);
+  fs->fs_zmap = allocbitmap(N_ZMAP);
+  fs->fs_spec_imap = allocsparse(N_IMAP);
+  fs->fs_spec_zmap = allocsparse(N_ZMAP);
+  fs->fs_dirmap = allocsparse(N_IMAP);
+}
+
+/* Release all the space taken by the bitmaps. */
+void putbitmaps()
+{
+  freebitmap(fs->fs_imap);
+  freebitmap(fs->fs_zmap);
+  sbfree(fs->fs_spec_imap);
+  sbfree(fs->fs_spec_zmap);
+  sbfree(fs->fs_dirmap);
+  fs->fs_imap = fs->fs_zmap = NULL;
+  fs->fs_spec_imap = fs->fs_spec_zmap = fs->fs_dirmap = NULL;
+}
+
+/* `w1' and `w2' are differing words from two bitmaps that should be
+ * identical.  Print what's the matter with them.
+ */
+void chkword(w1, w2, bit, type, n, report, phys)
+unsigned w1, w2;
+char *type;
+bit_nr bit;
+int *n, *report;
+bit_nr phys;
+{
+  register unsigned d;
+  register int i;
+
+  for (d = w1 ^ w2; d != 0; d &= d - 1) {
+	i = firstbit(d);
+	if (++(*n) % MAXPRINT == 0 && *report &&
+	    (!repair || automatic || yes("stop this listing")))
+		*report = 0;
+	else if (*report)
+		if (w1 >> i & 1)
+			fsprintf("%s %ld is missing\n", type, bit + i);
+		else
+			fsprintf("%s %ld is not free\n", type, bit + i);
+  }
+}
+
+/* Check if the given (correct) bitmap is identical with the one that is
+ * on the disk.  If not, ask if the disk should be repaired.  With -r the
+ * given map only holds the subtree, so only what it has in use and the
+ * disk has free is wrong, and the repair adds that to the disk map.
+ */
+void chkmap(cmap, bit, blkno, nblk, type)
+bitchunk_t *cmap;
+bit_nr bit;
+block_nr blkno;
+int nblk;
+char *type;
+{
+  int report = 1, nerr = 0;
+  int w = nblk * WORDS_PER_BLOCK;
+  register int i;
+  bitchunk_t *dmap;
+
+  fsprintf("Checking %s map. ", type);
+  if(!preen) fsprintf("\n");
+  fflush(OUT);
+  dmap = allocbitmap(nblk);
+  loadbitmap(dmap, blkno, nblk);
+  for (i = 0; (i = mapdiff(dmap, cmap, i, w)) < w; i++)
+	if (scope == NULL)
+		chkword(dmap[i], cmap[i], bit + i * FS_BITCHUNK_BITS, type,
+			&nerr, &report, (bit_nr) i * FS_BITCHUNK_BITS);
+	else if (cmap[i] & ~dmap[i]) {
+		chkword(dmap[i] & cmap[i], cmap[i], bit + i * FS_BITCHUNK_BITS,
+			type, &nerr, &report, (bit_nr) i * FS_BITCHUNK_BITS);
+		dmap[i] |= cmap[i];
+	}
+
+  if ((!repair || automatic) && !report) fsprintf("etc. ");
+  if (nerr > MAXPRINT || nerr > 10) fsprintf("%d errors found. ", nerr);
+  if (nerr != 0 && ask(R_MAP, (ino_t) 0, "install a new map"))
+	dumpbitmap(scope == NULL ? cmap : dmap, blkno, nblk);
+  if (nerr > 0) fsprintf("\n");
+  freebitmap(dmap);
+}
+
+/* See if the inodes that aren't allocated are cleared.  Only the inode
+ * table blocks with free inodes are read, ILIST_CHUNK blocks at a time;
+ * the free inodes are found a word of the inode map at a time, and their
+ * modes are compared with inodesbusy().
+ */
+void chkilist()
+{
+  register ino_t ino;
+  register int i, j, m, ipb = INODES_PER_BLOCK;
+  bitchunk_t bad;
+  long bno, first, last, c;
+  char *buf, *p;
+
+  fsprintf("Checking inode list. ");
+  if(!preen) fsprintf("\n");
+  fflush(OUT);
+  if (fs->fs_itable == NULL) advise(BLK_ILIST, (long) N_ILIST, 0);
+  buf = fs->fs_itable != NULL ? NULL :
+	balloc((size_t) ILIST_CHUNK * fs->fs_block_size);
+  for (c = 0; c < N_ILIST; c += ILIST_CHUNK) {
+	/* Read the blocks of the chunk from the first to the last one
+	 * with a free inode in it, if any.
+	 */
+	first = last = -1;
+	for (bno = c; bno < N_ILIST && bno < c + ILIST_CHUNK; bno++)
+		if (blkfree(bno)) {
+			if (first < 0) first = bno;
+			last = bno;
+		}
+	if (first < 0) continue;
+	if (fs->fs_itable == NULL)
+		devreadblocks(BLK_ILIST + first, (int) (last - first + 1),
+			      &buf[(first - c) * fs->fs_block_size]);
+
+	for (bno = first; bno <= last; bno++) {
+		p = fs->fs_itable != NULL ?
+			(char *) &fs->fs_itable[bno * ipb] :
+			&buf[(bno - c) * fs->fs_block_size];
+		for (i = 0; i < ipb; i += FS_BITCHUNK_BITS) {
+			ino = bno * ipb + i + 1;
+			if (ino > fs->fs_sb.s_ninodes) break;
+			m = ipb - i;
+			if (m > FS_BITCHUNK_BITS) m = FS_BITCHUNK_BITS;
+			if ((bad = freeinodes(ino, m)) == 0) continue;
+			PADD(fs->fs_nchecked, mapcount(&bad, 1));
+			bad &= inodesbusy(&p[i * INODE_SIZE], m, INODE_SIZE);
+			for (; bad != 0; bad &= bad - 1) {
+				j = firstbit(bad);
+				fsprintf("mode inode %u not cleared", ino + j);
+				if (ask(R_CLEAR, ino + j, ". clear"))
+					putinode(ino + j,
+						 (d_inode *) fs->fs_nullbuf);
+			}
+		}
+	}
+  }
+  if (buf != NULL) free(buf);
+  if (fs->fs_itable == NULL) advise(BLK_ILIST, (long) N_ILIST, 1);
+  if(!preen) fsprintf("\n");
+}
+
+/* Return a word with bit i set if inode `ino' + i is free, for the
+ * inodes from `ino' on, at most `n' of them and at most one word.
+ */
+bitchunk_t freeinodes(ino, n)
+ino_t ino;
+int n;
+{
+  if (n > FS_BITCHUNK_BITS) n = FS_BITCHUNK_BITS;
+  if (n > fs->fs_sb.s_ninodes - ino + 1) n = fs->fs_sb.s_ninodes - ino + 1;
+  if (n == FS_BITCHUNK_BITS) return(~getbits(fs->fs_imap, (long) ino, n));
+  return(~getbits(fs->fs_imap, (long) ino, n) & (((bitchunk_t) 1 << n) - 1));
+}
+
+/* Has inode table block `bno', counted from the start of the table, a
+ * free inode in it?
+ */
+int blkfree(bno)
+long bno;
+{
+  register int i, ipb = INODES_PER_BLOCK;
+  register ino_t ino;
+
+  for (i = 0; i < ipb; i += FS_BITCHUNK_BITS) {
+	ino = bno * ipb + i + 1;
+	if (ino > fs->fs_sb.s_ninodes) break;
+	if (freeinodes(ino, ipb - i) != 0) return(1);
+  }
+  return(0);
+}
+
+/* Allocate an array to maintain the inode reference counts in. */
+void getcount()
+{
+  fs->fs_count = (signed char *) alloc((unsigned) (fs->fs_sb.s_ninodes + 1),
+				       sizeof(*fs->fs_count));
+}
+
+/* Return the overflow entry of inode `ino', whose count is CNT_OVER. */
+struct bigcnt *findcnt(ino)
+ino_t ino;
+{
+  register struct bigcnt *op;
+
+  for (op = fs->fs_bigcount[ino % BIGCNT_HASH]; op != NULL; op = op->bc_next)
+	if (op->bc_ino == ino) return(op);
+  fatal("internal error (findcnt)");
+  return(NULL);
+}
+
+/* Return the reference count of inode `ino'. */
+int getcnt(ino)
+ino_t ino;
+{
+  return(fs->fs_count[ino] != CNT_OVER ? fs->fs_count[ino] :
+	 findcnt(ino)->bc_count);
+}
+
+/* Add `n' to the reference count of inode `ino'. */
+void addcnt(ino, n)
+ino_t ino;
+int n;
+{
+  register struct bigcnt *op;
+  register int c;
+
+  if (fs->fs_count[ino] == CNT_OVER) {
+	findcnt(ino)->bc_count += n;
+	return;
+  }
+  c = fs->fs_count[ino] + n;
+  if (c > CNT_OVER && c <= SCHAR_MAX) {
+	fs->fs_count[ino] = c;
+	return;
+  }
+  if (fs->fs_bigcount == NULL)
+	fs->fs_bigcount = (struct bigcnt **) alloc(BIGCNT_HASH,
+						   sizeof(*fs->fs_bigcount));
+  op = (struct bigcnt *) alloc(1, sizeof(struct bigcnt));
+  op->bc_ino = ino;
+  op->bc_count = c;
+  op->bc_next = fs->fs_bigcount[ino % BIGCNT_HASH];
+  fs->fs_bigcount[ino % BIGCNT_HASH] = op;
+  fs->fs_count[ino] = CNT_OVER;
+}
+
+/* The reference count for inode `ino' is wrong.  Ask if it should be adjusted. */
+void counterror(ino_t ino)
+{
+  d_inode inode;
+
+  if (fs->fs_firstcnterr) {
+	fsprintf("INODE NLINK COUNT\n");
+	fs->fs_firstcnterr = 0;
+  }
+  getinode(ino, &inode);
+  addcnt(ino, inode.i_nlinks);	/* it was already subtracted; add it back */
+  fsprintf("%5u %5u %5u", ino, (unsigned) inode.i_nlinks, getcnt(ino));
+  if (ask(R_COUNT, ino, " adjust")) {
+	if ((inode.i_nlinks = getcnt(ino)) == 0) {
+		fatal("internal error (counterror)");
+		inode.i_mode = I_NOT_ALLOC;
+		clrbit(fs->fs_imap, (bit_nr) ino);
+	}
+	putinode(ino, &inode);
+  }
+}
+
+/* Check if the reference count of the inodes are correct.  The array `count'
+ * is maintained as follows:  an entry indexed by the inode number is
+ * incremented each time a link is found; when the inode is read the link
+ * count in there is substracted from the corresponding entry in `count'.
+ * Thus, when the whole file system has been traversed, all the entries
+ * should be zero.  With -r only the inodes of the subtree are looked at.
+ * All links to its directories are in it, but a file may have links from
+ * outside, so a file is only wrong if more links were found than it counts.
+ */
+void chkcount()
+{
+  register ino_t ino;
+  register int c;
+
+  for (ino = 1; (ino = bytescan((char *) fs->fs_count, (long) ino,
+				(long) fs->fs_sb.s_ninodes + 1)) <= fs->fs_sb.s_ninodes; ino++) {
+	c = getcnt(ino);
+	if (scope != NULL && (!bitset(fs->fs_imap, (bit_nr) ino) ||
+			      (c < 0 && !sbtest(fs->fs_dirmap, (bit_nr) ino))))
+		continue;
+	if (c != 0) counterror(ino);
+  }
+  if (!fs->fs_firstcnterr) fsprintf("\n");
+}
+
+/* Deallocate the `count' array and its overflow table. */
+void freecount()
+{
+  register struct bigcnt *op;
+  register int i;
+
+  if (fs->fs_bigcount != NULL) {
+	for (i = 0; i < BIGCNT_HASH; i++)
+		while ((op = fs->fs_bigcount[i]) != NULL) {
+			fs->fs_bigcount[i] = op->bc_next;
+			free((char *) op);
+		}
+	free((char *) fs->fs_bigcount);
+	fs->fs_bigcount = NULL;
+  }
+  free((char *) fs->fs_count);
+  fs->fs_count = NULL;
+}
+
+/* Print the inode permission bits given by mode and shift. */
+void printperm(mode_t mode, int shift, int special, int overlay)
+{
+  if (mode >> shift & R_BIT)
+	putchar('r');
+  else
+	putchar('-');
+  if (mode >> shift & W_BIT)
+	putchar('w');
+  else
+	putchar('-');
+  if (mode & special)
+	putchar(overlay);
+  else
+	if (mode >> shift & X_BIT)
+		putchar('x');
+	else
+		putchar('-');
+}
+
+/* List the given inode. */
+void list(ino_t ino, d_inode *ip)
+{
+  if (fs->fs_firstlist) {
+	fs->fs_firstlist = 0;
+	fsprintf(" inode permission link   size name\n");
+  }
+  fsprintf("%6u ", ino);
+  switch (ip->i_mode & I_TYPE) {
+      case I_REGULAR:		putchar('-');	break;
+      case I_DIRECTORY:		putchar('d');	break;
+      case I_CHAR_SPECIAL:	putchar('c');	break;
+      case I_BLOCK_SPECIAL:	putchar('b');	break;
+      case I_NAMED_PIPE:	putchar('p');	break;
+      case I_UNIX_SOCKET:	putchar('s');	break;
+#ifdef I_SYMBOLIC_LINK
+      case I_SYMBOLIC_LINK:	putchar('l');	break;
+#endif
+      default:			putchar('?');
+}
+  printperm(ip->i_mode, 6, I_SET_UID_BIT, 's');
+  printperm(ip->i_mode, 3, I_SET_GID_BIT, 's');
+  printperm(ip->i_mode, 0, STICKY_BIT, 't');
+  fsprintf(" %3u ", ip->i_nlinks);
+  switch (ip->i_mode & I_TYPE) {
+      case I_CHAR_SPECIAL:
+      case I_BLOCK_SPECIAL:
+	fsprintf("  %2x,%2x ", (dev_t) ip->i_zone[0] >> MAJOR & 0xFF,
+		 (dev_t) ip->i_zone[0] >> MINOR & 0xFF);
+	break;
+      default:	fsprintf("%7ld ", ip->i_size);
+  }
+  printpath(0, 1);
+}
+
+/* Remove an entry from a directory if ok with the user.
+ * Don't name the function remove() - that is owned by ANSI, and chaos results
+ * when it is a macro.
+ */
+int Remove(dir_struct *dp)
+{
+  sbmark(fs->fs_spec_imap, (bit_nr) dp->d_inum);
+  if (ask(R_ENTRY, dp->d_inum, ". remove entry")) {
+	addcnt(dp->d_inum, -1);
+	memset((void *) dp, 0, sizeof(dir_struct));
+	return(1);
+  }
+  return(0);
+}
+
+/* Convert string so that embedded control characters are printable. */
+void make_printable_name(dst, src, n)
+register char *dst;
+register char *src;
+register int n;
+{
+  register int c;
+
+  while (--n >= 0 && (c = *src++) != '\0') {
+	if (isprint(c) && c != '\\')
+		*dst++ = c;
+	else {
+		*dst++ = '\\';
+		switch (c) {
+		      case '\\':
+			*dst++ = '\\'; break;
+		      case '\b':
+			*dst++ = 'b'; break;
+		      case '\f':
+			*dst++ = 'f'; break;
+		      case '\n':
+			*dst++ = 'n'; break;
+		      case '\r':
+			*dst++ = 'r'; break;
+		      case '\t':
+			*dst++ = 't'; break;
+		      default:
+			*dst++ = '0' + ((c >> 6) & 03);
+			*dst++ = '0' + ((c >> 3) & 07);
+			*dst++ = '0' + (c & 07);
+		}
+	}
+  }
+  *dst = '\0';
+}
+
+/* See if the `.' or `..' entry is as expected. */
+int chkdots(ino_t ino, off_t pos, dir_struct *dp, ino_t exp)
+{
+  char printable_name[4 * MFS_NAME_MAX + 1];
+
+  if (dp->d_inum != exp) {
+	make_printable_name(printable_name, dp->mfs_d_name, sizeof(dp->mfs_d_name));
+	fsprintf("bad %s in ", printable_name);
+	printpath(1, 0);
+	fsprintf("%s is linked to %u ", printable_name, dp->d_inum);
+	fsprintf("instead of %u)", exp);
+	sbmark(fs->fs_spec_imap, (bit_nr) ino);
+	sbmark(fs->fs_spec_imap, (bit_nr) dp->d_inum);
+	sbmark(fs->fs_spec_imap, (bit_nr) exp);
+	if (ask(R_DOTS, ino, ". repair")) {
+		addcnt(dp->d_inum, -1);
+		dp->d_inum = exp;
+		addcnt(exp, 1);
+		return(0);
+	}
+  } else if (pos != (dp->mfs_d_name[1] ? DIR_ENTRY_SIZE : 0)) {
+	make_printable_name(printable_name, dp->mfs_d_name, sizeof(dp->mfs_d_name));
+	fsprintf("warning: %s has offset %ld in ", printable_name, pos);
+	printpath(1, 0);
+	fsprintf("%s is linked to %u)\n", printable_name, dp->d_inum);
+	sbmark(fs->fs_spec_imap, (bit_nr) ino);
+	sbmark(fs->fs_spec_imap, (bit_nr) dp->d_inum);
+	sbmark(fs->fs_spec_imap, (bit_nr) exp);
+  }
+  return(1);
+}
+
+/* Check the name in a directory entry. */
+int chkname(ino_t ino, dir_struct *dp)
+{
+  register n = MFS_NAME_MAX + 1;
+  register char *p = dp->mfs_d_name;
+
+  if (*p == '\0') {
+	fsprintf("null name found in ");
+	printpath(0, 0);
+	sbmark(fs->fs_spec_imap, (bit_nr) ino);
+	if (Remove(dp)) return(0);
+  }
+  while (*p != '\0' && --n != 0)
+	if (*p++ == '/') {
+		fsprintf("found a '/' in entry of directory ");
+		printpath(1, 0);
+		sbmark(fs->fs_spec_imap, (bit_nr) ino);
+		fsprintf("entry = '");
+		printname(dp->mfs_d_name);
+		fsprintf("')");
+		if (Remove(dp)) return(0);
+		break;
+	}
+  return(1);
+}
+
+/* Check a directory entry.  Here the routine `descendtree' is called to
+ * check the file or directory pointed to by the entry.
+ */
+int chkentry(ino_t ino, off_t pos, dir_struct *dp)
+{
+  if (dp->d_inum < ROOT_INODE || dp->d_inum > fs->fs_sb.s_ninodes) {
+	fsprintf("bad inode found in directory ");
+	printpath(1, 0);
+	fsprintf("ino found = %u, ", dp->d_inum);
+	fsprintf("name = '");
+	printname(dp->mfs_d_name);
+	fsprintf("')");
+	if (ask(R_ENTRY, dp->d_inum, ". remove entry")) {
+		memset((void *) dp, 0, sizeof(dir_struct));
+		return(0);
+	}
+	return(1);
+  }
+  if ((unsigned) getcnt(dp->d_inum) == SHRT_MAX) {
+	fsprintf("too many links to ino %u\n", dp->d_inum);
+	fsprintf("discovered at entry '");
+	printname(dp->mfs_d_name);
+	fsprintf("' in directory ");
+	printpath(0, 1);
+	if (Remove(dp)) return(0);
+  }
+  addcnt(dp->d_inum, 1);
+  if (strcmp(dp->mfs_d_name, ".") == 0) {
+	fs->fs_ftop->st_presence |= DOT;
+	return(chkdots(ino, pos, dp, ino));
+  }
+  if (strcmp(dp->mfs_d_name, "..") == 0) {
+	fs->fs_ftop->st_presence |= DOTDOT;
+	if (triagepct > 0) return(1);	/* the parent isn't known */
+	return(chkdots(ino, pos, dp, ino == ROOT_INODE ? ino :
+			fs->fs_ftop->st_next->st_dir->d_inum));
+  }
+  if (!chkname(ino, dp)) return(0);
+  if (triagepct > 0) return(1);	/* the tree isn't walked */
+  if (sbtest(fs->fs_dirmap, (bit_nr) dp->d_inum)) {
+	fsprintf("link to directory discovered in ");
+	printpath(1, 0);
+	fsprintf("name = '");
+	printname(dp->mfs_d_name);
+	fsprintf("', dir ino = %u)", dp->d_inum);
+	return !Remove(dp);
+  }
+  return(descendtree(dp));
+}
+
+/* Check a zone of a directory by checking all the entries in the zone.
+ * The zone is read as a whole; blocks with changed entries are written
+ * back after all entries have been checked.
+ */
+int chkdirzone(ino_t ino, d_inode *ip, off_t pos, zone_nr zno)
+{
+  register dir_struct *dp;
+  register int i, dirty;
+  block_nr block= ztob(zno);
+  register off_t size = 0;
+  char *zbuf;
+  int nent = NR_DIR_ENTRIES(fs->fs_block_size);
+
+  if ((zbuf = getzbuf()) == NULL) zbuf = balloc(ZONE_SIZE);
+  devreadblocks(block, SCALE, zbuf);
+  prefetchdir((dir_struct *) zbuf, SCALE * nent);
+  for (i = 0; i < SCALE; i++) {
+	dirty = 0;
+	for (dp = (dir_struct *) &zbuf[i * fs->fs_block_size];
+	     dp < (dir_struct *) &zbuf[(i + 1) * fs->fs_block_size]; dp++) {
+		fs->fs_entblk = block + i;
+		fs->fs_entoff = (char *) dp - &zbuf[i * fs->fs_block_size];
+		if (jnlfile != NULL && dp->d_inum != NO_ENTRY)
+			jnlentry(ino, pos, dp);
+		if (dp->d_inum != NO_ENTRY && !chkentry(ino, pos, dp))
+			dirty = 1;
+		pos += DIR_ENTRY_SIZE;
+		if (dp->d_inum != NO_ENTRY) size = pos;
+	}
+	if (dirty)
+		devwrite(block + i, 0L, &zbuf[i * fs->fs_block_size],
+			 fs->fs_block_size);
+  }
+  putzbuf(zbuf);
+
+  if (size > ip->i_size) {
+	fsprintf("size not updated of directory ");
+	printpath(2, 0);
+	if (ask(R_SIZE, ino, ". extend")) {
+		sbmark(fs->fs_spec_imap, (bit_nr) ino);
+		ip->i_size = size;
+		putinode(ino, ip);
+	}
+  }
+  return(1);
+}
+
+int chksymlinkzone(ino_t ino, d_inode *ip, off_t pos, zone_nr zno)
+{
+	long block;
+	size_t len;
+	char target[PATH_MAX+1];
+
+	if (ip->i_size > PATH_MAX)
+		fatal("chksymlinkzone: fsck program inconsistency\n");
+	block= ztob(zno);
+	devread(block, 0, target, ip->i_size);
+	target[ip->i_size]= '\0';
+	len= strlen(target);
+	if (len != ip->i_size)
+	{
+		fsprintf("bad size in symbolic link (%d instead of %d) ",
+			ip->i_size, len);
+		printpath(2, 0);
+		if (ask(R_SIZE, ino, ". update")) {
+			sbmark(fs->fs_spec_imap, (bit_nr) ino);
+			ip->i_size = len;
+			putinode(ino, ip);
+		}
+	}
+	return 1;
+}
+
+/* There is something wrong with the given zone.  Print some details. */
+void errzone(mess, zno, level, pos)
+char *mess;
+zone_nr zno;
+int level;
+off_t pos;
+{
+  fsprintf("%s zone in ", mess);
+  printpath(1, 0);
+  fsprintf("zno = %ld, type = ", zno);
+  switch (level) {
+      case 0:	fsprintf("DATA");	break;
+      case 1:	fsprintf("SINGLE INDIRECT");	break;
+      case 2:	fsprintf("DOUBLE INDIRECT");	break;
+      default:	fsprintf("VERY INDIRECT");
+  }
+  fsprintf(", pos = %ld)\n", pos);
+}
+
+/* Found the given zone in the given inode.  Check it, and if ok, mark it
+ * in the zone bitmap.
+ */
+int markzone(zno, level, pos)
+zone_nr zno;
+int level;
+off_t pos;
+{
+  register bit_nr bit = (bit_nr) zno - FIRST + 1;
+
+  PADD(fs->fs_ztype[level], 1);
+  if (zno < FIRST || zno >= fs->fs_sb.s_zones) {
+	errzone("out-of-range", zno, level, pos);
+	return(0);
+  }
+  if (bitset(fs->fs_zmap, bit)) {
+	sbmark(fs->fs_spec_zmap, bit);
+	errzone("duplicate", zno, level, pos);
+	return(0);
+  }
+  fs->fs_nfreezone--;
+  if (sbtest(fs->fs_spec_zmap, bit)) errzone("found", zno, level, pos);
+  setbit(fs->fs_zmap, bit);
+  return(1);
+}
+
+/* Check an indirect zone by checking all of its entries.  The block is
+ * read as a whole, and the blocks it points to that will be read next are
+ * prefetched in one go, so adjacent ones are read together.
+ */
+int chkindzone(ino_t ino, d_inode *ip, off_t *pos, zone_nr zno, int level)
+{
+  register zone_nr *indirect;
+  register int i, j, n = 0;
+  char *zbuf;
+  int data, ok = 1;
+
+  if ((zbuf = getzbuf()) == NULL) zbuf = balloc(ZONE_SIZE);
+  devreadblocks(ztob(zno), 1, zbuf);
+  indirect = (zone_nr *) zbuf;
+
+  data = (ip->i_mode & I_TYPE) == I_DIRECTORY ||
+	 (ip->i_mode & I_TYPE) == I_SYMBOLIC_LINK;
+  if (level > 1 || data)
+	for (i = 0; i < NR_INDIRECTS && n < fs->fs_npflist; i++) {
+		if (indirect[i] < FIRST || indirect[i] >= fs->fs_sb.s_zones)
+			continue;
+		for (j = 0; j < (level > 1 ? 1 : SCALE) &&
+		     n < fs->fs_npflist; j++)
+			fs->fs_pflist[n++] = ztob(indirect[i]) + j;
+	}
+  devprefetch(fs->fs_pflist, n);
+
+  for (i = 0; i < NR_INDIRECTS; i += CINDIR) {
+	if (!chkzones(ino, ip, pos, &indirect[i], CINDIR, level - 1)) {
+		ok = 0;
+		break;
+	}
+	if (*pos >= ip->i_size) break;
+  }
+  putzbuf(zbuf);
+  return(ok);
+}
+
+/* Return the size of a gap in the file, represented by a null zone number
+ * at some level of indirection.
+ */
+off_t jump(level)
+int level;
+{
+  off_t power = ZONE_SIZE;
+
+  if (level != 0) do
+		power *= NR_INDIRECTS;
+	while (--level);
+  return(power);
+}
+
+/* Check a zone, which may be either a normal data zone, a directory zone,
+ * or an indirect zone.
+ */
+int zonechk(ino_t ino, d_inode *ip, off_t *pos, zone_nr zno, int level)
+{
+  if (level == 0) {
+	if ((ip->i_mode & I_TYPE) == I_DIRECTORY)
+		queuezone(zno, *pos);
+	if ((ip->i_mode & I_TYPE) == I_SYMBOLIC_LINK &&
+	    !chksymlinkzone(ino, ip, *pos, zno))
+		return(0);
+	*pos += ZONE_SIZE;
+	return(1);
+  } else
+	return chkindzone(ino, ip, pos, zno, level);
+}
+
+/* Check a list of zones given by `zlist'. */
+int chkzones(ino_t ino, d_inode *ip, off_t *pos, zone_nr *zlist,
+ int len, int level)
 {
-  register n = MFS_NAME_MAX + 1;
-  register char *p = dp->mfs_d_name;
+  register ok = 1, i;
 
-  if (*p == '\0') {
-	printf("null name found in ");
-	printpath(0, 0);
-	setbit(spec_imap, (bit_nr) ino);
-	if (Remove(dp)) return(0);
+  /* The check on the position in the next loop is commented out, since FS
+   * now requires valid zone numbers in each level that is necessary and FS
+   * always deleted all the zones in the double indirect block.
+   */
+  for (i = 0; i < len /* && *pos < ip->i_size */ ; i++)
+	if (zlist[i] == NO_ZONE)
+		*pos += jump(level);
+	else if (!markzone(zlist[i], level, *pos)) {
+		*pos += jump(level);
+		ok = 0;
+	} else {
+		if (jnlfile != NULL) jnlzone(ino, zlist[i], level);
+		if (!zonechk(ino, ip, pos, zlist[i], level)) ok = 0;
+	}
+  return(ok);
+}
+
+/* Check a file or a directory. */
+int chkfile(ino_t ino, d_inode *ip)
+{
+  register ok, i, level;
+  off_t pos = 0;
+
+  ok = chkzones(ino, ip, &pos, &ip->i_zone[0], NR_DZONE_NUM, 0);
+  for (i = NR_DZONE_NUM, level = 1; i < NR_ZONE_NUMS; i++, level++)
+	ok &= chkzones(ino, ip, &pos, &ip->i_zone[i], 1, level);
+  return(ok);
+}
+
+/* Check a directory by checking its zones.  The zones are only queued
+ * here; whether . and .. are present is checked by finishdir() once
+ * all of them have been checked.  The frame on top is the directory's.
+ */
+int chkdirectory(ino_t ino, d_inode *ip)
+{
+  fs->fs_ftop->st_walked = 1;
+  sbmark(fs->fs_dirmap, (bit_nr) ino);
+  return(chkfile(ino, ip));
+}
+
+#ifdef I_SYMBOLIC_LINK
+
+/* Check the validity of a symbolic link. */
+int chklink(ino_t ino, d_inode *ip)
+{
+  int ok;
+
+  ok = chkfile(ino, ip);
+  if (ip->i_size <= 0 || ip->i_size > fs->fs_block_size) {
+	if (ip->i_size == 0)
+		fsprintf("empty symbolic link ");
+	else
+		fsprintf("symbolic link too large (size %ld) ", ip->i_size);
+	printpath(2, 1);
+	ok = 0;
   }
-  while (*p != '\0' && --n != 0)
-	if (*p++ == '/') {
-		printf("found a '/' in entry of directory ");
-		printpath(1, 0);
-		setbit(spec_imap, (bit_nr) ino);
-		printf("entry = '");
-		printname(dp->mfs_d_name);
-		printf("')");
-		if (Remove(dp)) return(0);
-		break;
+  return(ok);
+}
+
+#endif
+
+/* Check the validity of a special file. */
+int chkspecial(ino_t ino, d_inode *ip)
+{
+  int i, ok;
+
+  ok = 1;
+  if ((dev_t) ip->i_zone[0] == NO_DEV) {
+	fsprintf("illegal device number %ld for special file ", ip->i_zone[0]);
+	printpath(2, 1);
+	ok = 0;
+  }
+
+  /* FS will not use the remaining "zone numbers" but 1.6.11++ will panic if
+   * they are nonzero, since this should not happen.
+   */
+  for (i = 1; i < NR_ZONE_NUMS; i++)
+	if (ip->i_zone[i] != NO_ZONE) {
+		fsprintf("nonzero zone number %ld for special file ",
+			 ip->i_zone[i]);
+		printpath(2, 1);
+		ok = 0;
+	}
+  return(ok);
+}
+
+/* Check the mode and contents of an inode. */
+int chkmode(ino_t ino, d_inode *ip)
+{
+  switch (ip->i_mode & I_TYPE) {
+      case I_REGULAR:
+	fs->fs_nregular++;
+	return chkfile(ino, ip);
+      case I_DIRECTORY:
+	fs->fs_ndirectory++;
+	return chkdirectory(ino, ip);
+      case I_BLOCK_SPECIAL:
+	fs->fs_nblkspec++;
+	return chkspecial(ino, ip);
+      case I_CHAR_SPECIAL:
+	fs->fs_ncharspec++;
+	return chkspecial(ino, ip);
+      case I_NAMED_PIPE:
+	fs->fs_npipe++;
+	return chkfile(ino, ip);
+      case I_UNIX_SOCKET:
+	fs->fs_nsock++;
+	return chkfile(ino, ip);
+#ifdef I_SYMBOLIC_LINK
+      case I_SYMBOLIC_LINK:
+	fs->fs_nsyml++;
+	return chklink(ino, ip);
+#endif
+      default:
+	fs->fs_nbadinode++;
+	fsprintf("bad mode of ");
+	printpath(1, 0);
+	fsprintf("mode = %o)", ip->i_mode);
+	return(0);
+  }
+}
+
+/* Check an inode. */
+int chkinode(ino_t ino, d_inode *ip)
+{
+  PADD(fs->fs_nchecked, 1);
+  if (ino == ROOT_INODE && (ip->i_mode & I_TYPE) != I_DIRECTORY) {
+	fsprintf("root inode is not a directory ");
+	fsprintf("(ino = %u, mode = %o)\n", ino, ip->i_mode);
+	fatal("");
+  }
+  if (ip->i_nlinks == 0) {
+	fsprintf("link count zero of ");
+	printpath(2, 0);
+	return(0);
+  }
+  if (ip->d2_atime == 0 && ip->d2_mtime == 0) {
+	int a, c;
+
+	fs->fs_nerrors++;
+	fsprintf("Time of inode is corrupted. ");
+	printpath(2, 1);
+	fsprintf("access %u, modified %u, inode modified %u\n",
+		 ip->d2_atime, ip->d2_mtime, ip->d2_ctime);
+	if (policy[R_TIME] != P_DEFAULT) {
+		if (ask(R_TIME, ino, "Should delete")) return(0);
+	} else {
+		fsprintf("Should delete? 0 - no, 1 - yes -> ");
+		fflush(OUT);
+		if (scanf("%d", &a) != 1) a = 0;
+		do c = getchar(); while (!eoln(c));
+		if (replog != NULL)
+			fprintf(replog, "%s\t%s\t%u\t%s\n", fs->fs_device,
+				rclassname[R_TIME], ino,
+				a == 1 ? "repaired" : "skipped");
+		if (a == 1) return(0);
+	}
+  }
+  fs->fs_nfreeinode--;
+  setbit(fs->fs_imap, (bit_nr) ino);
+  if ((unsigned) ip->i_nlinks > SHRT_MAX) {
+	fsprintf("link count too big in ");
+	printpath(1, 0);
+	fsprintf("cnt = %u)\n", (unsigned) ip->i_nlinks);
+	addcnt(ino, -SHRT_MAX);
+	sbmark(fs->fs_spec_imap, (bit_nr) ino);
+  } else {
+	addcnt(ino, -(int) ip->i_nlinks);
+  }
+  return chkmode(ino, ip);
+}
+
+/* Queue directory zone `zno' at position `pos' of the directory whose
+ * frame is on top.
+ */
+void queuezone(zno, pos)
+zone_nr zno;
+off_t pos;
+{
+  register int i, parent;
+  struct work w;
+
+  if (fs->fs_nwork == fs->fs_maxwork) {
+	fs->fs_maxwork = fs->fs_maxwork == 0 ? 256 : 2 * fs->fs_maxwork;
+	fs->fs_worklist = (struct work *) realloc((char *) fs->fs_worklist,
+			fs->fs_maxwork * sizeof(struct work));
+	if (fs->fs_worklist == NULL)
+		fatal("out of memory");
+  }
+  w.wk_zone = zno;
+  w.wk_pos = pos;
+  w.wk_dir = fs->fs_ftop;
+  fs->fs_ftop->st_pending++;
+  for (i = fs->fs_nwork++; i > 0; i = parent) {
+	parent = (i - 1) / 2;
+	if (fs->fs_worklist[parent].wk_zone <= zno) break;
+	fs->fs_worklist[i] = fs->fs_worklist[parent];
+  }
+  fs->fs_worklist[i] = w;
+}
+
+/* With io_uring but without the pool, when directory zone `zno' taken
+ * from the worklist is not cached, load it in one batch with the next
+ * zones on the worklist: up to `qdepth' of them, and no more than a
+ * sixteenth of the cache, or they are pushed out before they are checked.
+ * They are taken from the heap in order by keeping the children of the
+ * ones taken as candidates.
+ */
+void prefetchwork(zno)
+zone_nr zno;
+{
+  int cand[QUEUE_MAX + 2];
+  register int i, j, m, nc;
+  block_nr bno = ztob(zno);
+  int n = 0, max, hit;
+
+  if (fs->fs_ring == NULL || nworkers != 0) return;
+  LOCK(&fs->fs_cachelock);
+  hit = findblock(bno)->cb_blk == bno;
+  UNLOCK(&fs->fs_cachelock);
+  if (hit) return;
+  max = qdepth * SCALE;
+  if (max > fs->fs_ncache / 16) max = fs->fs_ncache / 16;
+  for (j = 0; j < SCALE && n < max; j++) fs->fs_pflist[n++] = bno + j;
+  cand[0] = 0;
+  for (nc = fs->fs_nwork > 0; nc > 0 && n + SCALE <= max; ) {
+	for (m = 0, j = 1; j < nc; j++)
+		if (fs->fs_worklist[cand[j]].wk_zone <
+		    fs->fs_worklist[cand[m]].wk_zone)
+			m = j;
+	i = cand[m];
+	cand[m] = cand[--nc];
+	for (j = 0; j < SCALE; j++)
+		fs->fs_pflist[n++] = ztob(fs->fs_worklist[i].wk_zone) + j;
+	if (2 * i + 1 < fs->fs_nwork) cand[nc++] = 2 * i + 1;
+	if (2 * i + 2 < fs->fs_nwork) cand[nc++] = 2 * i + 2;
+  }
+  devprefetch(fs->fs_pflist, n);
+}
+
+/* Take the lowest numbered directory zone from the worklist. */
+int popzone(wp)
+struct work *wp;
+{
+  register int i, child;
+  struct work last;
+
+  if (fs->fs_nwork == 0) return(0);
+  *wp = fs->fs_worklist[0];
+  last = fs->fs_worklist[--fs->fs_nwork];
+  for (i = 0; (child = 2 * i + 1) < fs->fs_nwork; i = child) {
+	if (child + 1 < fs->fs_nwork &&
+	    fs->fs_worklist[child + 1].wk_zone <
+	    fs->fs_worklist[child].wk_zone)
+		child++;
+	if (last.wk_zone <= fs->fs_worklist[child].wk_zone) break;
+	fs->fs_worklist[i] = fs->fs_worklist[child];
+  }
+  fs->fs_worklist[i] = last;
+  return(1);
+}
+
+/* Make a frame for the directory named by `dp' with inode `ip', below the
+ * frame on top.
+ */
+struct stack *newframe(dp, ip)
+dir_struct *dp;
+d_inode *ip;
+{
+  register struct stack *fp;
+
+  fp = (struct stack *) alloc(1, sizeof(struct stack));
+  fp->st_ent = *dp;
+  fp->st_dir = &fp->st_ent;
+  fp->st_next = fs->fs_ftop;
+  fp->st_inode = *ip;
+  fp->st_entblk = fs->fs_entblk;
+  fp->st_entoff = fs->fs_entoff;
+  if (fs->fs_ftop != 0) fs->fs_ftop->st_refs++;
+  return(fp);
+}
+
+/* Free directory frame `fp' and those of its parents that are no longer
+ * needed.
+ */
+void freeframe(fp)
+struct stack *fp;
+{
+  register struct stack *next;
+
+  while (fp != 0 && fp->st_done && fp->st_refs == 0) {
+	next = fp->st_next;
+	free((char *) fp);
+	if (next != 0) next->st_refs--;
+	fp = next;
+  }
+}
+
+/* All zones of the directory of frame `fp' have been checked.  See if .
+ * and .. were found, if its zones were walked at all, and remove the
+ * directory if anything is wrong with it.  The entry for it is cleared in `dp', or on disk if `dp' is null.
+ * Return 0 if the directory was removed.
+ */
+int finishdir(fp, dp)
+struct stack *fp;
+dir_struct *dp;
+{
+  register ino_t ino = fp->st_ent.d_inum;
+  struct stack *save = fs->fs_ftop;
+  int removed = 0;
+
+  fs->fs_ftop = fp;
+  if (fp->st_walked && !(fp->st_presence & DOT)) {
+	fsprintf(". missing in ");
+	printpath(2, 1);
+	fp->st_ok = 0;
+  }
+  if (fp->st_walked && !(fp->st_presence & DOTDOT)) {
+	fsprintf(".. missing in ");
+	printpath(2, 1);
+	fp->st_ok = 0;
+  }
+  if (!fp->st_ok) {
+	sbmark(fs->fs_spec_imap, (bit_nr) ino);
+	if (ask(R_INODE, ino, "remove")) {
+		if (fp->st_next == 0) fatal("bad root inode");
+		addcnt(ino, fp->st_inode.i_nlinks - 1);
+		clrbit(fs->fs_imap, (bit_nr) ino);
+		putinode(ino, (d_inode *) fs->fs_nullbuf);
+		if (dp != 0)
+			memset((void *) dp, 0, sizeof(dir_struct));
+		else
+			devwrite(fp->st_entblk, (long) fp->st_entoff,
+				 fs->fs_nullbuf, DIR_ENTRY_SIZE);
+		removed = 1;
+	}
+  }
+  fs->fs_ftop = save;
+  fp->st_done = 1;
+  freeframe(fp);
+  return(!removed);
+}
+
+/* Check the directory entry pointed to by dp, by checking the inode.  The
+ * zones of a directory are queued, not checked here.
+ */
+int descendtree(dp)
+dir_struct *dp;
+{
+  d_inode inode, *ip = &inode;
+  register ino_t ino = dp->d_inum;
+  register visited;
+  struct stack stk, *fp;
+
+  stk.st_dir = dp;
+  stk.st_next = fs->fs_ftop;
+  stk.st_presence = 0;
+  fs->fs_ftop = &stk;
+  if (sbtest(fs->fs_spec_imap, (bit_nr) ino)) {
+	fsprintf("found inode %u: ", ino);
+	printpath(0, 1);
+  }
+  visited = bitset(fs->fs_imap, (bit_nr) ino);
+  if (!visited || listing) {
+	getinode(ino, ip);
+	if (listing) list(ino, ip);
+	if (!visited && (ip->i_mode & I_TYPE) == I_DIRECTORY) {
+		fs->fs_ftop = stk.st_next;
+		fs->fs_ftop = fp = newframe(dp, ip);
+		fp->st_ok = chkinode(ino, &fp->st_inode);
+		fs->fs_ftop = stk.st_next;
+		return(fp->st_pending == 0 ? finishdir(fp, dp) : 1);
+	}
+	if (!visited && !chkinode(ino, ip)) {
+		sbmark(fs->fs_spec_imap, (bit_nr) ino);
+		if (ask(R_INODE, ino, "remove")) {
+			addcnt(ino, ip->i_nlinks - 1);
+			clrbit(fs->fs_imap, (bit_nr) ino);
+			putinode(ino, (d_inode *) fs->fs_nullbuf);
+			memset((void *) dp, 0, sizeof(dir_struct));
+			fs->fs_ftop = fs->fs_ftop->st_next;
+			return(0);
+		}
 	}
+  }
+  fs->fs_ftop = fs->fs_ftop->st_next;
   return(1);
 }
 
-/* Check a directory entry.  Here the routine `descendtree' is called
- * recursively to check the file or directory pointed to by the entry.
+/* Look for the entry `name' in the zones in `zlist' of the directory with
+ * inode `ip', walking them the way jnlzones() does.  Return the inode
+ * number of the entry, and leave where it is in entblk and entoff, or
+ * return NO_ENTRY.
+ */
+ino_t lookzones(ip, pos, zlist, len, level, name)
+d_inode *ip;
+off_t *pos;
+zone_nr *zlist;
+int len, level;
+char *name;
+{
+  register dir_struct *dp;
+  register int i, j;
+  char *zbuf;
+  ino_t ino = NO_ENTRY;
+
+  for (i = 0; ino == NO_ENTRY && i < len && *pos < ip->i_size; i++) {
+	if (zlist[i] == NO_ZONE) {
+		*pos += jump(level);
+		continue;
+	}
+	if (zlist[i] < FIRST || zlist[i] >= fs->fs_sb.s_zones) break;
+	if ((zbuf = getzbuf()) == NULL) zbuf = balloc(ZONE_SIZE);
+	if (level == 0) {
+		devreadblocks(ztob(zlist[i]), SCALE, zbuf);
+		for (dp = (dir_struct *) zbuf;
+		     dp < (dir_struct *) &zbuf[ZONE_SIZE] && *pos < ip->i_size;
+		     dp++, *pos += DIR_ENTRY_SIZE)
+			if (dp->d_inum != NO_ENTRY &&
+			    strncmp(dp->mfs_d_name, name, MFS_NAME_MAX) == 0) {
+				j = (char *) dp - zbuf;
+				fs->fs_entblk = ztob(zlist[i]) +
+						j / fs->fs_block_size;
+				fs->fs_entoff = j % fs->fs_block_size;
+				ino = dp->d_inum;
+				break;
+			}
+	} else {
+		devreadblocks(ztob(zlist[i]), 1, zbuf);
+		for (j = 0; ino == NO_ENTRY && j < NR_INDIRECTS &&
+			    *pos < ip->i_size; j += CINDIR)
+			ino = lookzones(ip, pos, &((zone_nr *) zbuf)[j],
+					CINDIR, level - 1, name);
+	}
+	putzbuf(zbuf);
+  }
+  return(ino);
+}
+
+/* Look up `name' in the directory with inode `ip'. */
+ino_t lookup(ip, name)
+d_inode *ip;
+char *name;
+{
+  register int i, level;
+  off_t pos = 0;
+  ino_t ino;
+
+  if (strlen(name) > MFS_NAME_MAX) return(NO_ENTRY);
+  ino = lookzones(ip, &pos, &ip->i_zone[0], NR_DZONE_NUM, 0, name);
+  for (i = NR_DZONE_NUM, level = 1; ino == NO_ENTRY && i < NR_ZONE_NUMS;
+       i++, level++)
+	ino = lookzones(ip, &pos, &ip->i_zone[i], 1, level, name);
+  return(ino);
+}
+
+/* Start the walk at the file named by the path `scope' (-r).  The path is
+ * looked up from the root, and the directories on it get frames that stay
+ * until freepath(), so the .. of the file is checked against its parent
+ * and paths are printed in full.  The entry of the file is counted as a
+ * link, as its parent would have.
+ */
+void chkpath()
+{
+  dir_struct dir;
+  d_inode inode;
+  register struct stack *fp;
+  register char *name, *next;
+  char path[PATH_MAX+1];
+  block_nr blk;
+  int off;
+
+  strcpy(path, scope);
+  memset((void *) &dir, 0, sizeof(dir));
+  dir.d_inum = ROOT_INODE;
+  getinode(ROOT_INODE, &inode);
+  for (name = path; *name != '\0'; name = next) {
+	if ((next = strchr(name, '/')) != NULL)
+		*next++ = '\0';
+	else
+		next = name + strlen(name);
+	if (*name == '\0' || strcmp(name, ".") == 0) continue;
+	if (strcmp(name, "..") == 0) {
+		if ((fp = fs->fs_ftop) == 0) continue;
+		dir = fp->st_ent;
+		inode = fp->st_inode;
+		fs->fs_entblk = fp->st_entblk;
+		fs->fs_entoff = fp->st_entoff;
+		if ((fs->fs_path = fs->fs_ftop = fp->st_next) != 0)
+			fs->fs_ftop->st_refs--;
+		free((char *) fp);
+		continue;
+	}
+	if ((inode.i_mode & I_TYPE) != I_DIRECTORY) {
+		fsprintf("%s: ", scope);
+		printname(dir.mfs_d_name);
+		fsprintf(" is not a directory\n");
+		fatal("bad path");
+	}
+	fs->fs_path = fs->fs_ftop = newframe(&dir, &inode);
+	if ((dir.d_inum = lookup(&inode, name)) == NO_ENTRY ||
+	    dir.d_inum > fs->fs_sb.s_ninodes) {
+		fsprintf("%s: no entry %s\n", scope, name);
+		fatal("bad path");
+	}
+	strncpy(dir.mfs_d_name, name, MFS_NAME_MAX);
+	getinode(dir.d_inum, &inode);
+  }
+  if (fs->fs_ftop == 0) {
+	if (!descendtree(&dir)) fatal("bad root inode");
+	return;
+  }
+  addcnt(dir.d_inum, 1);
+  blk = fs->fs_entblk;
+  off = fs->fs_entoff;
+  if (!descendtree(&dir))
+	devwrite(blk, (long) off, fs->fs_nullbuf, DIR_ENTRY_SIZE);
+}
+
+/* Free the frames of the directories above the path of -r. */
+void freepath()
+{
+  register struct stack *fp;
+
+  while ((fp = fs->fs_path) != 0) {
+	fs->fs_path = fp->st_next;
+	free((char *) fp);
+  }
+}
+
+/* Check the file system tree.  The directory zones queued while checking
+ * the root and each directory entry are taken from the worklist in disk
+ * order until none are left.  With -K the walk goes on from a checkpoint,
+ * if there is one, and is checkpointed every CKPT_SECS seconds.  With -r
+ * it starts at the path given instead of the root.
+ */
+void chktree()
+{
+  dir_struct dir;
+  struct work w;
+  register long n;
+
+  fs->fs_ftop = 0;
+  if (scope != NULL) {
+	fs->fs_nfreeinode = fs->fs_sb.s_ninodes;
+	fs->fs_nfreezone = N_DATA;
+	fs->fs_nwork = 0;
+	chkpath();
+  } else if (ckptfile == NULL || !loadckpt()) {
+	fs->fs_nfreeinode = fs->fs_sb.s_ninodes;
+	fs->fs_nfreezone = N_DATA;
+	dir.d_inum = ROOT_INODE;
+	dir.mfs_d_name[0] = 0;
+	fs->fs_nwork = 0;
+	if (!descendtree(&dir)) fatal("bad root inode");
+  }
+  fs->fs_knext = clocktime(CLOCK_MONOTONIC) + CKPT_SECS;
+  for (n = 1; ; n++) {
+	if (ckptfile != NULL && n % CKPT_TEST == 0 &&
+	    clocktime(CLOCK_MONOTONIC) >= fs->fs_knext) {
+		saveckpt();
+		fs->fs_knext = clocktime(CLOCK_MONOTONIC) + CKPT_SECS;
+	}
+	if (!popzone(&w)) break;
+	prefetchwork(w.wk_zone);
+	fs->fs_ftop = w.wk_dir;
+	chkdirzone(w.wk_dir->st_ent.d_inum, &w.wk_dir->st_inode, w.wk_pos,
+		   w.wk_zone);
+	fs->fs_ftop = 0;
+	if (--w.wk_dir->st_pending == 0) finishdir(w.wk_dir, 0);
+  }
+  free((char *) fs->fs_worklist);
+  fs->fs_worklist = NULL;
+  fs->fs_maxwork = 0;
+  freepath();
+  putchar('\n');
+}
+
+/* Print the totals of all the objects found. */
+void printtotal()
+{
+  fsprintf("\nSummary of files, inode, zone details:\n");
+  fsprintf("======================================\n");
+  pr("%8u    file%s\n", fs->fs_nregular, "", "s");
+  pr("%8u    Director%s\n", fs->fs_ndirectory, "y", "ies");
+  pr("%8u    Symbolic link%s\n", fs->fs_nsyml, "", "s");
+  fsprintf("\n");
+
+  fsprintf("blocksize = %5d        ", fs->fs_block_size);
+  fsprintf("zonesize  = %5d\n", ZONE_SIZE);
+
+  if (fs->fs_nbadinode != 0)
+	pr("%6u    Bad inode%s\n", fs->fs_nbadinode, "", "s");
+  if (scope == NULL) pr("%8u    Free inode%s\n", fs->fs_nfreeinode, "", "s");
+
+  pr("%8u    Data zone%s\n",		  fs->fs_ztype[0],	 "",   "s");
+  pr("%8u    Single indirect zone%s\n",	  fs->fs_ztype[1],	 "",   "s");
+  pr("%8u    Double indirect zone%s\n",	  fs->fs_ztype[2],	 "",   "s");
+  if (scope == NULL) lpr("%8ld    Free zone%s\n", fs->fs_nfreezone, "", "s");
+
+  return;
+}
+
+/* Return the time of clock `id' in seconds. */
+double clocktime(id)
+clockid_t id;
+{
+  struct timespec ts;
+
+  clock_gettime(id, &ts);
+  return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/* Take the totals a phase starts or ends with.  The CPU time is that of
+ * the process, so it has what the prefetch threads used; with -P it also
+ * has what the other checks running used.
+ */
+void getmark(pp)
+struct phase *pp;
+{
+  register int i;
+
+  pp->ph_wall = clocktime(CLOCK_MONOTONIC);
+  pp->ph_cpu = clocktime(CLOCK_PROCESS_CPUTIME_ID);
+  LOCK(&fs->fs_cachelock);
+  LOCK(&fs->fs_iolock);
+  pp->ph_reads = fs->fs_nrdcalls;
+  pp->ph_writes = fs->fs_nwrcalls;
+  pp->ph_rdbytes = fs->fs_nrdbytes;
+  pp->ph_wrbytes = fs->fs_nwrbytes;
+  pp->ph_hits = fs->fs_cachehits;
+  pp->ph_misses = fs->fs_cachemisses;
+  UNLOCK(&fs->fs_iolock);
+  UNLOCK(&fs->fs_cachelock);
+  pp->ph_inodes = fs->fs_nchecked;
+  for (pp->ph_zones = 0, i = 0; i < NLEVEL; i++)
+	pp->ph_zones += fs->fs_ztype[i];
+}
+
+/* End the phase running, if any, and start phase `p', unless it is -1.
+ * A phase that runs more than once adds up.
  */
-int chkentry(ino_t ino, off_t pos, dir_struct *dp)
+void phase(p)
+int p;
 {
-  if (dp->d_inum < ROOT_INODE || dp->d_inum > sb.s_ninodes) {
-	printf("bad inode found in directory ");
-	printpath(1, 0);
-	printf("ino found = %u, ", dp->d_inum);
-	printf("name = '");
-	printname(dp->mfs_d_name);
-	printf("')");
-	if (yes(". remove entry")) {
-		memset((void *) dp, 0, sizeof(dir_struct));
-		return(0);
-	}
-	return(1);
-  }
-  if ((unsigned) count[dp->d_inum] == SHRT_MAX) {
-	printf("too many links to ino %u\n", dp->d_inum);
-	printf("discovered at entry '");
-	printname(dp->mfs_d_name);
-	printf("' in directory ");
-	printpath(0, 1);
-	if (Remove(dp)) return(0);
-  }
-  count[dp->d_inum]++;
-  if (strcmp(dp->mfs_d_name, ".") == 0) {
-	ftop->st_presence |= DOT;
-	return(chkdots(ino, pos, dp, ino));
+  struct phase now;
+  register struct phase *pp, *mp = &fs->fs_mark;
+
+  getmark(&now);
+  if (fs->fs_curphase >= 0) {
+	pp = &fs->fs_phase[fs->fs_curphase];
+	pp->ph_wall += now.ph_wall - mp->ph_wall;
+	pp->ph_cpu += now.ph_cpu - mp->ph_cpu;
+	pp->ph_reads += now.ph_reads - mp->ph_reads;
+	pp->ph_writes += now.ph_writes - mp->ph_writes;
+	pp->ph_rdbytes += now.ph_rdbytes - mp->ph_rdbytes;
+	pp->ph_wrbytes += now.ph_wrbytes - mp->ph_wrbytes;
+	pp->ph_hits += now.ph_hits - mp->ph_hits;
+	pp->ph_misses += now.ph_misses - mp->ph_misses;
+	pp->ph_inodes += now.ph_inodes - mp->ph_inodes;
+	pp->ph_zones += now.ph_zones - mp->ph_zones;
   }
-  if (strcmp(dp->mfs_d_name, "..") == 0) {
-	ftop->st_presence |= DOTDOT;
-	return(chkdots(ino, pos, dp, ino == ROOT_INODE ? ino :
-			ftop->st_next->st_dir->d_inum));
+  *mp = now;
+  PSET(fs->fs_curphase, p);
+}
+
+/* Add the figures of phase `pp' to those of `tot'. */
+void addphase(tot, pp)
+struct phase *tot, *pp;
+{
+  tot->ph_wall += pp->ph_wall;
+  tot->ph_cpu += pp->ph_cpu;
+  tot->ph_reads += pp->ph_reads;
+  tot->ph_writes += pp->ph_writes;
+  tot->ph_rdbytes += pp->ph_rdbytes;
+  tot->ph_wrbytes += pp->ph_wrbytes;
+  tot->ph_hits += pp->ph_hits;
+  tot->ph_misses += pp->ph_misses;
+  tot->ph_inodes += pp->ph_inodes;
+  tot->ph_zones += pp->ph_zones;
+}
+
+/* Print what each phase took.  Blocks read and written are counted in
+ * file system blocks; the rate is that of the bytes read and written.
+ */
+void printphases()
+{
+  register int i;
+  register struct phase *pp;
+  struct phase tot;
+  double bs = fs->fs_block_size != 0 ? fs->fs_block_size : 1;
+
+  memset((void *) &tot, 0, sizeof(tot));
+  fsprintf("\nPhase        Wall s   CPU s    Read Written     Hits   Inodes    Zones     kB/s\n");
+  for (i = 0; i <= NR_PHASE; i++) {
+	if (i < NR_PHASE) {
+		pp = &fs->fs_phase[i];
+		if (pp->ph_wall == 0) continue;
+		addphase(&tot, pp);
+	} else
+		pp = &tot;
+	fsprintf("%-10s %7.3f %7.3f %7.0f %7.0f %8ld %8ld %8ld %8.0f\n",
+		 i < NR_PHASE ? phasename[i] : "total", pp->ph_wall, pp->ph_cpu,
+		 pp->ph_rdbytes / bs, pp->ph_wrbytes / bs, pp->ph_hits,
+		 pp->ph_inodes, pp->ph_zones, pp->ph_wall == 0 ? 0.0 :
+		 (pp->ph_rdbytes + pp->ph_wrbytes) / 1024.0 / pp->ph_wall);
   }
-  if (!chkname(ino, dp)) return(0);
-  if (bitset(dirmap, (bit_nr) dp->d_inum)) {
-	printf("link to directory discovered in ");
-	printpath(1, 0);
-	printf("name = '");
-	printname(dp->mfs_d_name);
-	printf("', dir ino = %u)", dp->d_inum);
-	return !Remove(dp);
+}
+
+/* Write the figures of phase `pp' as the members of a JSON object. */
+void jsonphase(fp, pp)
+FILE *fp;
+struct phase *pp;
+{
+  fprintf(fp, "\"wall\": %.6f, \"cpu\": %.6f, \"reads\": %ld, \"writes\": %ld, ",
+	  pp->ph_wall, pp->ph_cpu, pp->ph_reads, pp->ph_writes);
+  fprintf(fp, "\"bytes_read\": %llu, \"bytes_written\": %llu, ",
+	  (unsigned long long) pp->ph_rdbytes,
+	  (unsigned long long) pp->ph_wrbytes);
+  fprintf(fp, "\"cache_hits\": %ld, \"cache_misses\": %ld, ",
+	  pp->ph_hits, pp->ph_misses);
+  fprintf(fp, "\"inodes\": %ld, \"zones\": %ld, \"bytes_per_second\": %.0f",
+	  pp->ph_inodes, pp->ph_zones, pp->ph_wall == 0 ? 0.0 :
+	  (pp->ph_rdbytes + pp->ph_wrbytes) / pp->ph_wall);
+}
+
+/* Write string `s' as a JSON string. */
+void jsonstring(fp, s)
+FILE *fp;
+char *s;
+{
+  putc('"', fp);
+  for (; *s != '\0'; s++)
+	if (*s == '"' || *s == '\\')
+		fprintf(fp, "\\%c", *s);
+	else if ((unsigned char) *s < ' ')
+		fprintf(fp, "\\u%04x", (unsigned char) *s);
+	else
+		putc(*s, fp);
+  putc('"', fp);
+}
+
+/* Append the statistics of the check of device `f', which ended with exit
+ * status `r', to the statistics file, as one element of a JSON array.
+ */
+void savestats(f, r)
+char *f;
+int r;
+{
+  register int i, n = 0;
+  register struct phase *pp;
+  struct phase tot;
+
+  memset((void *) &tot, 0, sizeof(tot));
+  pthread_mutex_lock(&statlock);
+  fprintf(statfile, "%s  { \"device\": ", nstats++ == 0 ? "" : ",\n");
+  jsonstring(statfile, f);
+  fprintf(statfile, ", \"status\": %d, \"block_size\": %d, \"modified\": %s,\n",
+	  r, fs->fs_block_size, fs->fs_changed ? "true" : "false");
+  fprintf(statfile, "    \"phases\": [");
+  for (i = 0; i < NR_PHASE; i++) {
+	pp = &fs->fs_phase[i];
+	if (pp->ph_wall == 0) continue;
+	addphase(&tot, pp);
+	fprintf(statfile, "%s\n      { \"phase\": \"%s\", ",
+		n++ == 0 ? "" : ",", phasename[i]);
+	jsonphase(statfile, pp);
+	fprintf(statfile, " }");
   }
-  return(descendtree(dp));
+  fprintf(statfile, " ],\n    \"total\": { ");
+  jsonphase(statfile, &tot);
+  fprintf(statfile, " } }");
+  fflush(statfile);
+  pthread_mutex_unlock(&statlock);
 }
 
-/* Check a zone of a directory by checking all the entries in the zone.
- * The zone is split up into chunks to not allocate too much stack.
+/* Estimate the work of the check for the progress report.  Every inode is
+ * checked once, in the tree walk or in the inode list check, and so is
+ * every zone the zone map on the device has in use.
  */
-int chkdirzone(ino_t ino, d_inode *ip, off_t pos, zone_nr zno)
+void estimate()
 {
-  dir_struct dirblk[CDIRECT];
-  register dir_struct *dp;
-  register n, dirty;
-  long block= ztob(zno);
-  register long offset = 0;
-  register off_t size = 0;
-  n = SCALE * (NR_DIR_ENTRIES(block_size) / CDIRECT);
+  bitchunk_t *dmap;
+  long used;
+
+  dmap = allocbitmap(N_ZMAP);
+  loadbitmap(dmap, BLK_ZMAP, N_ZMAP);
+  used = bitsused(dmap, (long) fs->fs_sb.s_zones - FIRST + 1);
+  freebitmap(dmap);
+  PSET(fs->fs_estimate, (long) fs->fs_sb.s_ninodes + used);
+}
 
-  do {
-	devread(block, offset, (char *) dirblk, DIRCHUNK);
-	dirty = 0;
-	for (dp = dirblk; dp < &dirblk[CDIRECT]; dp++) {
-		if (dp->d_inum != NO_ENTRY && !chkentry(ino, pos, dp))
-			dirty = 1;
-		pos += DIR_ENTRY_SIZE;
-		if (dp->d_inum != NO_ENTRY) size = pos;
-	}
-	if (dirty) devwrite(block, offset, (char *) dirblk, DIRCHUNK);
-	offset += DIRCHUNK;
-	n--;
-  } while (n > 0);
+/* Return the number of bits set among bits 1 to `n' - 1 of bitmap `map'
+ * as loaded from the device; bit 0 stands for no inode or zone, and the
+ * bits past the end of the map are left out.
+ */
+long bitsused(map, n)
+bitchunk_t *map;
+long n;
+{
+  bitchunk_t w;
+  long used;
 
-  if (size > ip->i_size) {
-	printf("size not updated of directory ");
-	printpath(2, 0);
-	if (yes(". extend")) {
-		setbit(spec_imap, (bit_nr) ino);
-		ip->i_size = size;
-		devwrite(inoblock(ino), inooff(ino), (char *) ip, INODE_SIZE);
-	}
+  used = mapcount(map, (int) (n / FS_BITCHUNK_BITS));
+  if (n % FS_BITCHUNK_BITS != 0) {
+	w = getbits(map, n - n % FS_BITCHUNK_BITS, (int) (n % FS_BITCHUNK_BITS));
+	used += mapcount(&w, 1);
   }
-  return(1);
+  return(used - (map[0] & 1));
 }
 
+/* Hash `n' bytes at `p' into `h' (FNV-1a). */
+u32_t jhash(h, p, n)
+u32_t h;
+char *p;
+int n;
+{
+  while (n-- > 0) h = (h ^ (unsigned char) *p++) * FNV_PRIME;
+  return(h);
+}
 
-int chksymlinkzone(ino_t ino, d_inode *ip, off_t pos, zone_nr zno)
+/* Make room for one more element after the `n' in array `p'. */
+char *jgrow(p, n, max, size)
+char *p;
+long n, *max;
+unsigned size;
 {
-	long block;
-	size_t len;
-	char target[PATH_MAX+1];
+  if (n < *max) return(p);
+  *max = *max == 0 ? 1024 : 2 * *max;
+  if ((p = realloc(p, (size_t) *max * size)) == NULL) fatal("out of memory");
+  return(p);
+}
 
-	if (ip->i_size > PATH_MAX)
-		fatal("chksymlinkzone: fsck program inconsistency\n");
-	block= ztob(zno);
-	devread(block, 0, target, ip->i_size);
-	target[ip->i_size]= '\0';
-	len= strlen(target);
-	if (len != ip->i_size)
-	{
-		printf("bad size in symbolic link (%d instead of %d) ",
-			ip->i_size, len);
-		printpath(2, 0);
-		if (yes(". update")) {
-			setbit(spec_imap, (bit_nr) ino);
-			ip->i_size = len;
-			devwrite(inoblock(ino), inooff(ino), 
-				(char *) ip, INODE_SIZE);
-		}
-	}
-	return 1;
+/* Update the record of inode `ino' from the in core inode table.  The sum
+ * and parent of a directory are kept; they are set by jnlentry().
+ */
+void jnlrecord(ino)
+ino_t ino;
+{
+  d_inode inode;
+  register struct jinode *jp = &fs->fs_jnew[ino];
+
+  inode = fs->fs_itable[ino - 1];
+  inode.d2_atime = 0;
+  jp->ji_ctime = inode.d2_ctime;
+  jp->ji_size = inode.i_size;
+  jp->ji_hash = jhash((u32_t) FNV_BASIS, (char *) &inode, INODE_SIZE);
+  jp->ji_mode = inode.i_mode;
+  jp->ji_nlinks = inode.i_nlinks;
 }
 
-/* There is something wrong with the given zone.  Print some details. */
-void errzone(mess, zno, level, pos)
-char *mess;
-zone_nr zno;
-int level;
+/* Note entry `dp' at position `pos' of directory `ino'. */
+void jnlentry(ino, pos, dp)
+ino_t ino;
 off_t pos;
+dir_struct *dp;
 {
-  printf("%s zone in ", mess);
-  printpath(1, 0);
-  printf("zno = %ld, type = ", zno);
-  switch (level) {
-      case 0:	printf("DATA");	break;
-      case 1:	printf("SINGLE INDIRECT");	break;
-      case 2:	printf("DOUBLE INDIRECT");	break;
-      default:	printf("VERY INDIRECT");
+  u32_t off = pos;
+  register struct jlink *lp;
+
+  fs->fs_jnew[ino].ji_sum += jhash(jhash((u32_t) FNV_BASIS, (char *) &off,
+			sizeof(off)), (char *) dp, DIR_ENTRY_SIZE);
+  if (strcmp(dp->mfs_d_name, ".") == 0) return;
+  if (strcmp(dp->mfs_d_name, "..") == 0) {
+	fs->fs_jnew[ino].ji_parent = dp->d_inum;
+	return;
   }
-  printf(", pos = %ld)\n", pos);
+  fs->fs_jnewlinks = (struct jlink *) jgrow((char *) fs->fs_jnewlinks,
+					    fs->fs_njnewlinks,
+				&fs->fs_maxjnewlinks, sizeof(struct jlink));
+  lp = &fs->fs_jnewlinks[fs->fs_njnewlinks++];
+  lp->jl_dir = ino;
+  lp->jl_ino = dp->d_inum;
 }
 
-/* Found the given zone in the given inode.  Check it, and if ok, mark it
- * in the zone bitmap.
+/* Note that zone `zno', at indirection level `level', is owned by inode
+ * `ino'.
  */
-int markzone(zno, level, pos)
+void jnlzone(ino, zno, level)
+ino_t ino;
 zone_nr zno;
 int level;
-off_t pos;
 {
-  register bit_nr bit = (bit_nr) zno - FIRST + 1;
+  register struct jextent *ep;
 
-  ztype[level]++;
-  if (zno < FIRST || zno >= sb.s_zones) {
-	errzone("out-of-range", zno, level, pos);
+  if (fs->fs_njnewexts > 0) {
+	ep = &fs->fs_jnewexts[fs->fs_njnewexts - 1];
+	if (ep->je_ino == ino && ep->je_level == level &&
+	    ep->je_zone + ep->je_len == zno) {
+		ep->je_len++;
+		return;
+	}
+  }
+  fs->fs_jnewexts = (struct jextent *) jgrow((char *) fs->fs_jnewexts,
+					     fs->fs_njnewexts,
+				&fs->fs_maxjnewexts, sizeof(struct jextent));
+  ep = &fs->fs_jnewexts[fs->fs_njnewexts++];
+  ep->je_zone = zno;
+  ep->je_len = 1;
+  ep->je_ino = ino;
+  ep->je_level = level;
+}
+
+/* Count the totals of a check against the journal as a full check would:
+ * the inodes in use in inode map `im' by type, from the inode table, and
+ * the zones of the extents kept and found by level.
+ */
+void jnltotals(im)
+bitchunk_t *im;
+{
+  register ino_t ino;
+  register long i;
+  register struct jextent *ep;
+  long used = 0;
+
+  fs->fs_nfreeinode = fs->fs_sb.s_ninodes;
+  for (ino = 1; ino <= fs->fs_sb.s_ninodes; ino++) {
+	if (!bitset(im, (bit_nr) ino)) continue;
+	fs->fs_nfreeinode--;
+	switch (fs->fs_itable[ino - 1].i_mode & I_TYPE) {
+	    case I_REGULAR:		fs->fs_nregular++;	break;
+	    case I_DIRECTORY:		fs->fs_ndirectory++;	break;
+	    case I_BLOCK_SPECIAL:	fs->fs_nblkspec++;	break;
+	    case I_CHAR_SPECIAL:	fs->fs_ncharspec++;	break;
+	    case I_NAMED_PIPE:		fs->fs_npipe++;		break;
+	    case I_UNIX_SOCKET:		fs->fs_nsock++;		break;
+#ifdef I_SYMBOLIC_LINK
+	    case I_SYMBOLIC_LINK:	fs->fs_nsyml++;		break;
+#endif
+	}
+  }
+  for (i = 0, ep = fs->fs_jexts; i < fs->fs_njexts; i++, ep++)
+	if (!bitset(fs->fs_jchg, (bit_nr) ep->je_ino)) {
+		PADD(fs->fs_ztype[ep->je_level], ep->je_len);
+		used += ep->je_len;
+	}
+  for (i = 0, ep = fs->fs_jnewexts; i < fs->fs_njnewexts; i++, ep++) {
+	PADD(fs->fs_ztype[ep->je_level], ep->je_len);
+	used += ep->je_len;
+  }
+  fs->fs_nfreezone = N_DATA - used;
+}
+
+/* The journal can't vouch for the file system.  Say why; return 0. */
+int jfail(why, ino)
+char *why;
+ino_t ino;
+{
+  fsprintf("Journal: %s", why);
+  if (ino != 0) fsprintf(" (ino = %u)", ino);
+  fsprintf(", checking the whole file system\n");
+  return(0);
+}
+
+/* Read `n' elements of `size' bytes from the journal. */
+int jnlread(fp, p, n, size)
+FILE *fp;
+char *p;
+long n;
+unsigned size;
+{
+  return(n == 0 || fread(p, size, (size_t) n, fp) == n);
+}
+
+/* Read the journal.  Return 0 if there is none, or if it is not one of
+ * this file system.
+ */
+int loadjournal()
+{
+  FILE *fp;
+  struct jheader jh;
+  long i;
+  int ok;
+
+  if ((fp = fopen(jnlfile, "r")) == NULL) {
+	if (errno != ENOENT) perror(jnlfile);
 	return(0);
   }
-  if (bitset(zmap, bit)) {
-	setbit(spec_zmap, bit);
-	errzone("duplicate", zno, level, pos);
+  if (fread((char *) &jh, sizeof(jh), 1, fp) != 1 ||
+      jh.jh_magic != JNL_MAGIC || jh.jh_version != JNL_VERSION ||
+      jh.jh_ninodes != fs->fs_sb.s_ninodes ||
+      jh.jh_zones != fs->fs_sb.s_zones ||
+      jh.jh_firstdata != FIRST || jh.jh_blocksize != fs->fs_block_size ||
+      jh.jh_imapblocks != N_IMAP || jh.jh_zmapblocks != N_ZMAP) {
+	fclose(fp);
+	fsprintf("Journal %s is not one of this file system.\n", jnlfile);
 	return(0);
   }
-  nfreezone--;
-  if (bitset(spec_zmap, bit)) errzone("found", zno, level, pos);
-  setbit(zmap, bit);
+  fs->fs_jimap = allocbitmap(N_IMAP);
+  fs->fs_jzmap = allocbitmap(N_ZMAP);
+  fs->fs_jold = (struct jinode *) alloc(fs->fs_sb.s_ninodes + 1,
+					sizeof(struct jinode));
+  fs->fs_njlinks = jh.jh_nlink;
+  fs->fs_njexts = jh.jh_next;
+  fs->fs_jlinks = (struct jlink *) alloc(fs->fs_njlinks + 1,
+					 sizeof(struct jlink));
+  fs->fs_jexts = (struct jextent *) alloc(fs->fs_njexts + 1,
+					  sizeof(struct jextent));
+  ok = jnlread(fp, (char *) fs->fs_jimap, N_IMAP, fs->fs_block_size) &&
+       jnlread(fp, (char *) fs->fs_jzmap, N_ZMAP, fs->fs_block_size) &&
+       jnlread(fp, (char *) fs->fs_jold, fs->fs_sb.s_ninodes + 1,
+	       sizeof(struct jinode)) &&
+       jnlread(fp, (char *) fs->fs_jlinks, fs->fs_njlinks,
+	       sizeof(struct jlink)) &&
+       jnlread(fp, (char *) fs->fs_jexts, fs->fs_njexts,
+	       sizeof(struct jextent));
+  fclose(fp);
+  for (i = 0; ok && i < fs->fs_njexts; i++)
+	if (fs->fs_jexts[i].je_level >= NLEVEL) ok = 0;
+  if (!ok) {
+	fsprintf("Journal %s is truncated.\n", jnlfile);
+	freejournal();
+	return(0);
+  }
+  fs->fs_jnew = (struct jinode *) alloc(fs->fs_sb.s_ninodes + 1,
+					sizeof(struct jinode));
+  memcpy((void *) fs->fs_jnew, (void *) fs->fs_jold,
+	 (fs->fs_sb.s_ninodes + 1) * sizeof(struct jinode));
   return(1);
 }
 
-/* Check an indirect zone by checking all of its entries.
- * The zone is split up into chunks to not allocate too much stack.
+/* Forget the journal read, if any, before a check of the whole file
+ * system collects a new one.
  */
-int chkindzone(ino_t ino, d_inode *ip, off_t *pos, zone_nr zno, int level)
+void newjournal()
+{
+  freejournal();
+  fs->fs_jnew = (struct jinode *) alloc(fs->fs_sb.s_ninodes + 1,
+					sizeof(struct jinode));
+}
+
+/* Order directory entries on directory. */
+int linkcmp(a, b)
+const void *a, *b;
 {
-  zone_nr indirect[CINDIR];
-  register n = NR_INDIRECTS / CINDIR;
-  long block= ztob(zno);
-  register long offset = 0;
+  u32_t x = ((struct jlink *) a)->jl_dir, y = ((struct jlink *) b)->jl_dir;
 
-  do {
-	devread(block, offset, (char *) indirect, INDCHUNK);
-	if (!chkzones(ino, ip, pos, indirect, CINDIR, level - 1)) return(0);
-	offset += INDCHUNK;
-  } while (--n && *pos < ip->i_size);
-  return(1);
+  return(x < y ? -1 : x > y);
 }
 
-/* Return the size of a gap in the file, represented by a null zone number
- * at some level of indirection.
+/* See if directory `dir' has an entry for `ino', as found if the directory
+ * was reread, or as saved otherwise.
  */
-off_t jump(level)
-int level;
+int haslink(dir, ino)
+ino_t dir, ino;
 {
-  off_t power = ZONE_SIZE;
+  register long lo = 0, hi = fs->fs_njlinks, mid;
 
-  if (level != 0) do
-		power *= NR_INDIRECTS;
-	while (--level);
-  return(power);
+  if (fs->fs_jreread != NULL && bitset(fs->fs_jreread, (bit_nr) dir)) {
+	for (mid = 0; mid < fs->fs_njnewlinks; mid++)
+		if (fs->fs_jnewlinks[mid].jl_dir == dir &&
+		    fs->fs_jnewlinks[mid].jl_ino == ino) return(1);
+	return(0);
+  }
+  while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (fs->fs_jlinks[mid].jl_dir < dir) lo = mid + 1; else hi = mid;
+  }
+  for (; lo < fs->fs_njlinks && fs->fs_jlinks[lo].jl_dir == dir; lo++)
+	if (fs->fs_jlinks[lo].jl_ino == ino) return(1);
+  return(0);
 }
 
-/* Check a zone, which may be either a normal data zone, a directory zone,
- * or an indirect zone.
+/* Write the journal, with bit maps `im' and `zm'.  What was saved about the
+ * directories reread and the inodes changed is replaced by what was found.
+ * The journal is written under a temporary name and then renamed, so a
+ * crash never leaves half a journal.
  */
-int zonechk(ino_t ino, d_inode *ip, off_t *pos, zone_nr zno, int level)
+void savejournal(im, zm)
+bitchunk_t *im, *zm;
 {
-  if (level == 0) {
-	if ((ip->i_mode & I_TYPE) == I_DIRECTORY &&
-	    !chkdirzone(ino, ip, *pos, zno))
-		return(0);
-	if ((ip->i_mode & I_TYPE) == I_SYMBOLIC_LINK &&
-	    !chksymlinkzone(ino, ip, *pos, zno))
-		return(0);
-	*pos += ZONE_SIZE;
-	return(1);
-  } else
-	return chkindzone(ino, ip, pos, zno, level);
+  struct jheader jh;
+  struct jlink *lp;
+  struct jextent *ep;
+  register long i, nl = 0, ne = 0;
+  register ino_t ino;
+  char *tmp;
+  FILE *fp;
+  int ok;
+
+  for (ino = 1; ino <= fs->fs_sb.s_ninodes; ino++) jnlrecord(ino);
+  lp = (struct jlink *) alloc(fs->fs_njlinks + fs->fs_njnewlinks + 1,
+			      sizeof(struct jlink));
+  for (i = 0; i < fs->fs_njlinks; i++)
+	if (fs->fs_jreread == NULL ||
+	    !bitset(fs->fs_jreread, (bit_nr) fs->fs_jlinks[i].jl_dir))
+		lp[nl++] = fs->fs_jlinks[i];
+  for (i = 0; i < fs->fs_njnewlinks; i++) lp[nl++] = fs->fs_jnewlinks[i];
+  qsort((void *) lp, (size_t) nl, sizeof(struct jlink), linkcmp);
+  ep = (struct jextent *) alloc(fs->fs_njexts + fs->fs_njnewexts + 1,
+				sizeof(struct jextent));
+  for (i = 0; i < fs->fs_njexts; i++)
+	if (fs->fs_jchg == NULL ||
+	    !bitset(fs->fs_jchg, (bit_nr) fs->fs_jexts[i].je_ino))
+		ep[ne++] = fs->fs_jexts[i];
+  for (i = 0; i < fs->fs_njnewexts; i++) ep[ne++] = fs->fs_jnewexts[i];
+
+  jh.jh_magic = JNL_MAGIC;
+  jh.jh_version = JNL_VERSION;
+  jh.jh_ninodes = fs->fs_sb.s_ninodes;
+  jh.jh_zones = fs->fs_sb.s_zones;
+  jh.jh_firstdata = FIRST;
+  jh.jh_blocksize = fs->fs_block_size;
+  jh.jh_imapblocks = N_IMAP;
+  jh.jh_zmapblocks = N_ZMAP;
+  jh.jh_nlink = nl;
+  jh.jh_next = ne;
+
+  tmp = alloc(strlen(jnlfile) + 5, 1);
+  sprintf(tmp, "%s.new", jnlfile);
+  if ((fp = fopen(tmp, "w")) == NULL) {
+	perror(tmp);
+	ok = 0;
+  } else {
+	ok = fwrite((char *) &jh, sizeof(jh), 1, fp) == 1 &&
+	     fwrite((char *) im, fs->fs_block_size, N_IMAP, fp) == N_IMAP &&
+	     fwrite((char *) zm, fs->fs_block_size, N_ZMAP, fp) == N_ZMAP &&
+	     fwrite((char *) fs->fs_jnew, sizeof(struct jinode),
+		    fs->fs_sb.s_ninodes + 1, fp) == fs->fs_sb.s_ninodes + 1 &&
+	     fwrite((char *) lp, sizeof(struct jlink), nl, fp) == nl &&
+	     fwrite((char *) ep, sizeof(struct jextent), ne, fp) == ne;
+	if (fclose(fp) != 0) ok = 0;
+	if (ok && rename(tmp, jnlfile) < 0) ok = 0;
+	if (!ok) {
+		perror(jnlfile);
+		unlink(tmp);
+	}
+  }
+  if (ok) fsprintf("Journal %s updated.\n", jnlfile);
+  free(tmp);
+  free((char *) lp);
+  free((char *) ep);
 }
 
-/* Check a list of zones given by `zlist'. */
-int chkzones(ino_t ino, d_inode *ip, off_t *pos, zone_nr *zlist,
- int len, int level)
+/* Release everything read or collected for the journal. */
+void freejournal()
 {
-  register ok = 1, i;
+  if (fs->fs_jimap != NULL) freebitmap(fs->fs_jimap);
+  if (fs->fs_jzmap != NULL) freebitmap(fs->fs_jzmap);
+  if (fs->fs_jchg != NULL) freebitmap(fs->fs_jchg);
+  if (fs->fs_jreread != NULL) freebitmap(fs->fs_jreread);
+  if (fs->fs_jzmapnew != NULL) freebitmap(fs->fs_jzmapnew);
+  if (fs->fs_jold != NULL) free((char *) fs->fs_jold);
+  if (fs->fs_jnew != NULL) free((char *) fs->fs_jnew);
+  if (fs->fs_jlinks != NULL) free((char *) fs->fs_jlinks);
+  if (fs->fs_jnewlinks != NULL) free((char *) fs->fs_jnewlinks);
+  if (fs->fs_jexts != NULL) free((char *) fs->fs_jexts);
+  if (fs->fs_jnewexts != NULL) free((char *) fs->fs_jnewexts);
+  if (fs->fs_jdelta != NULL) free((char *) fs->fs_jdelta);
+  fs->fs_jimap = fs->fs_jzmap = fs->fs_jchg = fs->fs_jreread = NULL;
+  fs->fs_jzmapnew = NULL;
+  fs->fs_jold = fs->fs_jnew = NULL;
+  fs->fs_jlinks = fs->fs_jnewlinks = NULL;
+  fs->fs_jexts = fs->fs_jnewexts = NULL;
+  fs->fs_jdelta = NULL;
+  fs->fs_njlinks = fs->fs_njnewlinks = fs->fs_maxjnewlinks = 0;
+  fs->fs_njexts = fs->fs_njnewexts = fs->fs_maxjnewexts = 0;
+}
 
-  /* The check on the position in the next loop is commented out, since FS
-   * now requires valid zone numbers in each level that is necessary and FS
-   * always deleted all the zones in the double indirect block.
-   */
-  for (i = 0; i < len /* && *pos < ip->i_size */ ; i++)
-	if (zlist[i] == NO_ZONE)
-		*pos += jump(level);
-	else if (!markzone(zlist[i], level, *pos)) {
-		*pos += jump(level);
-		ok = 0;
-	} else if (!zonechk(ino, ip, pos, zlist[i], level))
-		ok = 0;
+/* Reread zone `zno' at position `pos' of directory `ino', checking its
+ * entries and counting the links they make.
+ */
+int jnldirzone(ino, pos, zno)
+ino_t ino;
+off_t pos;
+zone_nr zno;
+{
+  register dir_struct *dp;
+  register char *p;
+  char *zbuf;
+  int ok = 1;
+
+  if ((zbuf = getzbuf()) == NULL) zbuf = balloc(ZONE_SIZE);
+  devreadblocks(ztob(zno), SCALE, zbuf);
+  for (dp = (dir_struct *) zbuf; ok && dp < (dir_struct *) &zbuf[ZONE_SIZE];
+       dp++, pos += DIR_ENTRY_SIZE) {
+	if (dp->d_inum == NO_ENTRY) continue;
+	fs->fs_jdirsize = pos + DIR_ENTRY_SIZE;
+	if (dp->d_inum < ROOT_INODE || dp->d_inum > fs->fs_sb.s_ninodes)
+		ok = jfail("bad inode in directory entry", ino);
+	else if (strcmp(dp->mfs_d_name, ".") == 0) {
+		fs->fs_jpresence |= DOT;
+		if (dp->d_inum != ino) ok = jfail("bad .", ino);
+	} else if (strcmp(dp->mfs_d_name, "..") == 0) {
+		fs->fs_jpresence |= DOTDOT;
+		if (ino == ROOT_INODE && dp->d_inum != ino)
+			ok = jfail("bad ..", ino);
+	} else {
+		p = memchr(dp->mfs_d_name, '/', MFS_NAME_MAX);
+		if (dp->mfs_d_name[0] == '\0' || p != NULL)
+			ok = jfail("bad name in directory entry", ino);
+	}
+	if (ok) {
+		jnlentry(ino, pos, dp);
+		fs->fs_jdelta[dp->d_inum]++;
+	}
+  }
+  putzbuf(zbuf);
   return(ok);
 }
 
-/* Check a file or a directory. */
-int chkfile(ino_t ino, d_inode *ip)
+/* Walk the zones in `zlist' of inode `ino' the way chkzones() does, without
+ * reporting.  The zones are marked in jzmapnew if `jmark' is set, and the
+ * zones of a directory to reread are reread.
+ */
+int jnlzones(ino, ip, pos, zlist, len, level)
+ino_t ino;
+d_inode *ip;
+off_t *pos;
+zone_nr *zlist;
+int len, level;
 {
-  register ok, i, level;
+  register int i, j;
+  register bit_nr bit;
+  char *zbuf;
+  int ok;
+
+  for (i = 0; i < len; i++) {
+	if (zlist[i] == NO_ZONE) {
+		*pos += jump(level);
+		continue;
+	}
+	if (zlist[i] < FIRST || zlist[i] >= fs->fs_sb.s_zones)
+		return(jfail("zone out of range", ino));
+	bit = (bit_nr) zlist[i] - FIRST + 1;
+	if (fs->fs_jmark) {
+		if (bitset(fs->fs_jzmapnew, bit)) return(jfail("duplicate zone", ino));
+		setbit(fs->fs_jzmapnew, bit);
+		jnlzone(ino, zlist[i], level);
+	}
+	if (level == 0) {
+		if ((ip->i_mode & I_TYPE) == I_DIRECTORY &&
+		    bitset(fs->fs_jreread, (bit_nr) ino) &&
+		    !jnldirzone(ino, *pos, zlist[i]))
+			return(0);
+		*pos += ZONE_SIZE;
+		continue;
+	}
+	if ((zbuf = getzbuf()) == NULL) zbuf = balloc(ZONE_SIZE);
+	devreadblocks(ztob(zlist[i]), 1, zbuf);
+	ok = 1;
+	for (j = 0; ok && j < NR_INDIRECTS; j += CINDIR) {
+		ok = jnlzones(ino, ip, pos, &((zone_nr *) zbuf)[j], CINDIR,
+			      level - 1);
+		if (*pos >= ip->i_size) break;
+	}
+	putzbuf(zbuf);
+	if (!ok) return(0);
+  }
+  return(1);
+}
+
+/* Recheck inode `ino', which has changed or is a directory to reread. */
+int jnlinode(ino, ip)
+ino_t ino;
+d_inode *ip;
+{
+  register int i, level;
   off_t pos = 0;
+  char target[PATH_MAX+1];
 
-  ok = chkzones(ino, ip, &pos, &ip->i_zone[0], NR_DZONE_NUM, 0);
+  fs->fs_jmark = bitset(fs->fs_jchg, (bit_nr) ino);
+  switch (ip->i_mode & I_TYPE) {
+      case I_REGULAR:
+      case I_DIRECTORY:
+      case I_NAMED_PIPE:
+      case I_UNIX_SOCKET:
+#ifdef I_SYMBOLIC_LINK
+      case I_SYMBOLIC_LINK:
+#endif
+	break;
+      case I_BLOCK_SPECIAL:
+      case I_CHAR_SPECIAL:
+	if ((dev_t) ip->i_zone[0] == NO_DEV)
+		return(jfail("bad device number", ino));
+	for (i = 1; i < NR_ZONE_NUMS; i++)
+		if (ip->i_zone[i] != NO_ZONE)
+			return(jfail("zone in special file", ino));
+	return(1);
+      default:
+	return(jfail("bad mode", ino));
+  }
+  if (fs->fs_jmark && ip->d2_atime == 0 && ip->d2_mtime == 0)
+	return(jfail("corrupted times", ino));
+  if ((ip->i_mode & I_TYPE) == I_DIRECTORY &&
+      bitset(fs->fs_jreread, (bit_nr) ino)) {
+	fs->fs_jnew[ino].ji_sum = 0;
+	fs->fs_jnew[ino].ji_parent = 0;
+	fs->fs_jpresence = 0;
+	fs->fs_jdirsize = 0;
+  }
+  if (!jnlzones(ino, ip, &pos, &ip->i_zone[0], NR_DZONE_NUM, 0)) return(0);
   for (i = NR_DZONE_NUM, level = 1; i < NR_ZONE_NUMS; i++, level++)
-	ok &= chkzones(ino, ip, &pos, &ip->i_zone[i], 1, level);
-  return(ok);
+	if (!jnlzones(ino, ip, &pos, &ip->i_zone[i], 1, level)) return(0);
+  if ((ip->i_mode & I_TYPE) == I_DIRECTORY &&
+      bitset(fs->fs_jreread, (bit_nr) ino)) {
+	if (fs->fs_jpresence != (DOT | DOTDOT))
+		return(jfail(". or .. missing", ino));
+	if (fs->fs_jdirsize > ip->i_size)
+		return(jfail("size not updated of directory", ino));
+	if (!fs->fs_jmark &&
+	    fs->fs_jnew[ino].ji_sum != fs->fs_jold[ino].ji_sum)
+		return(jfail("directory changed but not its inode", ino));
+  }
+#ifdef I_SYMBOLIC_LINK
+  if ((ip->i_mode & I_TYPE) == I_SYMBOLIC_LINK && fs->fs_jmark) {
+	if (ip->i_size <= 0 || ip->i_size > fs->fs_block_size ||
+	    ip->i_zone[0] == NO_ZONE)
+		return(jfail("bad symbolic link", ino));
+	devread(ztob(ip->i_zone[0]), 0, target, ip->i_size);
+	target[ip->i_size] = '\0';
+	if (strlen(target) != ip->i_size)
+		return(jfail("bad size in symbolic link", ino));
+  }
+#endif
+  return(1);
 }
 
-/* Check a directory by checking the contents.  Check if . and .. are present. */
-int chkdirectory(ino_t ino, d_inode *ip)
+/* Check the file system against the journal: recheck the inodes that have
+ * changed since it was saved and the directories they are entered in, then
+ * see if the bit maps on disk are what they should be.  Return 0 if that
+ * can't be done or something is wrong; the whole file system should then
+ * be checked.
+ */
+int chkjournal()
 {
-  register ok;
+  register ino_t ino;
+  register long i, k;
+  register struct jextent *ep;
+  register d_inode *ip;
+  bitchunk_t *dimap, *dzmap, *jimapnew;
+  int refs, ok = 1, nchg = 0, nreread = 0;
+
+  if (!loadjournal()) return(0);
+  fsprintf("Checking against journal %s. ", jnlfile);
+  if(!preen) fsprintf("\n");
+  fflush(OUT);
+
+  /* Find the inodes whose record changed. */
+  fs->fs_jchg = allocbitmap(N_IMAP);
+  fs->fs_jreread = allocbitmap(N_IMAP);
+  for (ino = 1; ino <= fs->fs_sb.s_ninodes; ino++) {
+	jnlrecord(ino);
+	if (memcmp((void *) &fs->fs_jnew[ino], (void *) &fs->fs_jold[ino],
+		   sizeof(struct jinode)) == 0) continue;
+	setbit(fs->fs_jchg, (bit_nr) ino);
+	nchg++;
+	if ((fs->fs_jold[ino].ji_mode & I_TYPE) == I_DIRECTORY ||
+	    (fs->fs_jnew[ino].ji_mode & I_TYPE) == I_DIRECTORY)
+		setbit(fs->fs_jreread, (bit_nr) ino);
+  }
+  for (i = 0; i < fs->fs_njlinks; i++)
+	if (bitset(fs->fs_jchg, (bit_nr) fs->fs_jlinks[i].jl_ino))
+		setbit(fs->fs_jreread, (bit_nr) fs->fs_jlinks[i].jl_dir);
 
-  setbit(dirmap, (bit_nr) ino);
-  ok = chkfile(ino, ip);
-  if (!(ftop->st_presence & DOT)) {
-	printf(". missing in ");
-	printpath(2, 1);
-	ok = 0;
+  /* Take back the links made by the directories to reread, and the zones
+   * of the inodes that changed.
+   */
+  fs->fs_jdelta = (int *) alloc(fs->fs_sb.s_ninodes + 1, sizeof(int));
+  for (i = 0; i < fs->fs_njlinks; i++)
+	if (bitset(fs->fs_jreread, (bit_nr) fs->fs_jlinks[i].jl_dir))
+		fs->fs_jdelta[fs->fs_jlinks[i].jl_ino]--;
+  for (ino = 1; ino <= fs->fs_sb.s_ninodes; ino++)
+	if (bitset(fs->fs_jreread, (bit_nr) ino) &&
+	    (fs->fs_jold[ino].ji_mode & I_TYPE) == I_DIRECTORY) {
+		fs->fs_jdelta[ino]--;
+		fs->fs_jdelta[fs->fs_jold[ino].ji_parent]--;
+	}
+  fs->fs_jzmapnew = allocbitmap(N_ZMAP);
+  memcpy((void *) fs->fs_jzmapnew, (void *) fs->fs_jzmap,
+	 N_ZMAP * fs->fs_block_size);
+  for (i = 0, ep = fs->fs_jexts; i < fs->fs_njexts; i++, ep++)
+	if (bitset(fs->fs_jchg, (bit_nr) ep->je_ino))
+		for (k = 0; k < ep->je_len; k++)
+			clrbit(fs->fs_jzmapnew,
+			       (bit_nr) ep->je_zone + k - FIRST + 1);
+
+  /* Recheck those inodes and reread those directories. */
+  for (ino = 1; ok && ino <= fs->fs_sb.s_ninodes; ino++) {
+	if (!bitset(fs->fs_jchg, (bit_nr) ino) &&
+	    !bitset(fs->fs_jreread, (bit_nr) ino))
+		continue;
+	ip = &fs->fs_itable[ino - 1];
+	if (ip->i_mode == I_NOT_ALLOC) continue;
+	ok = jnlinode(ino, ip);
+	if ((ip->i_mode & I_TYPE) == I_DIRECTORY &&
+	    bitset(fs->fs_jreread, (bit_nr) ino)) nreread++;
   }
-  if (!(ftop->st_presence & DOTDOT)) {
-	printf(".. missing in ");
-	printpath(2, 1);
-	ok = 0;
+
+  /* See if the link counts add up, and build the inode map. */
+  jimapnew = allocbitmap(N_IMAP);
+  memcpy((void *) jimapnew, (void *) fs->fs_jimap, N_IMAP * fs->fs_block_size);
+  for (ino = 1; ok && ino <= fs->fs_sb.s_ninodes; ino++) {
+	if (!bitset(fs->fs_jchg, (bit_nr) ino) &&
+	    fs->fs_jdelta[ino] == 0) continue;
+	ip = &fs->fs_itable[ino - 1];
+	refs = fs->fs_jdelta[ino];
+	if (bitset(fs->fs_jimap, (bit_nr) ino))
+		refs += fs->fs_jold[ino].ji_nlinks;
+	if (refs < 0)
+		ok = jfail("links lost", ino);
+	else if (refs == 0) {
+		if (ip->i_mode != I_NOT_ALLOC)
+			ok = jfail("mode inode not cleared", ino);
+		clrbit(jimapnew, (bit_nr) ino);
+	} else if (ip->i_mode == I_NOT_ALLOC)
+		ok = jfail("entry for a free inode", ino);
+	else if (ip->i_nlinks != refs)
+		ok = jfail("wrong link count", ino);
+	else if ((ip->i_mode & I_TYPE) == I_DIRECTORY && ino != ROOT_INODE &&
+		 !haslink((ino_t) fs->fs_jnew[ino].ji_parent, ino))
+		ok = jfail("bad ..", ino);
+	else
+		setbit(jimapnew, (bit_nr) ino);
+  }
+  if (ok && (fs->fs_itable[ROOT_INODE - 1].i_mode & I_TYPE) != I_DIRECTORY)
+	ok = jfail("root inode is not a directory", ROOT_INODE);
+  for (i = 0; ok && i < fs->fs_njnewlinks; i++) {
+	ino = fs->fs_jnewlinks[i].jl_ino;
+	if ((fs->fs_itable[ino - 1].i_mode & I_TYPE) == I_DIRECTORY &&
+	    fs->fs_jnew[ino].ji_parent != fs->fs_jnewlinks[i].jl_dir)
+		ok = jfail("link to directory", ino);
+  }
+
+  /* The bit maps on disk should be the ones built. */
+  dimap = allocbitmap(N_IMAP);
+  dzmap = allocbitmap(N_ZMAP);
+  if (ok) {
+	loadbitmap(dimap, BLK_IMAP, N_IMAP);
+	loadbitmap(dzmap, BLK_ZMAP, N_ZMAP);
+	k = N_IMAP * WORDS_PER_BLOCK;
+	if (mapdiff(dimap, jimapnew, 0, (int) k) < k)
+		ok = jfail("inode map differs", (ino_t) 0);
+	k = N_ZMAP * WORDS_PER_BLOCK;
+	if (ok && mapdiff(dzmap, fs->fs_jzmapnew, 0, (int) k) < k)
+		ok = jfail("zone map differs", (ino_t) 0);
   }
+  if (ok) {
+	if (nchg == 0)
+		fsprintf("Journal: nothing changed since the last check\n");
+	else
+		fsprintf("Journal: %d inode%s changed, %d director%s reread, no problems found\n",
+			 nchg, nchg == 1 ? "" : "s",
+			 nreread, nreread == 1 ? "y" : "ies");
+	jnltotals(jimapnew);
+	savejournal(dimap, dzmap);
+  }
+  freebitmap(dimap);
+  freebitmap(dzmap);
+  freebitmap(jimapnew);
   return(ok);
 }
 
-#ifdef I_SYMBOLIC_LINK
+/* Number the frames of the directories being walked, found from the
+ * zones queued, with a new mark.  Return how many there are.
+ */
+long numberframes()
+{
+  register long i, n = 0;
+  register struct stack *fp;
+
+  fs->fs_kmark++;
+  for (i = 0; i < fs->fs_nwork; i++)
+	for (fp = fs->fs_worklist[i].wk_dir;
+	     fp != 0 && fp->st_mark != fs->fs_kmark; fp = fp->st_next) {
+		fp->st_mark = fs->fs_kmark;
+		fp->st_index = n++;
+	}
+  return(n);
+}
 
-/* Check the validity of a symbolic link. */
-int chklink(ino_t ino, d_inode *ip)
+/* Write the bits set in sparse bitmap `m', followed by CKPT_END. */
+int savesparse(kp, m)
+FILE *kp;
+struct sbitmap *m;
 {
-  int ok;
+  u32_t w;
+  long bit;
 
-  ok = chkfile(ino, ip);
-  if (ip->i_size <= 0 || ip->i_size > block_size) {
-	if (ip->i_size == 0)
-		printf("empty symbolic link ");
-	else
-		printf("symbolic link too large (size %ld) ", ip->i_size);
-	printpath(2, 1);
-	ok = 0;
+  for (bit = sbnext(m, 0L); bit >= 0; bit = sbnext(m, bit + 1)) {
+	w = (u32_t) bit;
+	if (fwrite((char *) &w, sizeof(w), 1, kp) != 1) return(0);
   }
-  return(ok);
+  w = CKPT_END;
+  return(fwrite((char *) &w, sizeof(w), 1, kp) == 1);
 }
 
-#endif
-
-/* Check the validity of a special file. */
-int chkspecial(ino_t ino, d_inode *ip)
+/* Save a checkpoint of the tree walk.  The repairs held are written first,
+ * so the device agrees with it.  It is written under a temporary name,
+ * synced and renamed, so a crash leaves the last checkpoint whole.
+ */
+void saveckpt()
 {
-  int i, ok;
+  struct kheader kh;
+  struct kframe kf;
+  struct kwork kw;
+  struct bigcnt *op;
+  register struct stack *fp;
+  register long i;
+  long nframe, nbig = 0;
+  u32_t magic = CKPT_MAGIC;
+  char *tmp;
+  FILE *kp;
+  int ok;
 
-  ok = 1;
-  if ((dev_t) ip->i_zone[0] == NO_DEV) {
-	printf("illegal device number %ld for special file ", ip->i_zone[0]);
-	printpath(2, 1);
-	ok = 0;
+  drainpool();
+  flushdirty();
+  nframe = numberframes();
+  for (i = 0; fs->fs_bigcount != NULL && i < BIGCNT_HASH; i++)
+	for (op = fs->fs_bigcount[i]; op != NULL; op = op->bc_next) nbig++;
+
+  memset((void *) &kh, 0, sizeof(kh));
+  kh.kh_magic = CKPT_MAGIC;
+  kh.kh_version = CKPT_VERSION;
+  kh.kh_ninodes = fs->fs_sb.s_ninodes;
+  kh.kh_zones = fs->fs_sb.s_zones;
+  kh.kh_firstdata = FIRST;
+  kh.kh_blocksize = fs->fs_block_size;
+  kh.kh_imapblocks = N_IMAP;
+  kh.kh_zmapblocks = N_ZMAP;
+  ckptid(&kh);
+  kh.kh_nframe = nframe;
+  kh.kh_nwork = fs->fs_nwork;
+  kh.kh_nbig = nbig;
+  kh.kh_nregular = fs->fs_nregular;
+  kh.kh_ndirectory = fs->fs_ndirectory;
+  kh.kh_nblkspec = fs->fs_nblkspec;
+  kh.kh_ncharspec = fs->fs_ncharspec;
+  kh.kh_nbadinode = fs->fs_nbadinode;
+  kh.kh_nsock = fs->fs_nsock;
+  kh.kh_npipe = fs->fs_npipe;
+  kh.kh_nsyml = fs->fs_nsyml;
+  for (i = 0; i < NLEVEL; i++) kh.kh_ztype[i] = fs->fs_ztype[i];
+  kh.kh_nfreeinode = fs->fs_nfreeinode;
+  kh.kh_nfreezone = fs->fs_nfreezone;
+  kh.kh_nchecked = fs->fs_nchecked;
+  kh.kh_changed = fs->fs_changed;
+  kh.kh_notrepaired = fs->fs_notrepaired;
+  kh.kh_nerrors = fs->fs_nerrors;
+  kh.kh_firstcnterr = fs->fs_firstcnterr;
+  kh.kh_firstlist = fs->fs_firstlist;
+
+  tmp = alloc(strlen(ckptfile) + 5, 1);
+  sprintf(tmp, "%s.new", ckptfile);
+  if ((kp = fopen(tmp, "w")) == NULL) {
+	perror(tmp);
+	free(tmp);
+	return;
   }
-
-  /* FS will not use the remaining "zone numbers" but 1.6.11++ will panic if
-   * they are nonzero, since this should not happen.
-   */
-  for (i = 1; i < NR_ZONE_NUMS; i++)
-	if (ip->i_zone[i] != NO_ZONE) {
-		printf("nonzero zone number %ld for special file ",
-		       ip->i_zone[i]);
-		printpath(2, 1);
-		ok = 0;
+  ok = fwrite((char *) &kh, sizeof(kh), 1, kp) == 1 &&
+       fwrite((char *) fs->fs_imap, fs->fs_block_size, N_IMAP, kp) == N_IMAP &&
+       fwrite((char *) fs->fs_zmap, fs->fs_block_size, N_ZMAP, kp) == N_ZMAP &&
+       fwrite((char *) fs->fs_count, 1, fs->fs_sb.s_ninodes + 1, kp) ==
+       fs->fs_sb.s_ninodes + 1;
+  for (i = 0; ok && fs->fs_bigcount != NULL && i < BIGCNT_HASH; i++)
+	for (op = fs->fs_bigcount[i]; ok && op != NULL; op = op->bc_next)
+		ok = fwrite((char *) op, sizeof(*op), 1, kp) == 1;
+
+  /* Walk the frames in the order they were numbered in. */
+  for (i = 0; ok && i < fs->fs_nwork; i++)
+	for (fp = fs->fs_worklist[i].wk_dir;
+	     ok && fp != 0 && fp->st_mark == fs->fs_kmark; fp = fp->st_next) {
+		fp->st_mark = fs->fs_kmark + 1;
+		memset((void *) &kf, 0, sizeof(kf));
+		kf.kf_next = fp->st_next == 0 ? 0 : fp->st_next->st_index + 1;
+		kf.kf_presence = fp->st_presence;
+		kf.kf_walked = fp->st_walked;
+		kf.kf_done = fp->st_done;
+		kf.kf_ok = fp->st_ok;
+		kf.kf_pending = fp->st_pending;
+		kf.kf_refs = fp->st_refs;
+		kf.kf_entblk = fp->st_entblk;
+		kf.kf_entoff = fp->st_entoff;
+		kf.kf_ent = fp->st_ent;
+		kf.kf_inode = fp->st_inode;
+		ok = fwrite((char *) &kf, sizeof(kf), 1, kp) == 1;
 	}
-  return(ok);
+  fs->fs_kmark++;
+  for (i = 0; ok && i < fs->fs_nwork; i++) {
+	memset((void *) &kw, 0, sizeof(kw));
+	kw.kw_zone = fs->fs_worklist[i].wk_zone;
+	kw.kw_pos = fs->fs_worklist[i].wk_pos;
+	kw.kw_frame = fs->fs_worklist[i].wk_dir->st_index;
+	ok = fwrite((char *) &kw, sizeof(kw), 1, kp) == 1;
+  }
+  ok = ok && savesparse(kp, fs->fs_spec_imap) &&
+       savesparse(kp, fs->fs_spec_zmap) && savesparse(kp, fs->fs_dirmap) &&
+       fwrite((char *) &magic, sizeof(magic), 1, kp) == 1;
+  if (fflush(kp) != 0 || fsync(fileno(kp)) != 0) ok = 0;
+  if (fclose(kp) != 0) ok = 0;
+  if (ok && rename(tmp, ckptfile) < 0) ok = 0;
+  if (!ok) {
+	perror(ckptfile);
+	unlink(tmp);
+  }
+  free(tmp);
 }
 
-/* Check the mode and contents of an inode. */
-int chkmode(ino_t ino, d_inode *ip)
+/* Read the bits saved by savesparse() into a new sparse bitmap of `nblk'
+ * blocks in `*mp'.
+ */
+int loadsparse(kp, mp, nblk)
+FILE *kp;
+struct sbitmap **mp;
+int nblk;
 {
-  switch (ip->i_mode & I_TYPE) {
-      case I_REGULAR:
-	nregular++;
-	return chkfile(ino, ip);
-      case I_DIRECTORY:
-	ndirectory++;
-	return chkdirectory(ino, ip);
-      case I_BLOCK_SPECIAL:
-	nblkspec++;
-	return chkspecial(ino, ip);
-      case I_CHAR_SPECIAL:
-	ncharspec++;
-	return chkspecial(ino, ip);
-      case I_NAMED_PIPE:
-	npipe++;
-	return chkfile(ino, ip);
-      case I_UNIX_SOCKET:
-	nsock++;
-	return chkfile(ino, ip);
-#ifdef I_SYMBOLIC_LINK
-      case I_SYMBOLIC_LINK:
-	nsyml++;
-	return chklink(ino, ip);
-#endif
-      default:
-	nbadinode++;
-	printf("bad mode of ");
-	printpath(1, 0);
-	printf("mode = %o)", ip->i_mode);
-	return(0);
+  u32_t w;
+
+  sbfree(*mp);
+  *mp = allocsparse(nblk);
+  for (;;) {
+	if (fread((char *) &w, sizeof(w), 1, kp) != 1) return(0);
+	if (w == CKPT_END) return(1);
+	sbmark(*mp, (bit_nr) w);
   }
 }
 
-/* Check an inode. */
-int chkinode(ino_t ino, d_inode *ip)
+/* Put what tells the file system checked apart from others of the same
+ * geometry in checkpoint header `khp'.
+ */
+void ckptid(khp)
+struct kheader *khp;
 {
-  if (ino == ROOT_INODE && (ip->i_mode & I_TYPE) != I_DIRECTORY) {
-	printf("root inode is not a directory ");
-	printf("(ino = %u, mode = %o)\n", ino, ip->i_mode);
-	fatal("");
-  }
-  if (ip->i_nlinks == 0) {
-	printf("link count zero of ");
-	printpath(2, 0);
+  struct stat st;
+  d_inode inode;
+
+  memset((void *) &st, 0, sizeof(st));
+  (void) stat(fs->fs_device, &st);
+  getinode(ROOT_INODE, &inode);
+  khp->kh_super = fs->fs_superhash;
+  khp->kh_root = jhash((u32_t) FNV_BASIS, (char *) &inode,
+		       (int) sizeof(inode));
+  khp->kh_dev = st.st_dev;
+  khp->kh_ino = st.st_ino;
+  khp->kh_size = st.st_size;
+}
+
+/* Read the checkpoint, if there is one of this file system, and set the
+ * tree walk up to go on from where it was saved.  Return 0 if the walk has
+ * to start at the root.  A checkpoint is renamed into place only when it
+ * is whole, so one that can't be read after its end was found is fatal:
+ * the maps may be half loaded by then.
+ */
+int loadckpt()
+{
+  struct kheader kh, id;
+  struct kframe kf;
+  struct kwork kw;
+  struct bigcnt *op;
+  struct stack **fl;
+  register long i;
+  long nframe = 0;
+  u32_t magic;
+  FILE *kp;
+  int ok;
+
+  if ((kp = fopen(ckptfile, "r")) == NULL) {
+	if (errno != ENOENT) perror(ckptfile);
 	return(0);
   }
-  if (ip->d2_atime == 0 && ip->d2_mtime == 0) {
-	  	int a;
-	  	char c;
-        printf("Time of inode is corrupted. ");
-        printpath(2, 1);
-        printf("access %u, modified %u, inode modified %u\n", 
-                ip->d2_atime, ip->d2_mtime, ip->d2_ctime);
-        printf("Should delete? 0 - no, 1 - yes -> ");
-        scanf("%d", &a);
-        while (!(c == EOF || c == '\n' || c == '\r')) c = getchar();
-        if (a == 1) {
-	        return(0);
-        }
-  }
-  nfreeinode--;
-  setbit(imap, (bit_nr) ino);
-  if ((unsigned) ip->i_nlinks > SHRT_MAX) {
-	printf("link count too big in ");
-	printpath(1, 0);
-	printf("cnt = %u)\n", (unsigned) ip->i_nlinks);
-	count[ino] -= SHRT_MAX;
-	setbit(spec_imap, (bit_nr) ino);
-  } else {
-	count[ino] -= (unsigned) ip->i_nlinks;
+  ckptid(&id);
+  if (fread((char *) &kh, sizeof(kh), 1, kp) != 1 ||
+      kh.kh_magic != CKPT_MAGIC || kh.kh_version != CKPT_VERSION ||
+      kh.kh_ninodes != fs->fs_sb.s_ninodes ||
+      kh.kh_zones != fs->fs_sb.s_zones ||
+      kh.kh_firstdata != FIRST || kh.kh_blocksize != fs->fs_block_size ||
+      kh.kh_imapblocks != N_IMAP || kh.kh_zmapblocks != N_ZMAP ||
+      kh.kh_super != id.kh_super || kh.kh_root != id.kh_root ||
+      kh.kh_dev != id.kh_dev || kh.kh_ino != id.kh_ino ||
+      kh.kh_size != id.kh_size ||
+      fseek(kp, -(long) sizeof(magic), SEEK_END) != 0 ||
+      fread((char *) &magic, sizeof(magic), 1, kp) != 1 ||
+      magic != CKPT_MAGIC || fseek(kp, (long) sizeof(kh), SEEK_SET) != 0) {
+	fclose(kp);
+	fsprintf("Checkpoint %s is not one of this file system.\n", ckptfile);
+	return(0);
   }
-  return chkmode(ino, ip);
-}
 
-/* Check the directory entry pointed to by dp, by checking the inode. */
-int descendtree(dp)
-dir_struct *dp;
-{
-  d_inode inode;
-  register ino_t ino = dp->d_inum;
-  register visited;
-  struct stack stk;
+  ok = fread((char *) fs->fs_imap, fs->fs_block_size, N_IMAP, kp) == N_IMAP &&
+       fread((char *) fs->fs_zmap, fs->fs_block_size, N_ZMAP, kp) == N_ZMAP &&
+       fread((char *) fs->fs_count, 1, fs->fs_sb.s_ninodes + 1, kp) ==
+       fs->fs_sb.s_ninodes + 1;
+  if (kh.kh_nbig > 0 && fs->fs_bigcount == NULL)
+	fs->fs_bigcount = (struct bigcnt **) alloc(BIGCNT_HASH,
+						   sizeof(*fs->fs_bigcount));
+  for (i = 0; ok && i < kh.kh_nbig; i++) {
+	op = (struct bigcnt *) alloc(1, sizeof(struct bigcnt));
+	ok = fread((char *) op, sizeof(*op), 1, kp) == 1;
+	op->bc_next = fs->fs_bigcount[op->bc_ino % BIGCNT_HASH];
+	fs->fs_bigcount[op->bc_ino % BIGCNT_HASH] = op;
+  }
 
-  stk.st_dir = dp;
-  stk.st_next = ftop;
-  ftop = &stk;
-  if (bitset(spec_imap, (bit_nr) ino)) {
-	printf("found inode %u: ", ino);
-	printpath(0, 1);
+  /* Make all frames first; a parent may come after its children. */
+  fl = (struct stack **) alloc(kh.kh_nframe + 1, sizeof(*fl));
+  for (; ok && nframe < kh.kh_nframe; nframe++) {
+	ok = fread((char *) &kf, sizeof(kf), 1, kp) == 1 &&
+	     kf.kf_next <= kh.kh_nframe;
+	i = nframe;
+	fl[i] = (struct stack *) alloc(1, sizeof(struct stack));
+	fl[i]->st_index = kf.kf_next;
+	fl[i]->st_presence = kf.kf_presence;
+	fl[i]->st_walked = kf.kf_walked;
+	fl[i]->st_done = kf.kf_done;
+	fl[i]->st_ok = kf.kf_ok;
+	fl[i]->st_pending = kf.kf_pending;
+	fl[i]->st_refs = kf.kf_refs;
+	fl[i]->st_entblk = kf.kf_entblk;
+	fl[i]->st_entoff = kf.kf_entoff;
+	fl[i]->st_ent = kf.kf_ent;
+	fl[i]->st_dir = &fl[i]->st_ent;
+	fl[i]->st_inode = kf.kf_inode;
   }
-  visited = bitset(imap, (bit_nr) ino);
-  if (!visited || listing) {
-	devread(inoblock(ino), inooff(ino), (char *) &inode, INODE_SIZE);
-	if (listing) list(ino, &inode);
-	if (!visited && !chkinode(ino, &inode)) {
-		setbit(spec_imap, (bit_nr) ino);
-		if (yes("remove")) {
-			count[ino] += inode.i_nlinks - 1;
-			clrbit(imap, (bit_nr) ino);
-			devwrite(inoblock(ino), inooff(ino),
-				nullbuf, INODE_SIZE);
-			memset((void *) dp, 0, sizeof(dir_struct));
-			ftop = ftop->st_next;
-			return(0);
-		}
-	}
+  for (i = 0; ok && i < kh.kh_nframe; i++)
+	fl[i]->st_next = fl[i]->st_index == 0 ? 0 : fl[fl[i]->st_index - 1];
+
+  fs->fs_maxwork = kh.kh_nwork < 256 ? 256 : kh.kh_nwork;
+  fs->fs_worklist = (struct work *) alloc(fs->fs_maxwork, sizeof(struct work));
+  for (i = 0; ok && i < kh.kh_nwork; i++) {
+	ok = fread((char *) &kw, sizeof(kw), 1, kp) == 1 &&
+	     kw.kw_frame < kh.kh_nframe;
+	fs->fs_worklist[i].wk_zone = kw.kw_zone;
+	fs->fs_worklist[i].wk_pos = kw.kw_pos;
+	fs->fs_worklist[i].wk_dir = ok ? fl[kw.kw_frame] : 0;
   }
-  ftop = ftop->st_next;
+  ok = ok && loadsparse(kp, &fs->fs_spec_imap, N_IMAP) &&
+       loadsparse(kp, &fs->fs_spec_zmap, N_ZMAP) &&
+       loadsparse(kp, &fs->fs_dirmap, N_IMAP);
+  fclose(kp);
+  if (!ok) {
+	for (i = 0; i < nframe; i++) free((char *) fl[i]);
+	free((char *) fl);
+	fatal("checkpoint unreadable");
+  }
+  free((char *) fl);
+  fs->fs_nwork = kh.kh_nwork;
+
+  fs->fs_nregular = kh.kh_nregular;
+  fs->fs_ndirectory = kh.kh_ndirectory;
+  fs->fs_nblkspec = kh.kh_nblkspec;
+  fs->fs_ncharspec = kh.kh_ncharspec;
+  fs->fs_nbadinode = kh.kh_nbadinode;
+  fs->fs_nsock = kh.kh_nsock;
+  fs->fs_npipe = kh.kh_npipe;
+  fs->fs_nsyml = kh.kh_nsyml;
+  for (i = 0; i < NLEVEL; i++) PSET(fs->fs_ztype[i], kh.kh_ztype[i]);
+  fs->fs_nfreeinode = kh.kh_nfreeinode;
+  fs->fs_nfreezone = kh.kh_nfreezone;
+  PSET(fs->fs_nchecked, kh.kh_nchecked);
+  fs->fs_changed = kh.kh_changed;
+  fs->fs_notrepaired = kh.kh_notrepaired;
+  fs->fs_nerrors = kh.kh_nerrors;
+  fs->fs_firstcnterr = kh.kh_firstcnterr;
+  fs->fs_firstlist = kh.kh_firstlist;
+  fsprintf("Checkpoint %s: going on with the tree walk, %ld directory zones queued.\n",
+	   ckptfile, (long) fs->fs_nwork);
   return(1);
 }
 
-/* Check the file system tree. */
-void chktree()
+/* Throw the report away while `on' is set, or print it again. */
+void mute(on)
+int on;
 {
-  dir_struct dir;
-
-  nfreeinode = sb.s_ninodes;
-  nfreezone = N_DATA;
-  dir.d_inum = ROOT_INODE;
-  dir.mfs_d_name[0] = 0;
-  if (!descendtree(&dir)) fatal("bad root inode");
-  putchar('\n');
+  if (on && fs->fs_mute == NULL) {
+	fflush(fs->fs_out);
+	fs->fs_mute = fs->fs_out;
+	fs->fs_out = nullout;
+  } else if (!on && fs->fs_mute != NULL) {
+	fs->fs_out = fs->fs_mute;
+	fs->fs_mute = NULL;
+  }
 }
 
-/* Print the totals of all the objects found. */
-void printtotal()
+/* Return a random number (xorshift). */
+u32_t triagerand()
 {
-  printf("\nSummary of files, inode, zone details:\n");
-  printf("======================================\n");
-  pr("%8u    file%s\n", nregular, "", "s");
-  pr("%8u    Director%s\n", ndirectory, "y", "ies");
-  pr("%8u    Symbolic link%s\n", nsyml, "", "s");
-  printf("\n");
+  register u32_t x = fs->fs_seed;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return(fs->fs_seed = x);
+}
 
-  printf("blocksize = %5d        ", block_size);
-  printf("zonesize  = %5d\n", ZONE_SIZE);
+/* Add the `bad' of `n' objects of one inode table block to rate `rp'. */
+void addrate(rp, n, bad)
+struct rate *rp;
+long n, bad;
+{
+  rp->rt_n += n;
+  rp->rt_bad += bad;
+  rp->rt_m++;
+  rp->rt_nn += (double) n * n;
+  rp->rt_nb += (double) n * bad;
+  rp->rt_bb += (double) bad * bad;
+}
 
-  if (nbadinode != 0) pr("%6u    Bad inode%s\n", nbadinode, "", "s");
-  pr("%8u    Free inode%s\n", nfreeinode, "", "s");
+/* Print rate `rp' with its 95% interval, and what it comes to for `total'
+ * objects, if known.  The objects are sampled a whole inode table block at
+ * a time, and the damage in a block tends to go together, so they are not
+ * independent draws.  The interval is Wilson's, but for the effective
+ * number of objects: those checked divided by the design effect, which is
+ * the variance of the rate over the blocks (the ratio estimator) over the
+ * variance it would have had were the objects drawn one by one.  The
+ * design effect is not taken below 1, and with a single block sampled the
+ * block is all that counts.  The blocks are drawn without replacement, so
+ * the variance is scaled by 1 - `frac', the fraction of the blocks drawn:
+ * with all of them drawn the rate is exact.
+ */
+void prrate(what, rp, total, frac)
+char *what;
+struct rate *rp;
+double total;
+double frac;
+{
+  double z2 = TRIAGE_Z * TRIAGE_Z, p, c, h, n, m, d;
 
-  pr("%8u    Data zone%s\n",		  ztype[0],	 "",   "s");
-  pr("%8u    Single indirect zone%s\n",	  ztype[1],	 "",   "s");
-  pr("%8u    Double indirect zone%s\n",	  ztype[2],	 "",   "s");
-  lpr("%8ld    Free zone%s\n", nfreezone, "", "s");
+  if (rp->rt_n == 0) {
+	fsprintf("%-12s none checked\n", what);
+	return;
+  }
+  p = (double) rp->rt_bad / rp->rt_n;
+  n = rp->rt_n;
+  m = rp->rt_m;
+  if (m < 2) {
+	n = m;
+  } else if (p > 0 && p < 1) {
+	d = (rp->rt_bb - 2 * p * rp->rt_nb + p * p * rp->rt_nn) /
+	    ((m - 1) * n * p * (1 - p) / m);
+	if (d > 1) n /= d;
+  }
+  if (frac >= 1) {
+	c = p;
+	h = 0;
+  } else {
+	n /= 1 - frac;
+	c = (p + z2 / (2 * n)) / (1 + z2 / n);
+	h = TRIAGE_Z * sqrt(p * (1 - p) / n + z2 / (4.0 * n * n)) /
+	    (1 + z2 / n);
+  }
+  fsprintf("%-12s %8ld checked %7ld bad %7.3f%% (95%%: %.3f%% - %.3f%%)",
+	   what, rp->rt_n, rp->rt_bad, 100 * p, 100 * (c - h < 0 ? 0 : c - h),
+	   100 * (c + h > 1 ? 1 : c + h));
+  if (total > 0) fsprintf(", about %.0f of %.0f", p * total, total);
+  fsprintf("\n");
+}
 
-  return;
+/* Estimate how much of the file system is damaged from a sample (-T).  The
+ * inode table blocks are drawn at random without replacement, a batch at
+ * a time, and each batch is read in disk order.  The inodes the inode map
+ * on the device has in use are checked with chkinode(), and all zones of
+ * the directories among them with chkdirzone(), so the directory zones
+ * are sampled as the inodes are.  The tree is not walked: the entries are
+ * not followed, and .. and links to directories are not checked.  No
+ * repairs are made and what the checks print is thrown away; an object is
+ * bad if its check failed or asked for a repair; a directory zone is
+ * counted with the inode table block of its directory.  The time budget
+ * is looked at between batches.
+ */
+void triagefs()
+{
+  block_nr *blk, t;
+  long nblk = N_ILIST, want, drawn = 0, first, i, j, used;
+  long ni[TRIAGE_BATCH], nibad[TRIAGE_BATCH];
+  long nz[TRIAGE_BATCH], nzbad[TRIAGE_BATCH];
+  struct rate ir, zr;
+  register ino_t ino;
+  register int k, ipb = INODES_PER_BLOCK;
+  double start = clocktime(CLOCK_MONOTONIC);
+  bitchunk_t *dmap;
+  struct stack top, *fp;
+  dir_struct dir;
+  d_inode inode;
+  struct work w;
+  int e, ok, b;
+
+  fsprintf("Triage: sampling %.3g%% of the inode table, for at most %.3g s.\n",
+	   triagepct, triagesecs);
+  fflush(OUT);
+  fs->fs_seed = jhash((u32_t) FNV_BASIS, fs->fs_device, strlen(fs->fs_device));
+  if (fs->fs_seed == 0) fs->fs_seed = 1;
+  dmap = allocbitmap(N_IMAP);
+  loadbitmap(dmap, BLK_IMAP, N_IMAP);
+  used = bitsused(dmap, (long) fs->fs_sb.s_ninodes + 1);
+  want = (long) ceil(nblk * triagepct / 100);
+  if (want > nblk) want = nblk;
+  blk = (block_nr *) alloc((unsigned) nblk, sizeof(block_nr));
+  for (i = 0; i < nblk; i++) blk[i] = i;
+
+  memset((void *) &dir, 0, sizeof(dir));
+  memset((void *) &top, 0, sizeof(top));
+  memset((void *) &ir, 0, sizeof(ir));
+  memset((void *) &zr, 0, sizeof(zr));
+  top.st_dir = &dir;
+  fs->fs_nfreeinode = fs->fs_sb.s_ninodes;
+  fs->fs_nfreezone = N_DATA;
+  fs->fs_nwork = 0;
+  mute(1);
+  while (drawn < want && clocktime(CLOCK_MONOTONIC) - start < triagesecs) {
+	for (j = drawn; j < want && j < drawn + TRIAGE_BATCH; j++) {
+		i = j + triagerand() % (nblk - j);
+		t = blk[i];
+		blk[i] = blk[j];
+		blk[j] = t;
+	}
+	qsort((void *) &blk[drawn], (size_t) (j - drawn), sizeof(block_nr),
+	      blkcmp);
+	for (b = 0; b < j - drawn; b++)
+		ni[b] = nibad[b] = nz[b] = nzbad[b] = 0;
+	for (first = drawn; drawn < j; drawn++)
+	    for (k = 0; k < ipb; k++) {
+		ino = (ino_t) blk[drawn] * ipb + k + 1;
+		if (ino > fs->fs_sb.s_ninodes) break;
+		if (!bitset(dmap, (bit_nr) ino)) continue;
+		getinode(ino, &inode);
+		dir.d_inum = ino;
+		e = fs->fs_nerrors;
+		b = drawn - first;
+		ni[b]++;
+		if (ino == ROOT_INODE &&
+		    (inode.i_mode & I_TYPE) != I_DIRECTORY) {
+			nibad[b]++;
+			continue;
+		}
+		if ((inode.i_mode & I_TYPE) == I_DIRECTORY) {
+			fs->fs_ftop = fp = newframe(&dir, &inode);
+			ok = chkinode(ino, &fp->st_inode);
+			if (fp->st_pending == 0) {
+				fp->st_done = 1;
+				freeframe(fp);
+			}
+		} else {
+			fs->fs_ftop = &top;
+			ok = chkinode(ino, &inode);
+		}
+		fs->fs_ftop = 0;
+		if (!ok || fs->fs_nerrors != e) nibad[b]++;
+	    }
+	while (popzone(&w)) {
+		e = fs->fs_nerrors;
+		fs->fs_ftop = w.wk_dir;
+		chkdirzone(w.wk_dir->st_ent.d_inum, &w.wk_dir->st_inode,
+			   w.wk_pos, w.wk_zone);
+		fs->fs_ftop = 0;
+		t = (w.wk_dir->st_ent.d_inum - 1) / ipb;
+		for (b = 0; b < j - first - 1 && blk[first + b] != t; b++) ;
+		nz[b]++;
+		if (fs->fs_nerrors != e) nzbad[b]++;
+		if (--w.wk_dir->st_pending == 0) {
+			w.wk_dir->st_done = 1;
+			freeframe(w.wk_dir);
+		}
+	}
+	for (b = 0; b < j - first; b++) {
+		addrate(&ir, ni[b], nibad[b]);
+		addrate(&zr, nz[b], nzbad[b]);
+	}
+  }
+  mute(0);
+  free((char *) fs->fs_worklist);
+  fs->fs_worklist = NULL;
+  fs->fs_maxwork = 0;
+  free((char *) blk);
+  freebitmap(dmap);
+
+  fsprintf("%ld of %ld inode table blocks (%.3g%%) sampled in %.3f s\n",
+	   drawn, nblk, nblk == 0 ? 0.0 : 100.0 * drawn / nblk,
+	   clocktime(CLOCK_MONOTONIC) - start);
+  prrate("inodes", &ir, (double) used, (double) drawn / nblk);
+  prrate("dir zones", &zr,
+	 drawn == 0 ? 0.0 : (double) zr.rt_n * nblk / drawn,
+	 (double) drawn / nblk);
+  fs->fs_nerrors = ir.rt_bad + zr.rt_bad;	/* for the exit status */
 }
 
-/* Check the device which name is given by `f'.  The inodes listed by `clist'
+/* Check the device of the current check.  The inodes listed by `clist'
  * should be listed separately, and the inodes listed by `ilist' and the zones
  * listed by `zlist' should be watched for while checking the file system.
+ * What was allocated is released by chkdev(), also after a fatal error.
  */
-
-void chkdev(f, clist, ilist, zlist)
-char *f, **clist, **ilist, **zlist;
+void chkfs(clist, ilist, zlist)
+char **clist, **ilist, **zlist;
 {
-  if (automatic) repair = 1;
-  fsck_device = f;
   initvars();
+  phase(PH_SETUP);
 
   devopen();
 
   rw_super(SUPER_GET);
 
-  if(block_size < _MIN_BLOCK_SIZE)
+  if(fs->fs_block_size < _MIN_BLOCK_SIZE)
   	fatal("funny block size");
 
-  if(!(rwbuf = malloc(block_size))) fatal("couldn't allocate fs buf (1)");
-  if(!(nullbuf = malloc(block_size))) fatal("couldn't allocate fs buf (2)");
-  memset(nullbuf, 0, block_size);
+  initcache();
+  uringopen();
+  if(!(fs->fs_nullbuf = malloc(fs->fs_block_size)))
+	fatal("couldn't allocate fs buf (2)");
+  memset(fs->fs_nullbuf, 0, fs->fs_block_size);
 
   chksuper();
 
   #if 0
   if(markdirty) {
-  	if(sb.s_flags & MFSFLAG_CLEAN) {
-	  	sb.s_flags &= ~MFSFLAG_CLEAN;
+  	if(fs->fs_sb.s_flags & MFSFLAG_CLEAN) {
+	  	fs->fs_sb.s_flags &= ~MFSFLAG_CLEAN;
   		rw_super(SUPER_PUT);
-  		printf("\n----- FILE SYSTEM MARKED DIRTY -----\n\n");
+  		fsprintf("\n----- FILE SYSTEM MARKED DIRTY -----\n\n");
 	} else {
-  		printf("Filesystem is already dirty.\n");
+  		fsprintf("Filesystem is already dirty.\n");
 	}
   }
 
   /* If preening, skip fsck if clean flag is on. */
   if(preen) {
-  	if(sb.s_flags & MFSFLAG_CLEAN) {
-	  	printf("%s: clean\n", f);
+  	if(fs->fs_sb.s_flags & MFSFLAG_CLEAN) {
+	  	fsprintf("%s: clean\n", fs->fs_device);
 		return;
 	} 
-	printf("%s: dirty, performing fsck\n", f);
+	fsprintf("%s: dirty, performing fsck\n", f);
   }
   #endif
 
+  fs->fs_itable = NULL;
+  if (useitable) loaditable();
+
   lsi(clist);
 
   getbitmaps();
+  if (progress) estimate();
 
-  fillbitmap(spec_imap, (bit_nr) 1, (bit_nr) sb.s_ninodes + 1, ilist);
-  fillbitmap(spec_zmap, (bit_nr) FIRST, (bit_nr) sb.s_zones, zlist);
+  fillbitmap(fs->fs_spec_imap, (bit_nr) 1, (bit_nr) fs->fs_sb.s_ninodes + 1,
+	     ilist);
+  fillbitmap(fs->fs_spec_zmap, (bit_nr) FIRST, (bit_nr) fs->fs_sb.s_zones,
+	     zlist);
 
   getcount();
-  chktree();
-  chkmap(zmap, spec_zmap, (bit_nr) FIRST - 1, BLK_ZMAP, N_ZMAP, "zone");
-  chkcount();
-  chkmap(imap, spec_imap, (bit_nr) 0, BLK_IMAP, N_IMAP, "inode");
-  chkilist();
-  if(preen) printf("\n");
-  printtotal();
-
-  putbitmaps();
-  freecount();
-
-  if (changed) printf("\n----- FILE SYSTEM HAS BEEN MODIFIED -----\n\n");
+  if (jnlfile != NULL) phase(PH_JOURNAL);
+  if (triagepct > 0) {
+	phase(PH_TRIAGE);
+	triagefs();
+  } else if (jnlfile == NULL || !chkjournal()) {
+	if (jnlfile != NULL) newjournal();
+	phase(PH_TREE);
+	chktree();
+	/* Repairs made from here on can't be made twice, so a later run
+	 * must not go on from the walk.
+	 */
+	if (ckptfile != NULL) unlink(ckptfile);
+	drainpool();
+	flushdirty();
+	if (nworkers && fs->fs_image == NULL)
+		fsprintf("Prefetch: %ld blocks loaded by %d threads\n",
+			 fs->fs_nprefetched, nworkers);
+	phase(PH_ZMAP);
+	chkmap(fs->fs_zmap, (bit_nr) FIRST - 1, BLK_ZMAP, N_ZMAP, "zone");
+	flushdirty();
+	phase(PH_COUNT);
+	chkcount();
+	flushdirty();
+	phase(PH_IMAP);
+	chkmap(fs->fs_imap, (bit_nr) 0, BLK_IMAP, N_IMAP, "inode");
+	flushdirty();
+	if (scope == NULL) {
+		phase(PH_ILIST);
+		chkilist();
+		flushdirty();
+	}
+	phase(-1);
+	if(preen) fsprintf("\n");
+	printtotal();
+	if (jnlfile != NULL) {
+		phase(PH_JOURNAL);
+		/* Only a clean run is worth saving. */
+		if (fs->fs_nerrors == 0 && !fs->fs_changed &&
+		    !fs->fs_notrepaired)
+			savejournal(fs->fs_imap, fs->fs_zmap);
+		else
+			unlink(jnlfile);
+	}
+  } else {
+	if(preen) fsprintf("\n");
+	printtotal();
+  }
+  flushdirty();
+  freejournal();
+  phase(-1);
+  printphases();
+  if (fs->fs_image == NULL)
+	fsprintf("\nBlock cache: %ld hits, %ld misses, %ld blocks read ahead\n",
+		 fs->fs_cachehits, fs->fs_cachemisses, fs->fs_nreadahead);
+  fsprintf("Device: %ld reads, %ld writes, %ld system calls, %llu bytes read, %llu bytes written\n",
+	   fs->fs_nrdcalls, fs->fs_nwrcalls, fs->fs_nsyscalls,
+	   (unsigned long long) fs->fs_nrdbytes,
+	   (unsigned long long) fs->fs_nwrbytes);
+
+  if (fs->fs_changed)
+	fsprintf("\n----- FILE SYSTEM HAS BEEN MODIFIED -----\n\n");
 
   /* If we were told to repair the FS, and the user never stopped us from
    * doing it, and the FS wasn't marked clean, we can mark the FS as clean.
    * If we were stopped from repairing, tell user about it.
    */
   #if 0
-  if(repair && !(sb.s_flags & MFSFLAG_CLEAN)) {
-  	if(notrepaired) {
-  		printf("\n----- FILE SYSTEM STILL DIRTY -----\n\n");
+  if(repair && !(fs->fs_sb.s_flags & MFSFLAG_CLEAN)) {
+  	if(fs->fs_notrepaired) {
+  		fsprintf("\n----- FILE SYSTEM STILL DIRTY -----\n\n");
 	} else {
 		sync();	/* update FS on disk before clean flag */
-	  	sb.s_flags |= MFSFLAG_CLEAN;
+	  	fs->fs_sb.s_flags |= MFSFLAG_CLEAN;
   		rw_super(SUPER_PUT);
-  		printf("\n----- FILE SYSTEM MARKED CLEAN -----\n\n");
+  		fsprintf("\n----- FILE SYSTEM MARKED CLEAN -----\n\n");
 	}
   }
   #endif
+}
+
+/* Free the directory frames still referred to by the worklist, after a
+ * fatal error ended the tree walk.  A frame goes once its last queued zone
+ * is taken off, so parents stay until their subdirectories are gone.
+ */
+void freework()
+{
+  register int i;
+  register struct stack *fp;
+
+  for (i = 0; i < fs->fs_nwork; i++) {
+	fp = fs->fs_worklist[i].wk_dir;
+	if (--fp->st_pending == 0) {
+		fp->st_done = 1;
+		freeframe(fp);
+	}
+  }
+  free((char *) fs->fs_worklist);
+  fs->fs_worklist = NULL;
+  fs->fs_nwork = fs->fs_maxwork = 0;
+}
+
+/* Check the device which name is given by `f', writing the report to `out'.
+ * The state of the check is kept in a struct fsck of its own, so devices
+ * can be checked by several threads at once.  Return FSCK_EXIT_OK, or
+ * FSCK_EXIT_CHECK_FAILED if the check ended with a fatal error.
+ */
+int chkdev(f, clist, ilist, zlist, out)
+char *f, **clist, **ilist, **zlist;
+FILE *out;
+{
+  struct fsck *fp, **pp;
+  int r = FSCK_EXIT_OK;
+
+  if ((fp = (struct fsck *) calloc(1, sizeof(struct fsck))) == NULL) {
+	fprintf(stderr, "%s: out of memory\n", prog);
+	return(FSCK_EXIT_CHECK_FAILED);
+  }
+  fs = fp;
+  fs->fs_out = out;
+  fs->fs_device = f;
+  fs->fs_version = 2;
+  fs->fs_dev = -1;
+  fs->fs_undofd = -1;
+  fs->fs_curphase = -1;
+  fs->fs_ncache = cacheblocks;
+  pthread_mutex_init(&fs->fs_cachelock, NULL);
+  pthread_mutex_init(&fs->fs_iolock, NULL);
+  fs->fs_start = clocktime(CLOCK_MONOTONIC);
+  if (progress) {
+	pthread_mutex_lock(&proglock);
+	fs->fs_nextcheck = checks;
+	checks = fs;
+	pthread_mutex_unlock(&proglock);
+  }
+
+  if (setjmp(fs->fs_fail) == 0)
+	chkfs(clist, ilist, zlist);
+  else
+	r = FSCK_EXIT_CHECK_FAILED;
+  phase(-1);
+  if (r == FSCK_EXIT_OK && triagepct > 0 && fs->fs_nerrors > 0)
+	r = FSCK_EXIT_UNRESOLVED;
+
+  /* No prefetch task may outlive the check it belongs to.  Repairs made
+   * before a fatal error are still written.
+   */
+  drainpool();
+  uringclose();
+  if ((patchfile != NULL ? writepatch() : writedirty()) != 0)
+	r = FSCK_EXIT_CHECK_FAILED;
+  if (fs->fs_undofd >= 0) {
+	if (fs->fs_nundo > 0)
+		fsprintf("%ld blocks logged in %s\n", fs->fs_nundo, undofile);
+	close(fs->fs_undofd);
+  }
+  freework();
+  freepath();
+  freejournal();
+  putbitmaps();
+  freecount();
+  freeitable();
+  free(fs->fs_nullbuf);
+  freecache();
+  if (fs->fs_dev >= 0 && devclose() != 0) r = FSCK_EXIT_CHECK_FAILED;
+  fflush(out);
+  if (statfile != NULL) savestats(f, r);
+  if (progress) {
+	pthread_mutex_lock(&proglock);
+	for (pp = &checks; *pp != fp; pp = &(*pp)->fs_nextcheck)
+		;
+	*pp = fp->fs_nextcheck;
+	nfinished++;
+	pthread_mutex_unlock(&proglock);
+  }
+  pthread_mutex_destroy(&fs->fs_cachelock);
+  pthread_mutex_destroy(&fs->fs_iolock);
+  fs = NULL;
+  free((char *) fp);
+  return(r);
+}
+
+/* The devices to check, and what is shared by the threads checking them. */
+char **devlist;			/* device names */
+int ndevs, nextdev;		/* number of devices, next one to check */
+int nparallel = 1;		/* number of devices checked at once (-P) */
+int exitstatus;			/* or of the results of all checks */
+pthread_mutex_t devlock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Print the progress of the checks running on stderr with -v, and write
+ * it to the status file with -s, under its name with .new added first so
+ * a reader never sees half of it.  `last' is set once all checks are
+ * done.  Called with proglock held.
+ */
+void report(last)
+int last;
+{
+  register struct fsck *fp;
+  register int i, n = 0;
+  long done, total;
+  double t = clocktime(CLOCK_MONOTONIC), pct, rate, eta;
+  char *tmp = NULL;
+  FILE *sp = NULL;
+  int tty = isatty(2);
+
+  if (statusfile != NULL &&
+      (tmp = malloc(strlen(statusfile) + 5)) != NULL) {
+	sprintf(tmp, "%s.new", statusfile);
+	if ((sp = fopen(tmp, "w")) != NULL)
+		fprintf(sp, "{ \"time\": %ld, \"devices\": %d, \"finished\": %d, \"done\": %s,\n  \"checks\": [",
+			(long) time((time_t *) 0), ndevs, nfinished,
+			last ? "true" : "false");
+  }
+  for (fp = checks; fp != NULL; fp = fp->fs_nextcheck) {
+	done = PGET(fp->fs_nchecked);
+	for (i = 0; i < NLEVEL; i++) done += PGET(fp->fs_ztype[i]);
+	total = PGET(fp->fs_estimate);
+	i = PGET(fp->fs_curphase);
+	pct = total <= 0 ? 0.0 : done >= total ? 100.0 : 100.0 * done / total;
+	rate = t > fp->fs_start ? done / (t - fp->fs_start) : 0.0;
+	eta = total <= 0 || rate == 0 ? -1 : done >= total ? 0 :
+						(total - done) / rate;
+	if (showprogress) {
+		fprintf(stderr, "%s%s: %s %.1f%%, %.0f/s", n == 0 ?
+			(tty ? "\r" : "") : "; ", fp->fs_device,
+			i >= 0 ? phasename[i] : "setup", pct, rate);
+		if (eta >= 0)
+			fprintf(stderr, ", %ld:%02ld left",
+				(long) eta / 60, (long) eta % 60);
+	}
+	if (sp != NULL) {
+		fprintf(sp, "%s\n    { \"device\": ", n == 0 ? "" : ",");
+		jsonstring(sp, fp->fs_device);
+		fprintf(sp, ", \"phase\": \"%s\", \"checked\": %ld, \"estimate\": %ld, ",
+			i >= 0 ? phasename[i] : "setup", done, total);
+		fprintf(sp, "\"percent\": %.1f, \"rate\": %.0f, \"eta\": ",
+			pct, rate);
+		if (eta >= 0)
+			fprintf(sp, "%.0f }", eta);
+		else
+			fprintf(sp, "null }");
+	}
+	n++;
+  }
+  if (showprogress) {
+	if (tty) fprintf(stderr, n == 0 ? "\r\033[K" : "\033[K");
+	else if (n > 0) putc('\n', stderr);
+  }
+  if (sp != NULL) {
+	if (last) fprintf(sp, " ],\n  \"status\": %d }\n", exitstatus);
+	else fprintf(sp, " ] }\n");
+	if (fclose(sp) != 0 || rename(tmp, statusfile) != 0) unlink(tmp);
+  }
+  free(tmp);
+}
+
+/* Report the progress every PROGRESS_SECS seconds until told to stop. */
+void *progressloop(arg)
+void *arg;
+{
+  struct timespec ts;
+
+  pthread_mutex_lock(&proglock);
+  while (!progstop) {
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += PROGRESS_SECS;
+	while (!progstop &&
+	       pthread_cond_timedwait(&progcond, &proglock, &ts) == 0)
+		;
+	if (!progstop) report(0);
+  }
+  pthread_mutex_unlock(&proglock);
+  return(NULL);
+}
+
+/* Check devices from the list until there are none left.  With more than
+ * one check at a time, a report is collected in a temporary file and
+ * printed in one piece when its check is done.
+ */
+void *chkthread(arg)
+void *arg;
+{
+  register int i, c;
+  FILE *out;
+  int r;
 
-  devclose();
+  for (;;) {
+	pthread_mutex_lock(&devlock);
+	i = nextdev++;
+	pthread_mutex_unlock(&devlock);
+	if (i >= ndevs) return(NULL);
+	if (nparallel == 1)
+		out = stdout;
+	else if ((out = tmpfile()) == NULL) {
+		perror("tmpfile");
+		out = stdout;
+	}
+	if (ndevs > 1) fprintf(out, "\n==> %s <==\n", devlist[i]);
+	r = chkdev(devlist[i], (char **) 0, (char **) 0, (char **) 0, out);
+	pthread_mutex_lock(&devlock);
+	exitstatus |= r;
+	if (out != stdout) {
+		rewind(out);
+		while ((c = getc(out)) != EOF) putc(c, stdout);
+		fflush(stdout);
+		fclose(out);
+	}
+	pthread_mutex_unlock(&devlock);
+  }
 }
 
 int main(argc, argv)
 int argc;
 char **argv;
 {
-  register char **clist = 0, **ilist = 0, **zlist = 0;
+  register char *arg;
+  int i;
+  pthread_t *threads;
   preen = repair = automatic = 1;
 
   prog = *argv++;
-  if (argc != 2) {
-      printf("Invalid Number of arguments.\n");
-      printf("Usage: %s <device-name>\n", prog);
-      printf("    Example: ./recoverFileSystemTool /dev/c0d0p0s0\n");
-      printf("    for device name execute command df\n");
-      return(0);
+  while ((arg = *argv) != 0 && arg[0] == '-' && arg[1] != '\0') {
+	argv++;
+	argc--;
+	if (strcmp(arg, "--rollback") == 0) arg = "-R";
+	if (strcmp(arg, "--apply") == 0) arg = "-A";
+	switch (arg[1]) {
+	    case 'c':
+		if (arg[2] != '\0' || *argv == 0 ||
+		    (cacheblocks = atoi(*argv)) <= 0) {
+			argc = 0;
+			break;
+		}
+		argv++;
+		argc--;
+		break;
+	    case 'm':
+		usemmap = 1;
+		break;
+	    case 'd':
+		directio = 1;
+		break;
+	    case 'i':
+		useitable = 1;
+		break;
+	    case 'v':
+		showprogress = 1;
+		break;
+	    case 'j':
+		if (arg[2] != '\0' || *argv == 0) {
+			argc = 0;
+			break;
+		}
+		jnlfile = *argv++;
+		argc--;
+		useitable = 1;
+		break;
+	    case 'K':
+		if (arg[2] != '\0' || *argv == 0) {
+			argc = 0;
+			break;
+		}
+		ckptfile = *argv++;
+		argc--;
+		break;
+	    case 'r':
+		if (arg[2] != '\0' || *argv == 0 || strlen(*argv) > PATH_MAX) {
+			argc = 0;
+			break;
+		}
+		scope = *argv++;
+		argc--;
+		break;
+	    case 'U':
+	    case 'R':
+	    case 'O':
+	    case 'A':
+		if (arg[2] != '\0' || *argv == 0) {
+			argc = 0;
+			break;
+		}
+		if (arg[1] == 'U')
+			undofile = *argv++;
+		else if (arg[1] == 'R')
+			rollfile = *argv++;
+		else if (arg[1] == 'O')
+			patchfile = *argv++;
+		else
+			applyfile = *argv++;
+		argc--;
+		break;
+	    case 'y':
+	    case 'n':
+	    case 'p':
+	    case 'L':
+	    case 'S':
+	    case 's':
+		if (arg[2] != '\0' || *argv == 0) {
+			argc = 0;
+			break;
+		}
+		if (arg[1] == 'L') {
+			if (replog != NULL) fclose(replog);
+			if ((replog = fopen(*argv, "w")) == NULL) {
+				perror(*argv);
+				return(FSCK_EXIT_USAGE);
+			}
+		} else if (arg[1] == 's')
+			statusfile = *argv;
+		else if (arg[1] == 'S') {
+			if (statfile != NULL) fclose(statfile);
+			if ((statfile = fopen(*argv, "w")) == NULL) {
+				perror(*argv);
+				return(FSCK_EXIT_USAGE);
+			}
+			fprintf(statfile, "[\n");
+		} else if (arg[1] == 'p' ? !loadpolicy(*argv) :
+			   !setpolicy(*argv, arg[1] == 'y' ? P_YES : P_NO))
+			return(FSCK_EXIT_USAGE);
+		argv++;
+		argc--;
+		break;
+	    case 't':
+		if (arg[2] != '\0' || *argv == 0 ||
+		    (nworkers = atoi(*argv)) < 0 || nworkers > NR_WORKERS) {
+			argc = 0;
+			break;
+		}
+		argv++;
+		argc--;
+		break;
+	    case 'Q':
+		if (arg[2] != '\0' || *argv == 0 ||
+		    (qdepth = atoi(*argv)) < 0 || qdepth > QUEUE_MAX) {
+			argc = 0;
+			break;
+		}
+		argv++;
+		argc--;
+		break;
+	    case 'T':
+		if (arg[2] != '\0' || *argv == 0 ||
+		    (triagepct = atof(*argv)) <= 0 || triagepct > 100) {
+			argc = 0;
+			break;
+		}
+		argv++;
+		argc--;
+		break;
+	    case 'b':
+		if (arg[2] != '\0' || *argv == 0 ||
+		    (triagesecs = atof(*argv)) <= 0) {
+			argc = 0;
+			break;
+		}
+		argv++;
+		argc--;
+		break;
+	    case 'P':
+		if (arg[2] != '\0' || *argv == 0 ||
+		    (nparallel = atoi(*argv)) <= 0) {
+			argc = 0;
+			break;
+		}
+		argv++;
+		argc--;
+		break;
+	    default:
+		argc = 0;
+	}
+	if (argc == 0) break;
+  }
+  if (argc < 2) {
+      fsprintf("Invalid Number of arguments.\n");
+      fsprintf("Usage: %s [-i] [-m] [-d] [-c cache-blocks] [-t threads] [-Q depth]\n\t[-j journal] [-U undo-log] [-O patch] [-P checks] [-y classes] [-n classes]\n\t[-p policy-file] [-L log-file] [-S stats-file]\n\t[-v] [-s status-file] [-K checkpoint] [-T percent [-b seconds]]\n\t[-r path] <device-name> ...\n       %s --rollback undo-log <device-name>\n       %s [-U undo-log] --apply patch <device-name>\n", prog, prog, prog);
+      fsprintf("    Example: ./recoverFileSystemTool /dev/c0d0p0s0\n");
+      fsprintf("    for device name execute command df\n");
+      fsprintf("    -c: number of blocks in the block cache (default %d)\n",
+	       CACHE_BLOCKS);
+      fsprintf("    -i: read the whole inode table before the tree walk\n");
+      fsprintf("    -m: map an image file into memory instead of reading it\n");
+      fsprintf("    -d: read the device with O_DIRECT, past the page cache\n");
+      fsprintf("    -t: number of threads loading zone trees ahead (max. %d)\n",
+	       NR_WORKERS);
+      fsprintf("    -Q: number of reads kept in flight with io_uring (max. %d)\n",
+	       QUEUE_MAX);
+      fsprintf("    -j: recheck only what changed since the run that saved the journal\n");
+      fsprintf("    -K: checkpoint the tree walk in a file, and go on from it\n");
+      fsprintf("    -T: estimate the damage from a sample of the inode table, repair nothing\n");
+      fsprintf("    -b: time budget of the sample in seconds (default %d)\n",
+	       TRIAGE_SECS);
+      fsprintf("    -r: check only the subtree under a path in the file system\n");
+      fsprintf("    -U: save what repaired blocks held in an undo log first\n");
+      fsprintf("    -R, --rollback: undo the repairs saved in an undo log\n");
+      fsprintf("    -O: save the repairs in a patch, leave the device alone\n");
+      fsprintf("    -A, --apply: write the repairs saved in a patch\n");
+      fsprintf("    -P: number of devices checked at once\n");
+      fsprintf("    -y, -n: always/never make repairs of the given classes\n");
+      fsprintf("        (comma separated: all");
+      for (i = 0; i < NR_RCLASS; i++) fsprintf(", %s", rclassname[i]);
+      fsprintf(")\n");
+      fsprintf("    -p: read the repair policy of each class from a file\n");
+      fsprintf("    -L: log every repair decision to a file\n");
+      fsprintf("    -S: save the time and work of each phase in a JSON file\n");
+      fsprintf("    -v: show the progress of the check on stderr\n");
+      fsprintf("    -s: keep the progress of the check in a JSON file\n");
+      /* argc is 0 if an option or its value was bad. */
+      return(argc == 0 ? FSCK_EXIT_USAGE : 0);
+  }
+
+  devlist = argv;
+  ndevs = argc - 1;
+  if (directio && usemmap) {
+	fsprintf("%s: -d and -m don't go together\n", prog);
+	return(FSCK_EXIT_USAGE);
+  }
+#ifndef O_DIRECT
+  if (directio) {
+	fsprintf("warning: no O_DIRECT here, reading through the page cache\n");
+	directio = 0;
+  }
+#endif
+  if (rollfile != NULL) {
+	if (ndevs > 1) {
+		fsprintf("%s: --rollback takes one device\n", prog);
+		return(FSCK_EXIT_USAGE);
+	}
+	return(rollback(rollfile, devlist[0]));
+  }
+  if (applyfile != NULL) {
+	if (ndevs > 1) {
+		fsprintf("%s: --apply takes one device\n", prog);
+		return(FSCK_EXIT_USAGE);
+	}
+	return(applypatch(applyfile, devlist[0]));
+  }
+  if (patchfile != NULL && (ndevs > 1 || undofile != NULL)) {
+	fsprintf("%s: -O takes one device, and no -U\n", prog);
+	return(FSCK_EXIT_USAGE);
+  }
+  if (jnlfile != NULL && ndevs > 1) {
+	fsprintf("%s: -j takes one device\n", prog);
+	return(FSCK_EXIT_USAGE);
+  }
+  if (ckptfile != NULL && (ndevs > 1 || jnlfile != NULL || patchfile != NULL)) {
+	fsprintf("%s: -K takes one device, and no -j or -O\n", prog);
+	return(FSCK_EXIT_USAGE);
+  }
+  if (undofile != NULL && ndevs > 1) {
+	fsprintf("%s: -U takes one device\n", prog);
+	return(FSCK_EXIT_USAGE);
+  }
+  if (triagepct > 0 && (jnlfile != NULL || ckptfile != NULL)) {
+	fsprintf("%s: -T takes no -j or -K\n", prog);
+	return(FSCK_EXIT_USAGE);
+  }
+  if (triagesecs > 0 && triagepct == 0) {
+	fsprintf("%s: -b takes -T\n", prog);
+	return(FSCK_EXIT_USAGE);
+  }
+  if (triagesecs == 0) triagesecs = TRIAGE_SECS;
+  if (scope != NULL && (jnlfile != NULL || ckptfile != NULL || triagepct > 0)) {
+	fsprintf("%s: -r takes no -j, -K or -T\n", prog);
+	return(FSCK_EXIT_USAGE);
+  }
+  if (nparallel > ndevs) nparallel = ndevs;
+  if (nparallel > 1 && triagepct == 0) {
+	/* Checks running at once can't share the terminal for questions. */
+	for (i = 0; i < NR_RCLASS; i++)
+		if (policy[i] == P_ASK ||
+		    (policy[i] == P_DEFAULT && (i == R_TIME || !automatic))) {
+			fsprintf("%s: -P needs a policy for the %s class\n",
+				 prog, rclassname[i]);
+			return(FSCK_EXIT_USAGE);
+		}
+  }
+  if (automatic) repair = 1;
+  if (triagepct > 0) {
+	/* A sample is only looked at; nothing may ask or be repaired. */
+	repair = automatic = 0;
+	if (policy[R_TIME] == P_DEFAULT) policy[R_TIME] = P_NO;
+	if ((nullout = fopen("/dev/null", "w")) == NULL) {
+		perror("/dev/null");
+		return(FSCK_EXIT_CHECK_FAILED);
+	}
   }
 
   sync();
-  chkdev(*argv, clist, ilist, zlist);
+  startpool();
+  progress = showprogress || statusfile != NULL;
+  if (progress && pthread_create(&progthread, NULL, progressloop, NULL) != 0)
+	fatal("couldn't start progress thread");
+  if (nparallel == 1)
+	chkthread(NULL);
+  else {
+	threads = (pthread_t *) alloc((unsigned) nparallel, sizeof(pthread_t));
+	for (i = 0; i < nparallel; i++)
+		if (pthread_create(&threads[i], NULL, chkthread, NULL) != 0)
+			fatal("couldn't start check thread");
+	for (i = 0; i < nparallel; i++) pthread_join(threads[i], NULL);
+	free((char *) threads);
+  }
+  if (progress) {
+	pthread_mutex_lock(&proglock);
+	progstop = 1;
+	pthread_cond_signal(&progcond);
+	pthread_mutex_unlock(&proglock);
+	pthread_join(progthread, NULL);
+	report(1);
+  }
+  stoppool();
   sync();
+  if (replog != NULL) fclose(replog);
+  if (statfile != NULL) {
+	fprintf(statfile, "%s]\n", nstats == 0 ? "" : "\n");
+	if (fclose(statfile) != 0) perror("statistics file");
+  }
 
-  return(0);
+  return(exitstatus);
 }